@@ -1,161 +1,3001 @@
 #pragma once
 
-#include <functional>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
 #include <tuple>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+#ifdef ASYNC_ALLOCATION_STATS
+#include <mutex>
+#endif
+
+#ifdef ASYNC_CHAIN_REGISTRY
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#endif
+
+#ifdef ASYNC_TRACING
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+#endif
+
+// Defined when the header is built without exceptions; errors then flow only through the
+// error channel.
+#if !defined(ASYNC_NO_EXCEPTIONS) && !defined(__cpp_exceptions) && !defined(__EXCEPTIONS) && !defined(_CPPUNWIND)
+#define ASYNC_NO_EXCEPTIONS
+#endif
+
+namespace async
+{
+
+    using error_type = std::exception_ptr;
+
+    // A lightweight error type for chains whose failures are frequent enough that exceptions
+    // cost too much. It is also an error_code enum, for chains reporting std::error_code.
+    enum class status : unsigned char
+    {
+        ok = 0,
+        failed,
+        cancelled,
+        timed_out
+    };
+
+    inline std::error_category const& status_category() noexcept {
+        struct category : std::error_category
+        {
+            char const* name() const noexcept override { return "async"; }
+
+            std::string message(int value) const override {
+                switch (static_cast<status>(value)) {
+                case status::ok: return "ok";
+                case status::failed: return "failed";
+                case status::cancelled: return "cancelled";
+                case status::timed_out: return "timed out";
+                }
+                return "unknown";
+            }
+        };
+        static category const instance;
+        return instance;
+    }
+
+    inline std::error_code make_error_code(status value) noexcept {
+        return std::error_code(static_cast<int>(value), status_category());
+    }
+
+    // What a chain needs from its error type: the value meaning success, whether a value is a
+    // failure, and what to report when a step throws. Specialise it to use another type.
+    template<typename Error>
+    struct error_traits;
+
+    template<>
+    struct error_traits<std::exception_ptr>
+    {
+        static std::exception_ptr success() noexcept { return nullptr; }
+        static bool failed(std::exception_ptr const& error) noexcept { return static_cast<bool>(error); }
+        static std::exception_ptr from_exception(std::exception_ptr error) noexcept { return error; }
+    };
+
+    template<>
+    struct error_traits<std::error_code>
+    {
+        static std::error_code success() noexcept { return std::error_code(); }
+        static bool failed(std::error_code const& error) noexcept { return static_cast<bool>(error); }
+
+        static std::error_code from_exception(std::exception_ptr error) noexcept {
+#ifndef ASYNC_NO_EXCEPTIONS
+            try {
+                std::rethrow_exception(error);
+            }
+            catch (std::system_error const& e) {
+                return e.code();
+            }
+            catch (...) {
+            }
+#else
+            (void)error;
+#endif
+            return make_error_code(status::failed);
+        }
+    };
+
+    template<>
+    struct error_traits<status>
+    {
+        static status success() noexcept { return status::ok; }
+        static bool failed(status error) noexcept { return error != status::ok; }
+        static status from_exception(std::exception_ptr) noexcept { return status::failed; }
+    };
+
+    // What the library has allocated on a thread. Counted only when ASYNC_ALLOCATION_STATS is
+    // defined, which must then be so in every translation unit; otherwise every count stays zero
+    // and counting compiles to nothing.
+    struct allocation_stats
+    {
+        std::size_t chains = 0;             // series and simple_series chains started
+        std::size_t frames = 0;             // frames of any kind constructed
+        std::size_t frame_bytes = 0;        // their pool size classes
+        std::size_t frame_frees = 0;        // frames destroyed; frames - frame_frees are live
+        std::size_t heap_allocations = 0;   // frames the pools had to take from operator new
+        std::size_t heap_bytes = 0;
+        std::size_t heap_frees = 0;         // frames the pools gave back, when full or at thread exit
+        std::size_t continuations = 0;      // continuations given a target; they hold it inline
+        std::size_t error_objects = 0;      // exception_ptrs captured from thrown exceptions
+
+        allocation_stats& operator+=(allocation_stats const& other) noexcept {
+            chains += other.chains;
+            frames += other.frames;
+            frame_bytes += other.frame_bytes;
+            frame_frees += other.frame_frees;
+            heap_allocations += other.heap_allocations;
+            heap_bytes += other.heap_bytes;
+            heap_frees += other.heap_frees;
+            continuations += other.continuations;
+            error_objects += other.error_objects;
+            return *this;
+        }
+
+        // The counts between two snapshots.
+        friend allocation_stats operator-(allocation_stats const& after, allocation_stats const& before) noexcept {
+            allocation_stats delta;
+            delta.chains = after.chains - before.chains;
+            delta.frames = after.frames - before.frames;
+            delta.frame_bytes = after.frame_bytes - before.frame_bytes;
+            delta.frame_frees = after.frame_frees - before.frame_frees;
+            delta.heap_allocations = after.heap_allocations - before.heap_allocations;
+            delta.heap_bytes = after.heap_bytes - before.heap_bytes;
+            delta.heap_frees = after.heap_frees - before.heap_frees;
+            delta.continuations = after.continuations - before.continuations;
+            delta.error_objects = after.error_objects - before.error_objects;
+            return delta;
+        }
+    };
+
+    namespace detail
+    {
+
+        constexpr std::size_t cache_line_size = 64;
+
+        enum class allocation_event { chain, frame, frame_free, heap_allocation, heap_free, continuation, error_object };
+
+#ifdef ASYNC_ALLOCATION_STATS
+        // One per thread, linked into a registry so that other threads can read it. Only the
+        // owning thread writes, so counting is a relaxed load and store.
+        class allocation_counters
+        {
+            std::atomic<std::size_t> chains{0};
+            std::atomic<std::size_t> frames{0};
+            std::atomic<std::size_t> frame_bytes{0};
+            std::atomic<std::size_t> frame_frees{0};
+            std::atomic<std::size_t> heap_allocations{0};
+            std::atomic<std::size_t> heap_bytes{0};
+            std::atomic<std::size_t> heap_frees{0};
+            std::atomic<std::size_t> continuations{0};
+            std::atomic<std::size_t> error_objects{0};
+
+            static void bump(std::atomic<std::size_t>& counter, std::size_t amount) noexcept {
+                counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+            }
+
+        public:
+            allocation_counters* previous = nullptr;
+            allocation_counters* next = nullptr;
+
+            allocation_counters();
+            ~allocation_counters();
+
+            allocation_counters(allocation_counters const&) = delete;
+            allocation_counters& operator=(allocation_counters const&) = delete;
+
+            void add(allocation_event event, std::size_t bytes) noexcept {
+                switch (event) {
+                case allocation_event::chain: bump(chains, 1); break;
+                case allocation_event::frame: bump(frames, 1); bump(frame_bytes, bytes); break;
+                case allocation_event::frame_free: bump(frame_frees, 1); break;
+                case allocation_event::heap_allocation: bump(heap_allocations, 1); bump(heap_bytes, bytes); break;
+                case allocation_event::heap_free: bump(heap_frees, 1); break;
+                case allocation_event::continuation: bump(continuations, 1); break;
+                case allocation_event::error_object: bump(error_objects, 1); break;
+                }
+            }
+
+            allocation_stats snapshot() const noexcept {
+                allocation_stats stats;
+                stats.chains = chains.load(std::memory_order_relaxed);
+                stats.frames = frames.load(std::memory_order_relaxed);
+                stats.frame_bytes = frame_bytes.load(std::memory_order_relaxed);
+                stats.frame_frees = frame_frees.load(std::memory_order_relaxed);
+                stats.heap_allocations = heap_allocations.load(std::memory_order_relaxed);
+                stats.heap_bytes = heap_bytes.load(std::memory_order_relaxed);
+                stats.heap_frees = heap_frees.load(std::memory_order_relaxed);
+                stats.continuations = continuations.load(std::memory_order_relaxed);
+                stats.error_objects = error_objects.load(std::memory_order_relaxed);
+                return stats;
+            }
+        };
+
+        // The live threads' counters, and what exited threads counted.
+        struct allocation_registry
+        {
+            std::mutex mutex;
+            allocation_counters* head = nullptr;
+            allocation_stats retired;
+
+            static allocation_registry& instance() {
+                static allocation_registry registry;
+                return registry;
+            }
+        };
+
+        inline allocation_counters::allocation_counters() {
+            auto& registry = allocation_registry::instance();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            next = registry.head;
+            if (next)
+                next->previous = this;
+            registry.head = this;
+        }
+
+        inline allocation_counters::~allocation_counters() {
+            auto& registry = allocation_registry::instance();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            if (previous)
+                previous->next = next;
+            else
+                registry.head = next;
+            if (next)
+                next->previous = previous;
+            registry.retired += snapshot();
+        }
+
+        inline allocation_counters& local_allocation_counters() {
+            static thread_local allocation_counters counters;
+            return counters;
+        }
+#endif
+
+        inline void count_allocation(allocation_event event, std::size_t bytes = 0) noexcept {
+#ifdef ASYNC_ALLOCATION_STATS
+            local_allocation_counters().add(event, bytes);
+#else
+            (void)event;
+            (void)bytes;
+#endif
+        }
+
+    }
+
+    // The calling thread's counts.
+    inline allocation_stats this_thread_allocation_stats() noexcept {
+#ifdef ASYNC_ALLOCATION_STATS
+        return detail::local_allocation_counters().snapshot();
+#else
+        return allocation_stats();
+#endif
+    }
+
+    // The counts of every thread, those that have exited included; safe to call from any thread.
+    inline allocation_stats total_allocation_stats() {
+        allocation_stats total;
+#ifdef ASYNC_ALLOCATION_STATS
+        auto& registry = detail::allocation_registry::instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        total = registry.retired;
+        for (auto* counters = registry.head; counters; counters = counters->next)
+            total += counters->snapshot();
+#endif
+        return total;
+    }
+
+#ifdef ASYNC_TRACING
+
+#ifndef ASYNC_TRACE_RING_SIZE
+#define ASYNC_TRACE_RING_SIZE 4096
+#endif
+
+    // One step of a chain as recorded by tracing: the thread that invoked it, and when it was
+    // invoked and completed, in trace clock ticks.
+    struct trace_record
+    {
+        std::uint64_t chain;
+        std::uint32_t step;
+        std::uint32_t thread;
+        std::uint64_t start;
+        std::uint64_t end;
+    };
+
+    namespace detail
+    {
+
+        // The time stamp counter where there is one, steady_clock nanoseconds elsewhere.
+        inline std::uint64_t trace_clock() noexcept {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+            return __rdtsc();
+#else
+            return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()
+            ).count());
+#endif
+        }
+
+        inline double trace_ticks_per_microsecond() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+            static double const ticks = [] {
+                auto clock_start = std::chrono::steady_clock::now();
+                std::uint64_t ticks_start = trace_clock();
+                while (std::chrono::steady_clock::now() - clock_start < std::chrono::milliseconds(10));
+                std::uint64_t ticks_end = trace_clock();
+                auto elapsed = std::chrono::steady_clock::now() - clock_start;
+                return double(ticks_end - ticks_start) / std::chrono::duration<double, std::micro>(elapsed).count();
+            }();
+            return ticks;
+#else
+            return 1000.0;
+#endif
+        }
+
+        // A thread's last ASYNC_TRACE_RING_SIZE steps. Only the owning thread writes; readers
+        // drop the slots that may have been overwritten while they copied.
+        class trace_ring
+        {
+            static constexpr std::size_t size = ASYNC_TRACE_RING_SIZE;
+            static_assert(size > 0 && (size & (size - 1)) == 0, "ASYNC_TRACE_RING_SIZE must be a power of two");
+
+            struct slot
+            {
+                std::atomic<std::uint64_t> chain;
+                std::atomic<std::uint64_t> start;
+                std::atomic<std::uint64_t> end;
+                std::atomic<std::uint32_t> step;
+                std::atomic<std::uint32_t> thread;
+            };
+
+            slot slots[size];
+            std::atomic<std::uint64_t> written{0};
+
+        public:
+            // Rings are never freed: a thread that exits releases its ring to the next new thread.
+            std::atomic<bool> owned{true};
+            trace_ring* next = nullptr;
+
+            void push(trace_record const& record) noexcept {
+                std::uint64_t n = written.load(std::memory_order_relaxed);
+                slot& s = slots[n & (size - 1)];
+                s.chain.store(record.chain, std::memory_order_relaxed);
+                s.start.store(record.start, std::memory_order_relaxed);
+                s.end.store(record.end, std::memory_order_relaxed);
+                s.step.store(record.step, std::memory_order_relaxed);
+                s.thread.store(record.thread, std::memory_order_relaxed);
+                written.store(n + 1, std::memory_order_release);
+            }
+
+            void copy_to(std::vector<trace_record>& records) const {
+                std::uint64_t last = written.load(std::memory_order_acquire);
+                std::uint64_t first = last > size ? last - size : 0;
+                std::size_t copied = records.size();
+                for (std::uint64_t i = first; i < last; i++) {
+                    slot const& s = slots[i & (size - 1)];
+                    records.push_back({
+                        s.chain.load(std::memory_order_relaxed),
+                        s.step.load(std::memory_order_relaxed),
+                        s.thread.load(std::memory_order_relaxed),
+                        s.start.load(std::memory_order_relaxed),
+                        s.end.load(std::memory_order_relaxed)
+                    });
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                std::uint64_t now = written.load(std::memory_order_relaxed);
+                // The slot of index now - size may be half-written by the push in progress.
+                if (now + 1 > first + size) {
+                    std::uint64_t torn = std::min(now + 1 - size, last) - first;
+                    records.erase(records.begin() + copied, records.begin() + copied + torn);
+                }
+            }
+        };
+
+        struct trace_registry
+        {
+            std::atomic<trace_ring*> rings{nullptr};
+            std::atomic<std::uint32_t> threads{0};
+            std::atomic<std::uint64_t> chains{0};
+
+            static trace_registry& instance() {
+                static trace_registry registry;
+                return registry;
+            }
+
+            trace_ring* claim_ring() {
+                for (trace_ring* ring = rings.load(std::memory_order_acquire); ring; ring = ring->next) {
+                    bool owned = false;
+                    if (ring->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+                        return ring;
+                }
+                trace_ring* ring = new trace_ring();
+                ring->next = rings.load(std::memory_order_relaxed);
+                while (!rings.compare_exchange_weak(ring->next, ring, std::memory_order_release, std::memory_order_relaxed));
+                return ring;
+            }
+        };
+
+        class trace_thread
+        {
+        public:
+            trace_ring* const ring;
+            std::uint32_t const id;
+
+            trace_thread()
+            : ring(trace_registry::instance().claim_ring()),
+              id(trace_registry::instance().threads.fetch_add(1, std::memory_order_relaxed) + 1)
+            {}
+
+            ~trace_thread() { ring->owned.store(false, std::memory_order_release); }
+
+            trace_thread(trace_thread const&) = delete;
+            trace_thread& operator=(trace_thread const&) = delete;
+
+            static trace_thread& local() {
+                static thread_local trace_thread thread;
+                return thread;
+            }
+        };
+
+    }
+
+    // The steps recorded in every thread's ring, exited threads' included, by start time.
+    inline std::vector<trace_record> trace_records() {
+        std::vector<trace_record> records;
+        for (auto* ring = detail::trace_registry::instance().rings.load(std::memory_order_acquire); ring; ring = ring->next)
+            ring->copy_to(records);
+        std::sort(records.begin(), records.end(), [] (trace_record const& a, trace_record const& b) {
+            return a.start < b.start;
+        });
+        return records;
+    }
+
+    // Writes trace_records() as Chrome trace-event JSON, for chrome://tracing or Perfetto: one
+    // complete event per step, on the thread that invoked it.
+    inline void write_chrome_trace(std::ostream& out) {
+        auto records = trace_records();
+        double ticks_per_microsecond = detail::trace_ticks_per_microsecond();
+        std::uint64_t origin = records.empty() ? 0 : records.front().start;
+        out << "{\"traceEvents\":[";
+        char const* separator = "\n";
+        for (auto const& record : records) {
+            double start = double(record.start - origin) / ticks_per_microsecond;
+            double duration = record.end > record.start ? double(record.end - record.start) / ticks_per_microsecond : 0.0;
+            out << separator
+                << "{\"name\":\"step " << record.step << "\",\"cat\":\"async\",\"ph\":\"X\""
+                << ",\"ts\":" << start << ",\"dur\":" << duration
+                << ",\"pid\":1,\"tid\":" << record.thread
+                << ",\"args\":{\"chain\":" << record.chain << ",\"step\":" << record.step << "}}";
+            separator = ",\n";
+        }
+        out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    }
+
+#endif
+
+#ifdef ASYNC_CHAIN_REGISTRY
+
+#ifndef ASYNC_CHAIN_REGISTRY_SHARDS
+#define ASYNC_CHAIN_REGISTRY_SHARDS 16
+#endif
+
+    // A series or simple_series chain that has started and not yet reached its final handler.
+    struct outstanding_chain
+    {
+        std::uint64_t id;
+        std::size_t step;                   // the step it is waiting on
+        std::size_t step_count;
+        std::chrono::nanoseconds age;       // since a scan of the registry first saw it
+        std::chrono::nanoseconds at_step;   // since a scan first saw it at step
+    };
+
+    namespace detail
+    {
+
+        // Links a chain into the registry. Chains only write step and read no clock; the times
+        // are taken by scans, under their shard's lock.
+        struct chain_registry_node
+        {
+            chain_registry_node* previous = nullptr;
+            chain_registry_node* next = nullptr;
+            std::size_t shard = 0;
+            bool registered = false;
+            std::uint64_t id = 0;
+            std::size_t step_count = 0;
+            std::atomic<std::size_t> step{0};
+
+            std::uint64_t first_seen_at = 0;
+            std::size_t seen_step = 0;
+            std::uint64_t seen_at = 0;
+            std::size_t reported_step = 0;  // one past the step last reported stuck, if any
+        };
+
+        inline std::uint64_t registry_clock() noexcept {
+            return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()
+            ).count());
+        }
+
+        // The outstanding chains, in lists sharded by the thread that started them, so that
+        // threads starting chains rarely contend for a lock.
+        class chain_registry
+        {
+            struct alignas(cache_line_size) shard_type
+            {
+                std::mutex mutex;
+                chain_registry_node* head = nullptr;
+                std::uint64_t added = 0;
+            };
+
+            shard_type shards[ASYNC_CHAIN_REGISTRY_SHARDS];
+            std::atomic<std::size_t> next_shard{0};
+
+        public:
+            static chain_registry& instance() {
+                static chain_registry registry;
+                return registry;
+            }
+
+            void add(chain_registry_node& node, std::size_t step_count) {
+                static thread_local std::size_t const local_shard =
+                    next_shard.fetch_add(1, std::memory_order_relaxed) % ASYNC_CHAIN_REGISTRY_SHARDS;
+                node.step_count = step_count;
+                node.shard = local_shard;
+                auto& shard = shards[local_shard];
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                node.id = ++shard.added * ASYNC_CHAIN_REGISTRY_SHARDS + local_shard;
+                node.next = shard.head;
+                if (node.next)
+                    node.next->previous = &node;
+                shard.head = &node;
+                node.registered = true;
+            }
+
+            void remove(chain_registry_node& node) {
+                auto& shard = shards[node.shard];
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                if (node.previous)
+                    node.previous->next = node.next;
+                else
+                    shard.head = node.next;
+                if (node.next)
+                    node.next->previous = node.previous;
+            }
+
+            // Calls visit(node, chain) for every outstanding chain, with its shard locked, after
+            // updating when the chain was first seen at its current step.
+            template<typename Visit>
+            void scan(Visit&& visit) {
+                for (auto& shard : shards) {
+                    std::lock_guard<std::mutex> lock(shard.mutex);
+                    std::uint64_t now = registry_clock();
+                    for (auto* node = shard.head; node; node = node->next) {
+                        std::size_t step = node->step.load(std::memory_order_relaxed);
+                        if (node->first_seen_at == 0) {
+                            node->first_seen_at = now;
+                            node->seen_step = step;
+                            node->seen_at = now;
+                        }
+                        else if (step != node->seen_step) {
+                            node->seen_step = step;
+                            node->seen_at = now;
+                        }
+                        visit(*node, outstanding_chain{
+                            node->id, step, node->step_count,
+                            std::chrono::nanoseconds(now - node->first_seen_at),
+                            std::chrono::nanoseconds(now - node->seen_at)
+                        });
+                    }
+                }
+            }
+        };
+
+    }
+
+    // Every outstanding chain. Times are measured from the first scan, this or a watchdog's, that
+    // saw the chain or its step, so they are under-reported by up to the time between scans.
+    inline std::vector<outstanding_chain> outstanding_chains() {
+        std::vector<outstanding_chain> chains;
+        detail::chain_registry::instance().scan([&] (detail::chain_registry_node&, outstanding_chain const& chain) {
+            chains.push_back(chain);
+        });
+        return chains;
+    }
+
+    // Scans the registry every period on a thread of its own, and reports each chain that has
+    // waited on the same step for at least threshold, once per step.
+    class chain_watchdog
+    {
+    public:
+        typedef std::function<void(outstanding_chain const&)> report_type;
+
+        chain_watchdog(std::chrono::nanoseconds threshold, std::chrono::nanoseconds period, report_type report)
+        : threshold(threshold), period(period), report(std::move(report)), stopping(false),
+          thread([this] { watch(); })
+        {}
+
+        ~chain_watchdog() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            thread.join();
+        }
+
+        chain_watchdog(chain_watchdog const&) = delete;
+        chain_watchdog& operator=(chain_watchdog const&) = delete;
+
+        // One scan, as the watchdog's thread runs every period. Reports are made with no lock
+        // held, so they may start chains of their own.
+        void check() {
+            std::vector<outstanding_chain> stuck;
+            detail::chain_registry::instance().scan([&] (detail::chain_registry_node& node, outstanding_chain const& chain) {
+                if (chain.at_step >= threshold && node.reported_step != chain.step + 1) {
+                    node.reported_step = chain.step + 1;
+                    stuck.push_back(chain);
+                }
+            });
+            for (auto const& chain : stuck)
+                report(chain);
+        }
+
+    private:
+        std::chrono::nanoseconds threshold;
+        std::chrono::nanoseconds period;
+        report_type report;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping;
+        std::thread thread;
+
+        void watch() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!wake.wait_for(lock, period, [this] { return stopping; })) {
+                lock.unlock();
+                check();
+                lock.lock();
+            }
+        }
+    };
+
+#endif
+
+#ifndef ASYNC_CALLBACK_INLINE_SIZE
+#define ASYNC_CALLBACK_INLINE_SIZE (4 * sizeof(void*))
+#endif
+
+    template<
+        typename Signature,
+        std::size_t InlineSize = ASYNC_CALLBACK_INLINE_SIZE
+    >
+    class continuation;
+
+    // Move-only, never-allocating replacement for std::function. The target
+    // must fit in InlineSize bytes; raise the size if a bigger one is needed.
+    template<
+        typename Error,
+        typename ... Args,
+        std::size_t InlineSize
+    >
+    class continuation<void(Error, Args...), InlineSize>
+    {
+        struct vtable {
+            void (*invoke)(void* target, Error&& error, Args&& ... args);
+            void (*relocate)(void* from, void* to) noexcept;
+            void (*destroy)(void* target) noexcept;
+        };
+
+        template<typename F>
+        static constexpr vtable vtable_for = {
+            [] (void* target, Error&& error, Args&& ... args) {
+                (*static_cast<F*>(target))(std::forward<Error>(error), std::forward<Args>(args)...);
+            },
+            [] (void* from, void* to) noexcept {
+                new (to) F(std::move(*static_cast<F*>(from)));
+                static_cast<F*>(from)->~F();
+            },
+            [] (void* target) noexcept {
+                static_cast<F*>(target)->~F();
+            }
+        };
+
+        alignas(std::max_align_t) mutable unsigned char storage[InlineSize];
+        vtable const* table;
+
+    public:
+        typedef Error error_type;
+        static constexpr std::size_t inline_size = InlineSize;
+
+        continuation() noexcept : table(nullptr) {}
+        continuation(std::nullptr_t) noexcept : table(nullptr) {}
+
+        template<
+            typename F,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, continuation> &&
+                std::is_invocable_v<std::decay_t<F>&, Error, Args...>
+            >
+        >
+        continuation(F&& f) : table(&vtable_for<std::decay_t<F>>) {
+            using target_t = std::decay_t<F>;
+            static_assert(sizeof(target_t) <= InlineSize,
+                "callable does not fit in the continuation's inline buffer");
+            static_assert(alignof(target_t) <= alignof(std::max_align_t),
+                "callable is over-aligned for the continuation's inline buffer");
+            static_assert(std::is_nothrow_move_constructible_v<target_t>,
+                "callable must be nothrow move constructible");
+            new (storage) target_t(std::forward<F>(f));
+            detail::count_allocation(detail::allocation_event::continuation);
+        }
+
+        continuation(continuation&& other) noexcept : table(other.table) {
+            if (table) {
+                table->relocate(other.storage, storage);
+                other.table = nullptr;
+            }
+        }
+
+        continuation& operator=(continuation&& other) noexcept {
+            if (this != &other) {
+                reset();
+                if (other.table) {
+                    other.table->relocate(other.storage, storage);
+                    table = other.table;
+                    other.table = nullptr;
+                }
+            }
+            return *this;
+        }
+
+        continuation(continuation const&) = delete;
+        continuation& operator=(continuation const&) = delete;
+
+        ~continuation() { reset(); }
+
+        void reset() noexcept {
+            if (table) {
+                table->destroy(storage);
+                table = nullptr;
+            }
+        }
+
+        explicit operator bool() const noexcept { return table != nullptr; }
+
+        void operator()(Error error, Args ... args) const {
+            table->invoke(storage, std::forward<Error>(error), std::forward<Args>(args)...);
+        }
+    };
+
+    template<typename Error, typename ... Args>
+    using basic_callback = continuation<void(Error, Args...)>;
+
+    template<typename ... Args>
+    using callback = basic_callback<error_type, Args...>;
+
+    // How a chain bound to an executor continues after a step completes: always on the
+    // completing thread, always through the executor, or inline until max_inline_steps
+    // steps have run back to back and then through the executor.
+    struct dispatch_policy
+    {
+        enum mode_type { inline_always, post_always, inline_bounded };
+
+        mode_type mode;
+        std::size_t max_inline_steps;
+
+        static constexpr dispatch_policy always_inline() { return { inline_always, 0 }; }
+        static constexpr dispatch_policy always_post() { return { post_always, 0 }; }
+        static constexpr dispatch_policy bounded(std::size_t max_inline_steps) { return { inline_bounded, max_inline_steps }; }
+    };
+
+    namespace detail
+    {
+
+        template<std::size_t Size, std::size_t Align>
+        class frame_pool
+        {
+            struct node { node* next; };
+
+            static constexpr bool over_aligned = Align > __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+            static void* raw_allocate() {
+                count_allocation(allocation_event::heap_allocation, Size);
+                if constexpr (over_aligned)
+                    return ::operator new(Size, std::align_val_t(Align));
+                else
+                    return ::operator new(Size);
+            }
+
+            static void raw_deallocate(void* p) {
+                count_allocation(allocation_event::heap_free);
+                if constexpr (over_aligned)
+                    ::operator delete(p, std::align_val_t(Align));
+                else
+                    ::operator delete(p);
+            }
+
+            static constexpr std::size_t max_cached = 64;
+
+            struct free_list {
+                node* head;
+                std::size_t count;
+                bool closed;
+            };
+
+            static free_list& local() {
+                static thread_local free_list list = { nullptr, 0, false };
+                return list;
+            }
+
+            // Frees the thread's cached frames at its exit. Made by the first frame the thread
+            // caches, which may have been allocated on another.
+            struct drain_guard {
+                drain_guard() noexcept {
+#ifdef ASYNC_ALLOCATION_STATS
+                    // The counters the drain counts into must outlive it.
+                    (void)local_allocation_counters();
+#endif
+                }
+
+                ~drain_guard() {
+                    auto& list = local();
+                    list.closed = true;
+                    while (list.head) {
+                        node* n = list.head;
+                        list.head = n->next;
+                        raw_deallocate(n);
+                    }
+                    list.count = 0;
+                }
+            };
+
+        public:
+            static void* allocate() {
+                auto& list = local();
+                if (list.head) {
+                    node* n = list.head;
+                    list.head = n->next;
+                    list.count--;
+                    return n;
+                }
+                return raw_allocate();
+            }
+
+            static void deallocate(void* p) {
+                auto& list = local();
+                if (list.closed || list.count >= max_cached) {
+                    raw_deallocate(p);
+                    return;
+                }
+                static thread_local drain_guard guard;
+                (void)guard;
+                list.head = new (p) node{ list.head };
+                list.count++;
+            }
+        };
+
+        constexpr std::size_t frame_size_class(std::size_t size) {
+            return (size + cache_line_size - 1) & ~(cache_line_size - 1);
+        }
+
+        template<typename Frame>
+        using frame_pool_for = frame_pool<
+            frame_size_class(sizeof(Frame)),
+            (alignof(Frame) > __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? alignof(Frame) : __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+        >;
+
+        // Calls invoke, handing anything it throws to on_exception. Calls that cannot throw, and
+        // builds without exceptions, get no landing pad.
+        template<bool NoThrow, typename Invoke, typename OnException>
+        inline void guarded_call(Invoke&& invoke, OnException&& on_exception) {
+#ifdef ASYNC_NO_EXCEPTIONS
+            (void)on_exception;
+            invoke();
+#else
+            if constexpr (NoThrow) {
+                invoke();
+            }
+            else {
+                try {
+                    invoke();
+                }
+                catch (...) {
+                    count_allocation(allocation_event::error_object);
+                    on_exception(std::current_exception());
+                }
+            }
+#endif
+        }
+
+        template<typename Frame, typename ... Args>
+        inline Frame* make_frame(Args&& ... args) {
+            using pool = frame_pool_for<Frame>;
+            void* memory = pool::allocate();
+            count_allocation(allocation_event::frame, frame_size_class(sizeof(Frame)));
+#ifndef ASYNC_NO_EXCEPTIONS
+            if constexpr (!std::is_nothrow_constructible_v<Frame, Args&&...>) {
+                try {
+                    return new (memory) Frame(std::forward<Args>(args)...);
+                }
+                catch (...) {
+                    count_allocation(allocation_event::frame_free);
+                    pool::deallocate(memory);
+                    throw;
+                }
+            }
+#endif
+            return new (memory) Frame(std::forward<Args>(args)...);
+        }
+
+        template<typename Frame>
+        inline void free_frame(Frame* frame) {
+            using pool = frame_pool_for<Frame>;
+            frame->~Frame();
+            count_allocation(allocation_event::frame_free);
+            pool::deallocate(frame);
+        }
+
+        // Marks an invocation on this thread's stack, so that a completion arriving before the
+        // invocation returns is handed back to the invoking loop instead of recursing into it.
+        class inline_slot
+        {
+            void const* owner;
+            std::size_t index;
+            bool done;
+            inline_slot* outer;
+
+            static inline_slot*& current() {
+                static thread_local inline_slot* slot = nullptr;
+                return slot;
+            }
+
+        public:
+            inline_slot(void const* owner, std::size_t index)
+            : owner(owner), index(index), done(false), outer(current())
+            {
+                current() = this;
+            }
+
+            ~inline_slot() { current() = outer; }
+
+            inline_slot(inline_slot const&) = delete;
+            inline_slot& operator=(inline_slot const&) = delete;
+
+            bool completed() const { return done; }
+
+            // True if the given invocation is the innermost one on this thread; it is then marked
+            // completed and its loop carries on. Otherwise the caller must carry on itself.
+            static bool complete(void const* owner, std::size_t index) {
+                inline_slot* slot = current();
+                if (slot && slot->owner == owner && slot->index == index) {
+                    slot->done = true;
+                    return true;
+                }
+                return false;
+            }
+        };
+
+        // The error a chain with errors of type Error reports for one of the library's own
+        // conditions: the status itself, its error_code, or a system_error holding that.
+        template<typename Error>
+        inline Error status_error(status value) {
+            if constexpr (std::is_same_v<Error, status>)
+                return value;
+            else if constexpr (std::is_same_v<Error, std::error_code>)
+                return make_error_code(value);
+            else {
+                count_allocation(allocation_event::error_object);
+                return error_traits<Error>::from_exception(std::make_exception_ptr(std::system_error(make_error_code(value))));
+            }
+        }
+
+        // A node of a stop state's callback list, embedded in the stop_callback it belongs to.
+        // next is written by the node's own add before it is published and otherwise only with
+        // the state locked. previous is also written by the add that pushes a node in front,
+        // just after its push, so whoever needs the previous of a node that is not first waits
+        // for that write.
+        class stop_callback_node
+        {
+            friend class stop_state;
+
+            std::atomic<stop_callback_node*> previous{nullptr};
+            stop_callback_node* next = nullptr;
+            bool linked = false;
+            // Set while the node runs, to tell its runner that it destroyed itself.
+            bool* destroyed = nullptr;
+            std::atomic<bool> done{false};
+            void (*run)(stop_callback_node* node) noexcept;
+
+        protected:
+            explicit stop_callback_node(void (*run)(stop_callback_node* node) noexcept) : run(run) {}
+        };
+
+        // Whether a stop has been requested, and the callbacks to run when it is. Reference
+        // counted by its sources and tokens and taken from the frame pools. Adding a callback
+        // is a compare-exchange onto the head of the list, which a stop swaps for a sentinel,
+        // so registration never waits and checking for a stop is a single load. Unlinking a
+        // callback, and popping them to run, take a spin bit instead: a lock-free doubly linked
+        // list with removal from the middle would cost every node more than the rare contention
+        // on the bit does. A state made for a child source also has a node in its parent's
+        // list, which stops it.
+        class stop_state
+        {
+            class parent_link
+            : public stop_callback_node
+            {
+            public:
+                stop_state* parent = nullptr;
+                stop_state* child;
+
+                explicit parent_link(stop_state* child) : stop_callback_node(&parent_link::stop_child), child(child) {}
+
+                static void stop_child(stop_callback_node* node) noexcept;
+            };
+
+            std::atomic<stop_callback_node*> head{nullptr};
+            std::atomic<bool> locked{false};
+            std::atomic<std::size_t> references{1};
+            // With the state locked: the callbacks a stop has yet to run, and the one it is running.
+            stop_callback_node* unrun = nullptr;
+            stop_callback_node* running = nullptr;
+            std::thread::id stopping_thread;
+            parent_link link;
+
+            // Never dereferenced: the head once a stop has been requested.
+            static stop_callback_node* stopped() noexcept {
+                return reinterpret_cast<stop_callback_node*>(alignof(stop_callback_node));
+            }
+
+            void lock() noexcept {
+                while (locked.exchange(true, std::memory_order_acquire))
+                    std::this_thread::yield();
+            }
+
+            void unlock() noexcept {
+                locked.store(false, std::memory_order_release);
+            }
+
+            static stop_callback_node* wait_for_previous(stop_callback_node* node) noexcept {
+                stop_callback_node* previous;
+                while (!(previous = node->previous.load(std::memory_order_acquire)))
+                    std::this_thread::yield();
+                return previous;
+            }
+
+            // With the state locked.
+            void unlink(stop_callback_node* node) noexcept {
+                stop_callback_node* next = node->next;
+                if (next)
+                    wait_for_previous(next);
+                stop_callback_node* previous = node->previous.load(std::memory_order_acquire);
+                if (!previous) {
+                    if (unrun == node) {
+                        unrun = next;
+                        if (next)
+                            next->previous.store(nullptr, std::memory_order_relaxed);
+                        return;
+                    }
+                    stop_callback_node* first = node;
+                    if (head.compare_exchange_strong(first, next, std::memory_order_acq_rel)) {
+                        // Unless an add has already pushed in front of next.
+                        if (next)
+                            next->previous.compare_exchange_strong(node, nullptr, std::memory_order_acq_rel);
+                        return;
+                    }
+                    // An add pushed in front of node and has yet to say so.
+                    previous = wait_for_previous(node);
+                }
+                previous->next = next;
+                if (next)
+                    next->previous.store(previous, std::memory_order_release);
+            }
+
+        public:
+            stop_state() noexcept : link(this) {}
+
+            // A state stopped when parent's is; parent is taken by the caller.
+            explicit stop_state(stop_state* parent) noexcept : link(this) {
+                link.parent = parent;
+                if (!parent->add(&link))
+                    request_stop();
+            }
+
+            stop_state(stop_state const&) = delete;
+            stop_state& operator=(stop_state const&) = delete;
+
+            bool stop_requested() const noexcept {
+                return head.load(std::memory_order_acquire) == stopped();
+            }
+
+            void acquire() noexcept {
+                references.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // Fails once the last reference has gone.
+            bool try_acquire() noexcept {
+                std::size_t count = references.load(std::memory_order_relaxed);
+                while (count > 0 && !references.compare_exchange_weak(count, count + 1, std::memory_order_relaxed));
+                return count > 0;
+            }
+
+            void release() noexcept {
+                if (references.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                    return;
+                if (stop_state* parent = link.parent) {
+                    parent->remove(&link);
+                    parent->release();
+                }
+                free_frame(this);
+            }
+
+            // Runs the callbacks on the calling thread, each with the list unlocked. True if this
+            // call made the request.
+            bool request_stop() noexcept {
+                lock();
+                stop_callback_node* first = head.exchange(stopped(), std::memory_order_acq_rel);
+                if (first == stopped()) {
+                    unlock();
+                    return false;
+                }
+                stopping_thread = std::this_thread::get_id();
+                unrun = first;
+                while (unrun) {
+                    stop_callback_node* node = unrun;
+                    unlink(node);
+                    node->linked = false;
+                    running = node;
+                    bool destroyed = false;
+                    node->destroyed = &destroyed;
+                    unlock();
+                    node->run(node);
+                    if (!destroyed) {
+                        node->destroyed = nullptr;
+                        node->done.store(true, std::memory_order_release);
+                    }
+                    lock();
+                    running = nullptr;
+                }
+                unlock();
+                return true;
+            }
+
+            // False if a stop has already been requested; the node is then not added.
+            bool add(stop_callback_node* node) noexcept {
+                node->linked = true;
+                node->previous.store(nullptr, std::memory_order_relaxed);
+                stop_callback_node* first = head.load(std::memory_order_acquire);
+                do {
+                    if (first == stopped()) {
+                        node->linked = false;
+                        return false;
+                    }
+                    node->next = first;
+                } while (!head.compare_exchange_weak(first, node, std::memory_order_acq_rel, std::memory_order_acquire));
+                if (first)
+                    first->previous.store(node, std::memory_order_release);
+                return true;
+            }
+
+            // Once this returns the node is not running and never will be, unless it is removing
+            // itself from inside its own callback.
+            void remove(stop_callback_node* node) noexcept {
+                lock();
+                if (node->linked) {
+                    unlink(node);
+                    node->linked = false;
+                    unlock();
+                    return;
+                }
+                bool is_running = running == node;
+                bool from_callback = is_running && stopping_thread == std::this_thread::get_id();
+                unlock();
+                if (from_callback)
+                    *node->destroyed = true;
+                else if (is_running)
+                    while (!node->done.load(std::memory_order_acquire))
+                        std::this_thread::yield();
+            }
+        };
+
+        // Holds a reference while the child stops, since its callbacks may drop every other one.
+        // If the last has already gone, whoever dropped it is waiting in remove for this to return,
+        // and the child needs no stopping.
+        inline void stop_state::parent_link::stop_child(stop_callback_node* node) noexcept {
+            stop_state* child = static_cast<parent_link*>(node)->child;
+            if (!child->try_acquire())
+                return;
+            child->request_stop();
+            child->release();
+        }
+
+    }
+
+    template<typename Callback>
+    class stop_callback;
+
+    // Tells an operation that its result is no longer wanted, so that it can stop early and
+    // release what it holds. Cheap to copy: a reference count on a shared state. A default
+    // constructed token is never stopped.
+    class stop_token
+    {
+        detail::stop_state* state;
+
+        template<typename Callback>
+        friend class stop_callback;
+        friend class stop_source;
+
+        explicit stop_token(detail::stop_state* state) noexcept : state(state) {
+            if (state)
+                state->acquire();
+        }
+
+    public:
+        constexpr stop_token() noexcept : state(nullptr) {}
+
+        stop_token(stop_token const& other) noexcept : stop_token(other.state) {}
+
+        stop_token(stop_token&& other) noexcept : state(other.state) {
+            other.state = nullptr;
+        }
+
+        stop_token& operator=(stop_token other) noexcept {
+            std::swap(state, other.state);
+            return *this;
+        }
+
+        ~stop_token() {
+            if (state)
+                state->release();
+        }
+
+        bool stop_requested() const noexcept { return state && state->stop_requested(); }
+        bool stop_possible() const noexcept { return state != nullptr; }
+    };
+
+    // Owns a stop state and requests the stop; tokens observe it.
+    class stop_source
+    {
+        detail::stop_state* state;
+
+        static detail::stop_state* child_of(detail::stop_state* parent) {
+            if (!parent)
+                return detail::make_frame<detail::stop_state>();
+            parent->acquire();
+            return detail::make_frame<detail::stop_state>(parent);
+        }
+
+    public:
+        stop_source() : state(detail::make_frame<detail::stop_state>()) {}
+
+        // A source that a stop of parent stops too, so that one request reaches a whole tree of
+        // operations while each subtree can still be stopped on its own. Stopped at once if
+        // parent already is; a default constructed parent never stops it.
+        explicit stop_source(stop_token const& parent) : state(child_of(parent.state)) {}
+
+        stop_source(stop_source const& other) noexcept : state(other.state) {
+            state->acquire();
+        }
+
+        stop_source& operator=(stop_source other) noexcept {
+            std::swap(state, other.state);
+            return *this;
+        }
+
+        ~stop_source() { state->release(); }
+
+        stop_token get_token() const noexcept { return stop_token(state); }
+
+        bool stop_requested() const noexcept { return state->stop_requested(); }
+
+        // Runs every registered callback on this thread before returning. True if this call made
+        // the request.
+        bool request_stop() noexcept { return state->request_stop(); }
+    };
+
+    // Calls callback once, when its token is stopped, or at once if it already is. After the
+    // destructor returns the callback is not running, and will not run. Callbacks must not throw.
+    template<typename Callback>
+    class stop_callback
+    : private detail::stop_callback_node
+    {
+        detail::stop_state* state;
+        Callback callback;
+
+        static void run_callback(detail::stop_callback_node* node) noexcept {
+            static_cast<stop_callback*>(node)->callback();
+        }
+
+    public:
+        template<typename C>
+        stop_callback(stop_token const& token, C&& c)
+        : detail::stop_callback_node(&stop_callback::run_callback), state(token.state), callback(std::forward<C>(c))
+        {
+            if (state) {
+                state->acquire();
+                if (!state->add(this))
+                    callback();
+            }
+        }
+
+        ~stop_callback() {
+            if (state) {
+                state->remove(this);
+                state->release();
+            }
+        }
+
+        stop_callback(stop_callback const&) = delete;
+        stop_callback& operator=(stop_callback const&) = delete;
+    };
+
+    template<typename Callback>
+    stop_callback(stop_token const&, Callback) -> stop_callback<Callback>;
+
+    namespace detail
+    {
+
+        // The token of a chain run without one.
+        inline stop_token const no_stop_token;
+
+    }
+
+    namespace detail
+    {
+
+        template<typename Executor, typename Function, typename = void>
+        struct has_adl_post : std::false_type {};
+
+        template<typename Executor, typename Function>
+        struct has_adl_post<Executor, Function, std::void_t<
+            decltype(post(std::declval<Executor&>(), std::declval<Function>()))
+        >> : std::true_type {};
+
+        // Anything post(executor, f) finds by ADL (Asio executors and execution contexts),
+        // or anything with a post(f) member.
+        template<typename Executor, typename Function>
+        inline void post_to(Executor& executor, Function&& function) {
+            if constexpr (has_adl_post<Executor, Function>::value)
+                post(executor, std::forward<Function>(function));
+            else
+                executor.post(std::forward<Function>(function));
+        }
+
+        struct inline_dispatcher
+        {
+            static constexpr bool should_post(std::size_t) { return false; }
+
+            template<typename Function>
+            void post(Function&&) {}
+        };
+
+        template<typename Executor>
+        class executor_dispatcher
+        {
+            Executor executor;
+            dispatch_policy policy;
+
+        public:
+            template<typename E>
+            executor_dispatcher(E&& executor, dispatch_policy policy)
+            : executor(std::forward<E>(executor)), policy(policy)
+            {}
+
+            bool should_post(std::size_t inline_steps) const {
+                switch (policy.mode) {
+                case dispatch_policy::post_always: return true;
+                case dispatch_policy::inline_bounded: return inline_steps > policy.max_inline_steps;
+                default: return false;
+                }
+            }
+
+            template<typename Function>
+            void post(Function&& function) {
+                post_to(executor, std::forward<Function>(function));
+            }
+        };
+
+        // Borrow lvalue executors (such as an io_context), copy everything else.
+        template<typename Executor>
+        using executor_dispatcher_for = executor_dispatcher<
+            std::conditional_t<std::is_lvalue_reference_v<Executor>, Executor, std::decay_t<Executor>>
+        >;
+
+        // The state of a chain that its steps' completions touch. It does not depend on the
+        // steps, so code generated for each step does not name the whole chain.
+        template<typename Error>
+        class chain_core
+        {
+        protected:
+            using error_traits_type = error_traits<Error>;
+
+            std::size_t cursor;
+            std::size_t step_count;
+            Error error;
+            void (*resume)(chain_core* core);
+#ifdef ASYNC_TRACING
+            std::uint64_t trace_chain;
+            std::uint64_t trace_start;
+            std::uint32_t trace_thread_id;
+#endif
+#ifdef ASYNC_CHAIN_REGISTRY
+            chain_registry_node registry_node;
+#endif
+
+            chain_core(std::size_t step_count, void (*resume)(chain_core* core))
+            : cursor(0), step_count(step_count), error(error_traits_type::success()), resume(resume)
+            {
+#ifdef ASYNC_TRACING
+                trace_chain = trace_registry::instance().chains.fetch_add(1, std::memory_order_relaxed) + 1;
+#endif
+            }
+
+#ifdef ASYNC_CHAIN_REGISTRY
+            ~chain_core() {
+                if (registry_node.registered)
+                    chain_registry::instance().remove(registry_node);
+            }
+#endif
+
+            // Lists the chain among the outstanding ones, once its steps are known.
+            void watch_started() {
+#ifdef ASYNC_CHAIN_REGISTRY
+                chain_registry::instance().add(registry_node, step_count);
+#endif
+            }
+
+            void watch_step_started() noexcept {
+#ifdef ASYNC_CHAIN_REGISTRY
+                registry_node.step.store(cursor, std::memory_order_relaxed);
+#endif
+            }
+
+            void trace_step_started() noexcept {
+#ifdef ASYNC_TRACING
+                trace_thread_id = trace_thread::local().id;
+                trace_start = trace_clock();
+#endif
+            }
+
+            // Recorded in the ring of the thread the step completes on.
+            void trace_step_finished() noexcept {
+#ifdef ASYNC_TRACING
+                trace_thread::local().ring->push({
+                    trace_chain, static_cast<std::uint32_t>(cursor), trace_thread_id, trace_start, trace_clock()
+                });
+#endif
+            }
+
+        public:
+            // Records the outcome of the current step. A step that completes while it is still
+            // on the stack is picked up by the loop in run(); a later completion resumes it here.
+            void advance(Error step_error) {
+                trace_step_finished();
+                if (error_traits_type::failed(step_error)) {
+                    error = std::move(step_error);
+                    cursor = step_count;
+                }
+                else {
+                    cursor++;
+                }
+                if (!inline_slot::complete(this, 0))
+                    resume(this);
+            }
+
+            // Called when the current step throws. A step that throws must not call next afterwards.
+            void fail(std::exception_ptr exception) {
+                trace_step_finished();
+                error = error_traits_type::from_exception(std::move(exception));
+                cursor = step_count;
+                inline_slot::complete(this, 0);
+            }
+
+            // Ends a stopped chain instead of starting its current step.
+            void cancel() {
+                error = status_error<Error>(status::cancelled);
+                cursor = step_count;
+            }
+        };
+
+        template<typename Derived, typename Dispatcher, typename Error>
+        class chain_frame
+        : public chain_core<Error>, private Dispatcher
+        {
+            using core = chain_core<Error>;
+
+        protected:
+            chain_frame(std::size_t step_count, Dispatcher&& dispatcher)
+            : core(step_count, &chain_frame::resume_chain), Dispatcher(std::move(dispatcher))
+            {}
+
+            // Called as each step is invoked and once it has completed. A Derived that observes its
+            // steps declares its own.
+            void step_started() noexcept {}
+            void step_finished() noexcept {}
+
+            // Checked before each step; a Derived that can be stopped declares its own, and
+            // skip_step to destroy what the skipped step would have consumed.
+            static constexpr bool stop_requested() noexcept { return false; }
+            void skip_step() noexcept {}
+
+            template<bool NoThrow, typename Invoke>
+            void invoke_guarded(Invoke&& invoke) {
+                guarded_call<NoThrow>(std::forward<Invoke>(invoke), [this] (std::exception_ptr exception) {
+                    this->fail(std::move(exception));
+                });
+            }
+
+        public:
+            void start() {
+                count_allocation(allocation_event::chain);
+                this->watch_started();
+                run(0);
+            }
+
+        private:
+            static void resume_chain(core* chain) {
+                auto* frame = static_cast<chain_frame*>(chain);
+                static_cast<Derived*>(frame)->step_finished();
+                frame->run(1);
+            }
+
+            // inline_steps counts the steps that have completed back to back on this thread.
+            void run(std::size_t inline_steps) {
+                auto& self = static_cast<Derived&>(*this);
+                for (;;) {
+                    if (inline_steps > 0 && Dispatcher::should_post(inline_steps)) {
+                        Dispatcher::post([this] () { run(0); });
+                        return;
+                    }
+                    if (this->cursor >= this->step_count)
+                        break;
+                    if (self.stop_requested()) {
+                        self.skip_step();
+                        this->cancel();
+                        break;
+                    }
+                    inline_slot slot(static_cast<core*>(this), 0);
+                    this->watch_step_started();
+                    this->trace_step_started();
+                    self.step_started();
+                    self.invoke_step();
+                    // Otherwise the step completes later, possibly on another thread that already owns
+                    // the frame, so it must not be touched again here.
+                    if (!slot.completed())
+                        return;
+                    self.step_finished();
+                    inline_steps++;
+                }
+                self.finish();
+            }
+        };
+
+        template<std::size_t I, typename T>
+        struct indexed_type
+        {
+            typedef T type;
+        };
+
+        template<typename Indices, typename ... Ts>
+        struct indexed_types;
+
+        template<std::size_t ... Is, typename ... Ts>
+        struct indexed_types<std::index_sequence<Is...>, Ts...>
+        : indexed_type<Is, Ts>...
+        {};
+
+        template<std::size_t I, typename T>
+        indexed_type<I, T> select_indexed(indexed_type<I, T> const&);
+
+        // The I-th type of Ts, found by overload resolution against a flat set of bases so that
+        // long packs need no recursive instantiation.
+        template<std::size_t I, typename ... Ts>
+        using nth_type_t = typename decltype(
+            select_indexed<I>(indexed_types<std::index_sequence_for<Ts...>, Ts...>())
+        )::type;
+
+        template<typename ... Ts>
+        using last_type_t = nth_type_t<sizeof...(Ts) - 1, Ts...>;
+
+        template<std::size_t I, typename T>
+        struct indexed_value
+        {
+            T value;
+        };
+
+        // The steps of a chain. Like a tuple, but each element is a direct base, so construction
+        // and access stay shallow for chains of hundreds of steps.
+        template<typename Indices, typename ... Ts>
+        class step_storage;
+
+        template<std::size_t ... Is, typename ... Ts>
+        class step_storage<std::index_sequence<Is...>, Ts...>
+        : public indexed_value<Is, Ts>...
+        {
+        public:
+            static constexpr std::size_t size = sizeof...(Ts);
+
+            template<std::size_t I>
+            using type = nth_type_t<I, Ts...>;
+
+            template<typename ... Args>
+            explicit step_storage(std::in_place_t, Args&& ... args)
+            : indexed_value<Is, Ts>{ std::forward<Args>(args) }...
+            {}
+
+            template<std::size_t I>
+            type<I>& get() {
+                return static_cast<indexed_value<I, type<I>>&>(*this).value;
+            }
+
+            template<std::size_t I>
+            type<I> const& get() const {
+                return static_cast<indexed_value<I, type<I>> const&>(*this).value;
+            }
+        };
+
+        template<typename ... Ts>
+        using step_storage_for = step_storage<std::index_sequence_for<Ts...>, Ts...>;
+
+        template<typename Frame, typename Error>
+        class simple_series_next
+        {
+            Frame* frame;
+        public:
+            explicit simple_series_next(Frame* frame) : frame(frame) {}
+            void operator()(Error error) const { frame->resume(std::move(error)); }
+        };
+
+        template<typename Dispatcher, typename Error, typename ... Handlers>
+        class simple_series_frame
+        : public chain_frame<simple_series_frame<Dispatcher, Error, Handlers...>, Dispatcher, Error>
+        {
+            using base = chain_frame<simple_series_frame, Dispatcher, Error>;
+            friend base;
+
+            using next_type = simple_series_next<simple_series_frame, Error>;
+            static_assert(std::is_trivially_copyable_v<next_type>);
+
+            static constexpr std::size_t last = sizeof...(Handlers) - 1;
+
+            step_storage_for<Handlers...> handlers;
+
+        public:
+            template<typename ... Args>
+            explicit simple_series_frame(Dispatcher dispatcher, Args&& ... args)
+            : base(last, std::move(dispatcher)), handlers(std::in_place, std::forward<Args>(args)...)
+            {}
+
+            void resume(Error error) {
+                this->advance(std::move(error));
+            }
+
+        private:
+            void invoke_step() {
+                static constexpr auto steps = step_table(std::make_index_sequence<last>());
+                (this->*steps[this->cursor])();
+            }
+
+            template<std::size_t ... Is>
+            static constexpr auto step_table(std::index_sequence<Is...>) {
+                return std::array<void (simple_series_frame::*)(), sizeof...(Is)>{
+                    &simple_series_frame::invoke_step<Is>...
+                };
+            }
+
+            template<std::size_t I>
+            void invoke_step() {
+                auto& handler = handlers.template get<I>();
+                this->template invoke_guarded<noexcept(handler(next_type(this)))>([&] {
+                    handler(next_type(this));
+                });
+            }
+
+            void finish() {
+                auto final_handler = std::move(handlers.template get<last>());
+                auto error = std::move(this->error);
+                free_frame(this);
+                final_handler(std::move(error));
+            }
+        };
+
+        template<typename Dispatcher, typename Error, typename Range, typename FinalHandler>
+        class simple_series_range_frame
+        : public chain_frame<simple_series_range_frame<Dispatcher, Error, Range, FinalHandler>, Dispatcher, Error>
+        {
+            using base = chain_frame<simple_series_range_frame, Dispatcher, Error>;
+            friend base;
+
+            using next_type = simple_series_next<simple_series_range_frame, Error>;
+            static_assert(std::is_trivially_copyable_v<next_type>);
+
+            Range handlers;
+            FinalHandler final_handler;
+            decltype(std::begin(std::declval<Range&>())) current;
+
+        public:
+            template<typename R, typename F>
+            simple_series_range_frame(Dispatcher dispatcher, R&& range, F&& final)
+            : base(0, std::move(dispatcher)), handlers(std::forward<R>(range)), final_handler(std::forward<F>(final)),
+              current(std::begin(handlers))
+            {
+                this->step_count = static_cast<std::size_t>(std::distance(current, std::end(handlers)));
+            }
+
+            void resume(Error error) {
+                ++current;
+                this->advance(std::move(error));
+            }
+
+        private:
+            void invoke_step() {
+                auto& handler = *current;
+                this->template invoke_guarded<noexcept(handler(next_type(this)))>([&] {
+                    handler(next_type(this));
+                });
+            }
+
+            void finish() {
+                auto handler = std::move(final_handler);
+                auto error = std::move(this->error);
+                free_frame(this);
+                handler(std::move(error));
+            }
+        };
+
+        template<typename T>
+        struct function_traits 
+        : public function_traits<decltype(&T::operator())>
+        {};
+
+        template<typename F, typename R, typename ... Args>
+        struct function_traits<R(F::*)(Args...) const>
+        {
+            static constexpr size_t arity = sizeof...(Args);
+            typedef std::tuple<Args...> argument_tuple;
+        };
+
+        template<typename F, typename R, typename ... Args>
+        struct function_traits<R(F::*)(Args...)>
+        : public function_traits<R(F::*)(Args...) const>
+        {};
+
+        template<typename F, typename R, typename ... Args>
+        struct function_traits<R(F::*)(Args...) const noexcept>
+        : public function_traits<R(F::*)(Args...) const>
+        {};
+
+        template<typename F, typename R, typename ... Args>
+        struct function_traits<R(F::*)(Args...) noexcept>
+        : public function_traits<R(F::*)(Args...) const>
+        {};
+
+        template<typename Tuple, typename Indices>
+        struct tuple_head_impl;
+
+        template<typename Tuple, size_t ... Is>
+        struct tuple_head_impl<Tuple, std::index_sequence<Is...>>
+        {
+            typedef std::tuple<std::tuple_element_t<Is, Tuple>...> type;
+        };
+
+        // The first N element types of Tuple.
+        template<typename Tuple, size_t N>
+        using tuple_head_t = typename tuple_head_impl<Tuple, std::make_index_sequence<N>>::type;
+
+        template<typename Tuple>
+        struct decay_tuple;
+
+        template<typename ... Ts>
+        struct decay_tuple<std::tuple<Ts...>>
+        {
+            typedef std::tuple<std::decay_t<Ts>...> type;
+        };
+
+        template<typename Callback>
+        struct callback_traits;
+
+        template<typename Error, typename ... Args, std::size_t InlineSize>
+        struct callback_traits<continuation<void(Error, Args...), InlineSize>>
+        {
+            typedef Error error_type;
+            typedef std::tuple<Args...> argument_tuple;
+        };
+
+        // The callback a step takes as its last parameter.
+        template<typename Function>
+        using step_callback_t = std::decay_t<std::tuple_element_t<
+            function_traits<Function>::arity - 1,
+            typename function_traits<Function>::argument_tuple
+        >>;
+
+        template<typename Function, size_t Arity = function_traits<Function>::arity, typename = void>
+        struct takes_stop_token : std::false_type {};
+
+        template<typename Function, size_t Arity>
+        struct takes_stop_token<Function, Arity, std::enable_if_t<(Arity >= 2)>>
+        : std::is_same<std::decay_t<std::tuple_element_t<Arity - 2, typename function_traits<Function>::argument_tuple>>, stop_token>
+        {};
+
+        // Whether a step takes a stop_token just ahead of its callback, to be given its chain's.
+        template<typename Function>
+        constexpr bool takes_stop_token_v = takes_stop_token<Function>::value;
+
+        // What a step takes ahead of its callback and any stop_token, as it declares them.
+        template<typename Function>
+        using step_declared_args_t = tuple_head_t<
+            typename function_traits<Function>::argument_tuple,
+            function_traits<Function>::arity - 1 - takes_stop_token_v<Function>
+        >;
+
+        // How a task's callback arguments are reported: a single value as itself, several as a tuple.
+        template<typename ArgumentTuple>
+        struct task_result
+        {
+            typedef ArgumentTuple type;
+        };
+
+        template<typename T>
+        struct task_result<std::tuple<T>>
+        {
+            typedef T type;
+        };
+
+        template<typename Task>
+        using task_result_t = typename task_result<
+            typename callback_traits<step_callback_t<Task>>::argument_tuple
+        >::type;
+
+        // Types for a series whose steps are the first StepCount elements of Steps, a step_storage.
+        template<typename Steps, size_t StepCount>
+        struct series_traits
+        {
+            static constexpr size_t step_count = StepCount;
+
+            template<size_t N>
+            using step_t = typename Steps::template type<N>;
+
+            template<size_t N, bool IsStep = (N < step_count)>
+            struct in_args
+            {
+                typedef step_declared_args_t<step_t<N>> declared;
+                typedef typename decay_tuple<declared>::type type;
+            };
+
+            template<size_t N>
+            struct in_args<N, false>
+            {
+                typedef std::tuple<> declared;
+                typedef std::tuple<> type;
+            };
+
+            // Arguments step N receives ahead of its callback, as stored between steps. Position
+            // step_count is the final handler, which receives none.
+            template<size_t N>
+            using in_args_t = typename in_args<N>::type;
+
+            // The same arguments as step N declares them, to forward the stored values with.
+            template<size_t N>
+            using declared_in_args_t = typename in_args<N>::declared;
+
+            template<size_t ... Is>
+            static constexpr size_t max_args_size(std::index_sequence<Is...>) {
+                return std::max({ sizeof(std::tuple<>), sizeof(in_args_t<Is>)... });
+            }
+
+            template<size_t ... Is>
+            static constexpr size_t max_args_align(std::index_sequence<Is...>) {
+                return std::max({ alignof(std::tuple<>), alignof(in_args_t<Is>)... });
+            }
+
+            static constexpr size_t args_size = max_args_size(std::make_index_sequence<step_count>());
+            static constexpr size_t args_align = max_args_align(std::make_index_sequence<step_count>());
+        };
+
+        // The error type a chain reports, taken from the parameter of its final handler; a
+        // generic final handler gets error_type.
+        template<typename FinalHandler, typename = void>
+        struct final_error
+        {
+            typedef error_type type;
+        };
+
+        template<typename FinalHandler>
+        struct final_error<FinalHandler, std::void_t<decltype(&FinalHandler::operator())>>
+        {
+            typedef std::decay_t<std::tuple_element_t<0, typename function_traits<FinalHandler>::argument_tuple>> type;
+        };
+
+        template<typename FinalHandler>
+        using final_error_t = typename final_error<FinalHandler>::type;
+
+        // Invokes one step of a series and carries what it passes to its callback over to the
+        // next step. It depends only on the step's own type, not its position or chain, so that
+        // long chains instantiate little per step. Step N reads its arguments from one buffer of
+        // the frame and writes step N+1's into the other.
+        template<typename Step, typename OutArgs, typename Error>
+        class series_step;
+
+        template<typename Step, typename ... OutArgs, typename Error>
+        class series_step<Step, std::tuple<OutArgs...>, Error>
+        {
+            using declared = step_declared_args_t<std::remove_const_t<Step>>;
+            static constexpr bool stoppable = takes_stop_token_v<std::remove_const_t<Step>>;
+
+        public:
+            typedef typename decay_tuple<declared>::type in_args_type;
+
+            class next
+            {
+                chain_core<Error>* core;
+                void* in_args;
+                void* out_args;
+            public:
+                next(chain_core<Error>* core, void* in_args, void* out_args)
+                : core(core), in_args(in_args), out_args(out_args)
+                {}
+
+                void operator()(Error error, OutArgs&& ... values) const {
+                    if (!error_traits<Error>::failed(error))
+                        new (out_args) std::tuple<OutArgs...>(std::move(values)...);
+                    destroy(in_args);
+                    core->advance(std::move(error));
+                }
+            };
+
+            static in_args_type& args_at(void* in_args) {
+                return *std::launder(static_cast<in_args_type*>(in_args));
+            }
+
+            static void destroy(void* in_args) {
+                args_at(in_args).~in_args_type();
+            }
+
+            static void invoke(chain_core<Error>& core, Step& step, void* in_args, void* out_args, stop_token const& token) {
+                invoke(core, step, in_args, out_args, token, std::make_index_sequence<std::tuple_size_v<in_args_type>>());
+            }
 
-namespace async
-{
+        private:
+            // Stored values are moved into by-value and rvalue reference parameters and
+            // passed as lvalues to lvalue reference ones, so nothing is copied on the way.
+            template<size_t ... Is>
+            static void call(Step& step, in_args_type& values, stop_token const& token, next&& n, std::index_sequence<Is...>) {
+                if constexpr (stoppable)
+                    step(std::forward<std::tuple_element_t<Is, declared>>(std::get<Is>(values))..., token, std::move(n));
+                else
+                    step(std::forward<std::tuple_element_t<Is, declared>>(std::get<Is>(values))..., std::move(n));
+            }
 
-    using error_type = std::exception_ptr;
+            template<size_t ... Is>
+            static constexpr bool call_noexcept(std::index_sequence<Is...>) {
+                if constexpr (stoppable)
+                    return noexcept(std::declval<Step&>()(
+                        std::forward<std::tuple_element_t<Is, declared>>(std::get<Is>(std::declval<in_args_type&>()))...,
+                        std::declval<stop_token const&>(), std::declval<next>()
+                    ));
+                else
+                    return noexcept(std::declval<Step&>()(
+                        std::forward<std::tuple_element_t<Is, declared>>(std::get<Is>(std::declval<in_args_type&>()))...,
+                        std::declval<next>()
+                    ));
+            }
 
-    template<typename ... Args>
-    using callback = std::function<void(error_type, Args...)>;
+            template<size_t ... Is>
+            static void invoke(
+                chain_core<Error>& core, Step& step, void* in_args, void* out_args, stop_token const& token, std::index_sequence<Is...> indices
+            ) {
+                auto& values = args_at(in_args);
+                guarded_call<call_noexcept(std::index_sequence<Is...>())>(
+                    [&] {
+                        call(step, values, token, next(&core, in_args, out_args), indices);
+                    },
+                    [&] (std::exception_ptr exception) {
+                        destroy(in_args);
+                        core.fail(std::move(exception));
+                    }
+                );
+            }
+        };
 
-    namespace detail
-    {
-        
-        template<
-            typename LastHandler
-        >
-        inline void simple_series(
-            LastHandler const& last_handler,
-            LastHandler const&
+        // The steps of a series followed by its final handler, owned by the frame.
+        template<typename ... Functions>
+        class owned_chain
+        {
+        public:
+            typedef step_storage_for<Functions...> storage_type;
+            typedef last_type_t<Functions...> final_type;
+            static constexpr size_t step_count = sizeof...(Functions) - 1;
+            static constexpr bool borrowed = false;
+
+            template<typename ... Fs>
+            explicit owned_chain(Fs&& ... fs) : functions(std::in_place, std::forward<Fs>(fs)...) {}
+
+            storage_type& steps() { return functions; }
+
+            final_type& final_handler() { return functions.template get<step_count>(); }
+
+            // Told when each step starts and completes and when the chain finishes; only an
+            // observed chain does anything with it.
+            void step_started(size_t) noexcept {}
+            void step_finished() noexcept {}
+            void finished() noexcept {}
+
+            // What steps that take a stop_token are given; only a stoppable chain is ever stopped.
+            static stop_token const& token() noexcept { return no_stop_token; }
+            static constexpr bool stop_requested() noexcept { return false; }
+
+        private:
+            storage_type functions;
+        };
+
+        // The steps of a pipeline, borrowed, and the final handler of one run.
+        template<typename Storage, typename FinalHandler>
+        class borrowed_chain
+        {
+        public:
+            typedef Storage storage_type;
+            typedef FinalHandler final_type;
+            static constexpr size_t step_count = Storage::size;
+            static constexpr bool borrowed = true;
+
+            template<typename F>
+            borrowed_chain(Storage const& steps, F&& final) : borrowed_steps(steps), handler(std::forward<F>(final)) {}
+
+            Storage const& steps() { return borrowed_steps; }
+
+            final_type& final_handler() { return handler; }
+
+            void step_started(size_t) noexcept {}
+            void step_finished() noexcept {}
+            void finished() noexcept {}
+
+            static stop_token const& token() noexcept { return no_stop_token; }
+            static constexpr bool stop_requested() noexcept { return false; }
+
+        private:
+            Storage const& borrowed_steps;
+            FinalHandler handler;
+        };
+
+        // Chain, run with a stop token: steps that take one are given it, and once it is stopped
+        // the steps not yet started are skipped and the chain reports status::cancelled.
+        template<typename Chain>
+        class stoppable_chain
+        : public Chain
+        {
+            stop_token stop;
+
+        public:
+            template<typename ... ChainArgs>
+            explicit stoppable_chain(stop_token token, ChainArgs&& ... chain_args)
+            : Chain(std::forward<ChainArgs>(chain_args)...), stop(std::move(token))
+            {}
+
+            stop_token const& token() const noexcept { return stop; }
+            bool stop_requested() const noexcept { return stop.stop_requested(); }
+        };
+
+        // Runs the steps of Chain, an owned_chain or a borrowed_chain, possibly stoppable, then
+        // its final handler.
+        template<typename Dispatcher, typename Chain>
+        class series_frame
+        : public chain_frame<series_frame<Dispatcher, Chain>, Dispatcher, final_error_t<typename Chain::final_type>>
+        {
+            using error_t = final_error_t<typename Chain::final_type>;
+            using base = chain_frame<series_frame, Dispatcher, error_t>;
+            friend base;
+
+            using traits = series_traits<typename Chain::storage_type, Chain::step_count>;
+
+            static constexpr size_t last = traits::step_count;
+
+            template<size_t N>
+            using in_args_t = typename traits::template in_args_t<N>;
+
+            // Step N as stored, const when borrowed from a pipeline.
+            template<size_t N>
+            using stored_step_t = std::conditional_t<
+                Chain::borrowed,
+                indexed_value<N, typename traits::template step_t<N>> const,
+                indexed_value<N, typename traits::template step_t<N>>
+            >;
+
+            template<size_t N>
+            using step_invoker_t = series_step<
+                std::remove_reference_t<decltype((std::declval<stored_step_t<N>&>().value))>,
+                in_args_t<N+1>,
+                error_t
+            >;
+
+            static_assert(function_traits<typename Chain::final_type>::arity == 1, "the final handler must take only an error");
+
+            Chain chain;
+            // Step N's arguments live in args[N % 2], so that a step's results can be built from
+            // its own arguments before those are destroyed.
+            alignas(traits::args_align) unsigned char args[2][traits::args_size];
+
+        public:
+            template<typename ... ChainArgs>
+            explicit series_frame(Dispatcher dispatcher, ChainArgs&& ... chain_args)
+            : base(last, std::move(dispatcher)), chain(std::forward<ChainArgs>(chain_args)...)
+            {}
+
+            // first_args are passed to the first step.
+            template<typename ... Args>
+            void start(Args&& ... first_args) {
+                static_assert(
+                    std::tuple_size_v<in_args_t<0>> == sizeof...(Args),
+                    "the first step must take the arguments the chain is started with, and only a callback in a series"
+                );
+                new (args[0]) in_args_t<0>(std::forward<Args>(first_args)...);
+                base::start();
+            }
+
+        private:
+            void invoke_step() {
+                static constexpr auto step_table = make_step_table(std::make_index_sequence<last>());
+                (this->*step_table[this->cursor])();
+            }
+
+            template<size_t ... Is>
+            static constexpr auto make_step_table(std::index_sequence<Is...>) {
+                return std::array<void (series_frame::*)(), sizeof...(Is)>{
+                    &series_frame::invoke_step<Is>...
+                };
+            }
+
+            template<size_t N>
+            void invoke_step() {
+                auto& step = static_cast<stored_step_t<N>&>(chain.steps()).value;
+                step_invoker_t<N>::invoke(*this, step, args[N % 2], args[(N + 1) % 2], chain.token());
+            }
+
+            template<size_t ... Is>
+            static constexpr auto make_skip_table(std::index_sequence<Is...>) {
+                return std::array<void (series_frame::*)(), sizeof...(Is)>{
+                    &series_frame::skip_step<Is>...
+                };
+            }
+
+            void skip_step() {
+                static constexpr auto skip_table = make_skip_table(std::make_index_sequence<last>());
+                (this->*skip_table[this->cursor])();
+            }
+
+            template<size_t N>
+            void skip_step() {
+                step_invoker_t<N>::destroy(args[N % 2]);
+            }
+
+            bool stop_requested() const { return chain.stop_requested(); }
+
+            void step_started() { chain.step_started(this->cursor); }
+            void step_finished() { chain.step_finished(); }
+
+            void finish() {
+                chain.finished();
+                auto handler = std::move(chain.final_handler());
+                auto error = std::move(this->error);
+                free_frame(this);
+                handler(std::move(error));
+            }
+        };
+
+        template<typename Storage, size_t ... Is, typename ... Arguments>
+        inline void start_pipeline(
+            Storage const& steps,
+            std::index_sequence<Is...>,
+            std::tuple<Arguments...> arguments
         ) {
-            last_handler(nullptr);
+            constexpr size_t last = sizeof...(Is);
+            using final_t = std::decay_t<std::tuple_element_t<last, std::tuple<Arguments...>>>;
+            using frame_t = series_frame<inline_dispatcher, borrowed_chain<Storage, final_t>>;
+            make_frame<frame_t>(inline_dispatcher(), steps, std::get<last>(std::move(arguments)))
+                ->start(std::get<Is>(std::move(arguments))...);
         }
-        
-        template<
-            typename LastHandler,
-            typename FirstHandler,
-            typename ... RestHandlers
-        >
-        inline void simple_series(
-            LastHandler const& last_handler,
-            FirstHandler const& first_handler,
-            RestHandlers const& ... rest_handlers
+
+        template<typename Storage, size_t ... Is, typename ... Arguments>
+        inline void start_pipeline(
+            stop_token token,
+            Storage const& steps,
+            std::index_sequence<Is...>,
+            std::tuple<Arguments...> arguments
         ) {
-            first_handler([&] (error_type error) -> void {
-                if (error)
-                    last_handler(error);
-                else try {
-                    simple_series(last_handler, rest_handlers...);
-                }
-                catch (...) {
-                    last_handler(std::current_exception());
-                }
-            });
+            constexpr size_t last = sizeof...(Is);
+            using final_t = std::decay_t<std::tuple_element_t<last, std::tuple<Arguments...>>>;
+            using frame_t = series_frame<inline_dispatcher, stoppable_chain<borrowed_chain<Storage, final_t>>>;
+            make_frame<frame_t>(inline_dispatcher(), std::move(token), steps, std::get<last>(std::move(arguments)))
+                ->start(std::get<Is>(std::move(arguments))...);
         }
 
-        template<typename T>
-        struct function_traits 
-        : public function_traits<decltype(&T::operator())>
-        {};
+        // Calls task(next), or task(token, next) for a task that takes a stop_token first.
+        template<typename Task, typename Next>
+        inline void invoke_stoppable(Task& task, stop_token const& token, Next&& next) {
+            if constexpr (takes_stop_token_v<Task>)
+                task(token, std::forward<Next>(next));
+            else
+                task(std::forward<Next>(next));
+        }
 
-        template<typename F, typename ... Args>
-        struct function_traits<void(F::*)(Args...) const>
+        template<typename Task, typename Next>
+        constexpr bool invoke_stoppable_noexcept() {
+            if constexpr (takes_stop_token_v<Task>)
+                return noexcept(std::declval<Task&>()(std::declval<stop_token const&>(), std::declval<Next>()));
+            else
+                return noexcept(std::declval<Task&>()(std::declval<Next>()));
+        }
+
+        template<typename FinalHandler, typename ... Tasks>
+        class parallel_frame
         {
-            static constexpr size_t arity = sizeof...(Args);
-            typedef std::tuple<Args...> argument_tuple;
+            static constexpr size_t task_count = sizeof...(Tasks);
+            static constexpr size_t finished_bit = size_t(1) << (sizeof(size_t) * 8 - 1);
+
+            using results_type = std::tuple<task_result_t<Tasks>...>;
+
+            static constexpr bool wants_results = function_traits<FinalHandler>::arity == 2;
+
+            static_assert(
+                std::is_same_v<
+                    typename function_traits<FinalHandler>::argument_tuple,
+                    std::conditional_t<wants_results, std::tuple<error_type, results_type>, std::tuple<error_type>>
+                >,
+                "parallel's final handler must take (error_type) or (error_type, std::tuple<results...>)"
+            );
+
+            template<size_t I, typename Args = typename callback_traits<step_callback_t<std::tuple_element_t<I, std::tuple<Tasks...>>>>::argument_tuple>
+            class next_task;
+
+            template<size_t I, typename ... Args>
+            class next_task<I, std::tuple<Args...>>
+            {
+                parallel_frame* frame;
+            public:
+                explicit next_task(parallel_frame* frame) : frame(frame) {}
+                void operator()(error_type error, Args ... args) const {
+                    frame->template complete<I>(std::move(error), std::move(args)...);
+                }
+            };
+
+            // Outstanding tasks plus one for the launcher; the top bit is set once final has been called.
+            struct alignas(cache_line_size) padded_counter {
+                std::atomic<size_t> value;
+            };
+
+            padded_counter pending;
+            std::tuple<Tasks...> tasks;
+            FinalHandler final_handler;
+            results_type results;
+            stop_token token;
+
+        public:
+            template<typename F, typename ... Ts>
+            explicit parallel_frame(stop_token token, F&& final, Ts&& ... ts)
+            : pending{ task_count + 1 }, tasks(std::forward<Ts>(ts)...),
+              final_handler(std::forward<F>(final)), results(), token(std::move(token))
+            {}
+
+            void start() {
+                start(std::make_index_sequence<task_count>());
+            }
+
+        private:
+            template<size_t ... Is>
+            void start(std::index_sequence<Is...>) {
+                size_t skipped = 0;
+                (start_task<Is>(skipped), ...);
+                release(skipped + 1);
+            }
+
+            template<size_t I>
+            void start_task(size_t& skipped) {
+                if (pending.value.load(std::memory_order_relaxed) & finished_bit) {
+                    skipped++;
+                    return;
+                }
+                if (token.stop_requested()) {
+                    fail(status_error<error_type>(status::cancelled));
+                    return;
+                }
+                using task_t = std::tuple_element_t<I, std::tuple<Tasks...>>;
+                auto& task = std::get<I>(tasks);
+                guarded_call<invoke_stoppable_noexcept<task_t, next_task<I>>()>(
+                    [&] { invoke_stoppable(task, token, next_task<I>(this)); },
+                    [this] (std::exception_ptr exception) { fail(std::move(exception)); }
+                );
+            }
+
+            template<size_t I, typename ... Args>
+            void complete(error_type error, Args&& ... args) {
+                if (error) {
+                    fail(std::move(error));
+                    return;
+                }
+                if constexpr (sizeof...(Args) == 1)
+                    std::get<I>(results) = (std::forward<Args>(args), ...);
+                else if constexpr (sizeof...(Args) > 1)
+                    std::get<I>(results) = std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...);
+                release(1);
+            }
+
+            void fail(error_type error) {
+                size_t expected = pending.value.load(std::memory_order_relaxed);
+                while (!pending.value.compare_exchange_weak(
+                    expected, (expected | finished_bit) - 1, std::memory_order_acq_rel
+                ));
+                bool last = (expected & ~finished_bit) == 1;
+                if (expected & finished_bit) {
+                    if (last)
+                        free_frame(this);
+                    return;
+                }
+                auto handler = std::move(final_handler);
+                if (last)
+                    free_frame(this);
+                if constexpr (wants_results)
+                    handler(std::move(error), results_type());
+                else
+                    handler(std::move(error));
+            }
+
+            void release(size_t count) {
+                size_t previous = pending.value.fetch_sub(count, std::memory_order_acq_rel);
+                if ((previous & ~finished_bit) != count)
+                    return;
+                if (previous & finished_bit) {
+                    free_frame(this);
+                    return;
+                }
+                auto handler = std::move(final_handler);
+                auto values = std::move(results);
+                free_frame(this);
+                if constexpr (wants_results)
+                    handler(error_type(nullptr), std::move(values));
+                else
+                    handler(error_type(nullptr));
+            }
         };
 
-        template<
-            int N,
-            typename ... Functions,
-            typename ... InArgs
-        >
-        inline void series(
-            std::tuple<Functions...> const& function_tuple,
-            std::tuple<InArgs...> in_args
-        );
+        // Starts every task and reports the first to succeed, or the last error once all have
+        // failed. One 64-bit word holds the outcome: the outstanding tasks plus one for the
+        // launcher, the index of the latest task to fail, and whether a task has won. Each
+        // completion updates it with a single compare-exchange, so late ones are dropped
+        // without a lock.
+        template<typename FinalHandler, typename ... Tasks>
+        class race_frame
+        {
+            static constexpr size_t task_count = sizeof...(Tasks);
 
-        template<
-            int N,
-            typename NextFunctionTraits,
-            typename ... Functions,
-            typename ... InArgs,
-            size_t ... InArgIs,
-            size_t ... OutArgIs
-        >
-        inline void series(
-            std::tuple<Functions...> const& function_tuple,
-            std::tuple<InArgs...> in_args,
-            std::index_sequence<InArgIs...>,
-            std::index_sequence<OutArgIs...>
-        ) {
-            using out_tuple_t = typename NextFunctionTraits::argument_tuple;
-            auto function = std::get<N>(function_tuple);
-            auto error_handler = std::get<sizeof...(Functions)-1>(function_tuple);
-            try {
-                function(
-                    std::get<InArgIs>(in_args)..., 
-                    [&](error_type error, std::tuple_element_t<OutArgIs, out_tuple_t>... args) {
-                        if (error)
-                            error_handler(error);
-                        else
-                            series<N+1>(
-                                function_tuple, 
-                                std::tuple<std::tuple_element_t<OutArgIs, out_tuple_t>...>{args...}
-                            );
-                    }
+            static constexpr std::uint64_t won_bit = std::uint64_t(1) << 63;
+            static constexpr unsigned failed_shift = 32;
+            static constexpr std::uint64_t count_mask = (std::uint64_t(1) << failed_shift) - 1;
+            static constexpr std::uint64_t failed_mask = ~won_bit & ~count_mask;
+
+            using first_task = nth_type_t<0, Tasks...>;
+            using argument_tuple = typename callback_traits<step_callback_t<first_task>>::argument_tuple;
+            using result_type = typename task_result<argument_tuple>::type;
+
+            static_assert(
+                (std::is_same_v<typename callback_traits<step_callback_t<Tasks>>::argument_tuple, argument_tuple> && ...),
+                "race's tasks must all pass the same values to their callbacks"
+            );
+
+            static constexpr bool wants_result = function_traits<FinalHandler>::arity == 2;
+
+            static_assert(
+                std::is_same_v<
+                    typename function_traits<FinalHandler>::argument_tuple,
+                    std::conditional_t<wants_result, std::tuple<error_type, result_type>, std::tuple<error_type>>
+                >,
+                "race's final handler must take (error_type) or (error_type, result)"
+            );
+
+            template<size_t I, typename Args = argument_tuple>
+            class next_task;
+
+            template<size_t I, typename ... Args>
+            class next_task<I, std::tuple<Args...>>
+            {
+                race_frame* frame;
+            public:
+                explicit next_task(race_frame* frame) : frame(frame) {}
+                void operator()(error_type error, Args ... args) const {
+                    if (error)
+                        frame->fail(I, std::move(error));
+                    else
+                        frame->succeed(std::move(args)...);
+                }
+            };
+
+            struct alignas(cache_line_size) padded_state {
+                std::atomic<std::uint64_t> value;
+            };
+
+            padded_state state;
+            std::tuple<Tasks...> tasks;
+            FinalHandler final_handler;
+            stop_source losers;
+            std::array<error_type, task_count> errors;
+
+        public:
+            template<typename F, typename ... Ts>
+            explicit race_frame(F&& final, Ts&& ... ts)
+            : state{ task_count + 1 }, tasks(std::forward<Ts>(ts)...), final_handler(std::forward<F>(final))
+            {}
+
+            void start() {
+                start(std::make_index_sequence<task_count>());
+            }
+
+        private:
+            template<size_t ... Is>
+            void start(std::index_sequence<Is...>) {
+                size_t skipped = 0;
+                (start_task<Is>(skipped), ...);
+                release(skipped + 1);
+            }
+
+            template<size_t I>
+            void start_task(size_t& skipped) {
+                if (state.value.load(std::memory_order_relaxed) & won_bit) {
+                    skipped++;
+                    return;
+                }
+                auto& task = std::get<I>(tasks);
+                stop_token token = losers.get_token();
+                guarded_call<invoke_stoppable_noexcept<std::tuple_element_t<I, std::tuple<Tasks...>>, next_task<I>>()>(
+                    [&] { invoke_stoppable(task, token, next_task<I>(this)); },
+                    [this] (std::exception_ptr exception) { fail(I, std::move(exception)); }
                 );
             }
-            catch (...) {
-                error_handler(std::current_exception());
+
+            template<typename ... Args>
+            void succeed(Args&& ... args) {
+                std::uint64_t expected = state.value.load(std::memory_order_relaxed);
+                while (!(expected & won_bit) && !state.value.compare_exchange_weak(
+                    expected, expected | won_bit, std::memory_order_acq_rel
+                ));
+                if (expected & won_bit) {
+                    release(1);
+                    return;
+                }
+                // The winner keeps its reference until it has taken what it needs, since losers may
+                // complete, even from their stop callbacks, as soon as they are stopped.
+                auto handler = std::move(final_handler);
+                stop_source stopping = losers;
+                release(1);
+                stopping.request_stop();
+                if constexpr (!wants_result)
+                    handler(error_type(nullptr));
+                else if constexpr (sizeof...(Args) == 1)
+                    handler(error_type(nullptr), std::forward<Args>(args)...);
+                else
+                    handler(error_type(nullptr), result_type(std::forward<Args>(args)...));
             }
-        }
 
-        template<
-            int N,
-            typename ... Functions,
-            typename ... InArgs
-        >
-        inline void series(
-            std::tuple<Functions...> const& function_tuple,
-            std::tuple<InArgs...> in_args
+            void fail(size_t index, error_type error) {
+                errors[index] = std::move(error);
+                std::uint64_t expected = state.value.load(std::memory_order_relaxed);
+                std::uint64_t desired;
+                do {
+                    desired = ((expected & ~failed_mask) | (std::uint64_t(index + 1) << failed_shift)) - 1;
+                } while (!state.value.compare_exchange_weak(expected, desired, std::memory_order_acq_rel));
+                if ((desired & count_mask) == 0)
+                    finish(desired);
+            }
+
+            void release(size_t count) {
+                std::uint64_t previous = state.value.fetch_sub(count, std::memory_order_acq_rel);
+                if ((previous & count_mask) == count)
+                    finish(previous - count);
+            }
+
+            // Called once nothing refers to the frame any more.
+            void finish(std::uint64_t outcome) {
+                if (outcome & won_bit) {
+                    free_frame(this);
+                    return;
+                }
+                auto handler = std::move(final_handler);
+                auto error = std::move(errors[((outcome & failed_mask) >> failed_shift) - 1]);
+                free_frame(this);
+                if constexpr (wants_result)
+                    handler(std::move(error), result_type());
+                else
+                    handler(std::move(error));
+            }
+        };
+
+        template<size_t ... Is, typename ... Arguments>
+        inline void start_race(
+            std::index_sequence<Is...>,
+            std::tuple<Arguments...> arguments
         ) {
-            if constexpr (N == sizeof...(Functions)-1) {
-                auto function = std::get<N>(function_tuple);
-                using fun_arg_tuple_t = typename function_traits<decltype(function)>::argument_tuple;
-                static_assert(std::is_same_v<decltype(in_args), std::tuple<>>);
-                static_assert(std::is_same_v<fun_arg_tuple_t, std::tuple<error_type>>);
-                function(nullptr);
+            constexpr size_t last = sizeof...(Is);
+            using frame_t = race_frame<
+                std::decay_t<std::tuple_element_t<last, std::tuple<Arguments...>>>,
+                std::decay_t<std::tuple_element_t<Is, std::tuple<Arguments...>>>...
+            >;
+            make_frame<frame_t>(
+                std::get<last>(std::move(arguments)),
+                std::get<Is>(std::move(arguments))...
+            )->start();
+        }
+
+        template<typename Range>
+        using range_iterator_t = decltype(std::begin(std::declval<Range&>()));
+
+        // Runs iteratee over a random-access range with at most limit invocations in flight. Each
+        // lane claims its next item with a fetch_add on a shared index when its current item
+        // completes; the counter of running lanes doubles as the join.
+        template<typename Range, typename Iteratee, typename FinalHandler, bool Map>
+        class each_frame
+        {
+            using iterator = range_iterator_t<Range>;
+
+            static_assert(
+                std::is_base_of_v<std::random_access_iterator_tag, typename std::iterator_traits<iterator>::iterator_category>,
+                "each and map need a random-access range"
+            );
+
+            static constexpr size_t finished_bit = size_t(1) << (sizeof(size_t) * 8 - 1);
+
+            using item_args = typename callback_traits<step_callback_t<Iteratee>>::argument_tuple;
+            using result_type = typename task_result<item_args>::type;
+
+            // std::vector<bool> packs neighbouring results into one word, which concurrent
+            // iterations must not write; they are kept a byte each and unpacked at the end.
+            struct unpacked_bool { bool value; };
+            static constexpr bool packs = std::is_same_v<result_type, bool>;
+            using stored_type = std::conditional_t<packs, unpacked_bool, result_type>;
+            using results_type = std::conditional_t<Map, std::vector<stored_type>, std::tuple<>>;
+
+            static_assert(Map || std::tuple_size_v<item_args> == 0, "each's iteratee must take callback<>");
+
+            template<typename Args = item_args>
+            class next_item;
+
+            template<typename ... Args>
+            class next_item<std::tuple<Args...>>
+            {
+                each_frame* frame;
+                size_t index;
+            public:
+                next_item(each_frame* frame, size_t index) : frame(frame), index(index) {}
+                void operator()(error_type error, Args ... args) const {
+                    frame->complete(index, std::move(error), std::move(args)...);
+                }
+            };
+
+            struct alignas(cache_line_size) padded_counter {
+                std::atomic<size_t> value;
+            };
+
+            padded_counter next_index;
+            // Running lanes plus one for the launcher; the top bit is set once final has been called.
+            padded_counter lanes;
+            Range range;
+            iterator first;
+            size_t size;
+            size_t limit;
+            Iteratee iteratee;
+            FinalHandler final_handler;
+            results_type results;
+
+        public:
+            template<typename R, typename I, typename F>
+            each_frame(R&& r, size_t limit, I&& i, F&& final)
+            : next_index{ 0 }, lanes{ 1 }, range(std::forward<R>(r)), first(std::begin(range)),
+              size(static_cast<size_t>(std::end(range) - first)), limit(limit > 0 ? std::min(limit, size) : 1),
+              iteratee(std::forward<I>(i)), final_handler(std::forward<F>(final))
+            {
+                if constexpr (Map)
+                    results.resize(size);
             }
-            else {
-                auto next_function = std::get<N+1>(function_tuple);
-                using traits = function_traits<decltype(next_function)>;
-                series<N,traits>(
-                    function_tuple, 
-                    in_args, 
-                    std::make_index_sequence<sizeof...(InArgs)>(),
-                    std::make_index_sequence<traits::arity-1>()
-                );
+
+            void start() {
+                lanes.value.fetch_add(limit, std::memory_order_relaxed);
+                for (size_t i = 0; i < limit; i++)
+                    run_lane();
+                release();
+            }
+
+        private:
+            void run_lane() {
+                for (;;) {
+                    if (lanes.value.load(std::memory_order_relaxed) & finished_bit)
+                        break;
+                    size_t index = next_index.value.fetch_add(1, std::memory_order_relaxed);
+                    if (index >= size)
+                        break;
+                    inline_slot slot(this, index);
+                    guarded_call<noexcept(iteratee(first[index], next_item<>(this, index)))>(
+                        [&] { iteratee(first[index], next_item<>(this, index)); },
+                        [&] (std::exception_ptr exception) {
+                            fail(std::move(exception));
+                            inline_slot::complete(this, index);
+                        }
+                    );
+                    if (!slot.completed())
+                        return;
+                }
+                release();
+            }
+
+            template<typename ... Args>
+            void complete(size_t index, error_type error, Args&& ... args) {
+                if (error)
+                    fail(std::move(error));
+                else if constexpr (packs)
+                    results[index].value = (std::forward<Args>(args), ...);
+                else if constexpr (sizeof...(Args) == 1)
+                    results[index] = (std::forward<Args>(args), ...);
+                else if constexpr (sizeof...(Args) > 1)
+                    results[index] = result_type(std::forward<Args>(args)...);
+                if (!inline_slot::complete(this, index))
+                    run_lane();
+            }
+
+            void fail(error_type error) {
+                size_t previous = lanes.value.fetch_or(finished_bit, std::memory_order_acq_rel);
+                if (previous & finished_bit)
+                    return;
+                auto handler = std::move(final_handler);
+                if constexpr (Map)
+                    handler(std::move(error), std::vector<result_type>());
+                else
+                    handler(std::move(error));
             }
+
+            void release() {
+                size_t previous = lanes.value.fetch_sub(1, std::memory_order_acq_rel);
+                if ((previous & ~finished_bit) != 1)
+                    return;
+                if (previous & finished_bit) {
+                    free_frame(this);
+                    return;
+                }
+                auto handler = std::move(final_handler);
+                auto values = take_results();
+                free_frame(this);
+                if constexpr (Map)
+                    handler(error_type(nullptr), std::move(values));
+                else
+                    handler(error_type(nullptr));
+            }
+
+            auto take_results() {
+                if constexpr (Map && packs) {
+                    std::vector<bool> values(results.size());
+                    for (size_t i = 0; i < results.size(); i++)
+                        values[i] = results[i].value;
+                    return values;
+                }
+                else
+                    return std::move(results);
+            }
+        };
+
+        template<bool Map, typename Range, typename Iteratee, typename FinalHandler>
+        inline void start_each(
+            Range&& range,
+            size_t limit,
+            Iteratee&& iteratee,
+            FinalHandler&& final_handler
+        ) {
+            // Borrow lvalue ranges, take ownership of temporaries.
+            using frame_t = each_frame<
+                std::conditional_t<std::is_lvalue_reference_v<Range>, Range, std::decay_t<Range>>,
+                std::decay_t<Iteratee>,
+                std::decay_t<FinalHandler>,
+                Map
+            >;
+            make_frame<frame_t>(
+                std::forward<Range>(range), limit,
+                std::forward<Iteratee>(iteratee), std::forward<FinalHandler>(final_handler)
+            )->start();
+        }
+
+        template<size_t ... Is, typename ... Arguments>
+        inline void start_parallel(
+            stop_token token,
+            std::index_sequence<Is...>,
+            std::tuple<Arguments&&...> arguments
+        ) {
+            constexpr size_t last = sizeof...(Is);
+            using frame_t = parallel_frame<
+                std::decay_t<std::tuple_element_t<last, std::tuple<Arguments...>>>,
+                std::decay_t<std::tuple_element_t<Is, std::tuple<Arguments...>>>...
+            >;
+            make_frame<frame_t>(
+                std::move(token),
+                std::get<last>(std::move(arguments)),
+                std::get<Is>(std::move(arguments))...
+            )->start();
         }
 
     }
 
+    // Runs handlers in order, each taking only next, then the last with the error. Handlers are
+    // kept in the chain's frame and called in place, and the frame goes as soon as the chain
+    // completes, which another thread may do as soon as it has next: a handler must not touch
+    // its own state after calling next or handing it off, so it copies out what it needs first.
     template<
         typename ... Handlers
     >
     inline void simple_series(
-        Handlers const& ... handlers
+        Handlers&& ... handlers
     ) {
-        std::tuple<Handlers const& ...> handler_tuple (handlers ...);
-        try {
-            detail::simple_series(std::get<sizeof...(Handlers)-1>(handler_tuple), handlers...);
-        }
-        catch (...) {
-            std::get<sizeof...(Handlers)-1>(handler_tuple)(std::current_exception());
-        }
+        using frame_t = detail::simple_series_frame<
+            detail::inline_dispatcher, detail::final_error_t<detail::last_type_t<std::decay_t<Handlers>...>>, std::decay_t<Handlers>...
+        >;
+        detail::make_frame<frame_t>(detail::inline_dispatcher(), std::forward<Handlers>(handlers)...)->start();
+    }
+
+    // Runs a runtime-length sequence of handlers, each taking only next, then final_handler.
+    template<
+        typename Range,
+        typename FinalHandler,
+        typename = decltype(std::begin(std::declval<Range&>()))
+    >
+    inline void simple_series(
+        Range&& handlers,
+        FinalHandler&& final_handler
+    ) {
+        using frame_t = detail::simple_series_range_frame<
+            detail::inline_dispatcher, detail::final_error_t<std::decay_t<FinalHandler>>, std::decay_t<Range>, std::decay_t<FinalHandler>
+        >;
+        detail::make_frame<frame_t>(
+            detail::inline_dispatcher(), std::forward<Range>(handlers), std::forward<FinalHandler>(final_handler)
+        )->start();
+    }
+
+    // Runs functions in order, each given what the one before passed its callback, then the
+    // final handler with the error. As in simple_series, steps are called in place in the
+    // chain's frame, and must not touch their own state after calling next or handing it off.
+    template<typename ... Functions>
+    inline void series(
+        Functions&& ... functions
+    ) {
+        static_assert(sizeof...(Functions) > 0, "series needs a final handler");
+        using frame_t = detail::series_frame<detail::inline_dispatcher, detail::owned_chain<std::decay_t<Functions>...>>;
+        detail::make_frame<frame_t>(detail::inline_dispatcher(), std::forward<Functions>(functions)...)->start();
     }
 
+    // As series, run with token: a step taking a stop_token just ahead of its callback is given
+    // it, and once it is stopped the steps not yet started are skipped and the final handler
+    // gets status::cancelled, as a system_error for exception_ptr chains. A step already
+    // running is only told through the token, and the chain waits for it to call next.
     template<typename ... Functions>
     inline void series(
-        Functions ... functions
+        stop_token token,
+        Functions&& ... functions
+    ) {
+        static_assert(sizeof...(Functions) > 0, "series needs a final handler");
+        using frame_t = detail::series_frame<
+            detail::inline_dispatcher, detail::stoppable_chain<detail::owned_chain<std::decay_t<Functions>...>>
+        >;
+        detail::make_frame<frame_t>(detail::inline_dispatcher(), std::move(token), std::forward<Functions>(functions)...)->start();
+    }
+
+    // As simple_series, continuing through executor according to policy. The first step runs
+    // in the caller. An executor passed as an lvalue is borrowed and must outlive the chain.
+    template<
+        typename Executor,
+        typename ... Handlers
+    >
+    inline void simple_series_on(
+        Executor&& executor,
+        dispatch_policy policy,
+        Handlers&& ... handlers
+    ) {
+        using dispatcher_t = detail::executor_dispatcher_for<Executor>;
+        using frame_t = detail::simple_series_frame<
+            dispatcher_t, detail::final_error_t<detail::last_type_t<std::decay_t<Handlers>...>>, std::decay_t<Handlers>...
+        >;
+        detail::make_frame<frame_t>(
+            dispatcher_t(std::forward<Executor>(executor), policy), std::forward<Handlers>(handlers)...
+        )->start();
+    }
+
+    // As series, continuing through executor according to policy. The first step runs in the
+    // caller. An executor passed as an lvalue is borrowed and must outlive the chain.
+    template<
+        typename Executor,
+        typename ... Functions
+    >
+    inline void series_on(
+        Executor&& executor,
+        dispatch_policy policy,
+        Functions&& ... functions
+    ) {
+        static_assert(sizeof...(Functions) > 0, "series needs a final handler");
+        using dispatcher_t = detail::executor_dispatcher_for<Executor>;
+        using frame_t = detail::series_frame<dispatcher_t, detail::owned_chain<std::decay_t<Functions>...>>;
+        detail::make_frame<frame_t>(
+            dispatcher_t(std::forward<Executor>(executor), policy), std::forward<Functions>(functions)...
+        )->start();
+    }
+
+    // A series whose steps are stored and type-checked once and can then be run any number of
+    // times, concurrently if the steps allow it. Each run only takes a frame from the pool for
+    // the values passed between steps. Steps are called through a const reference, and the
+    // pipeline must outlive every run.
+    template<typename ... Steps>
+    class pipeline
+    {
+        using steps_type = detail::step_storage_for<Steps...>;
+        using traits = detail::series_traits<steps_type, sizeof...(Steps)>;
+
+        steps_type steps;
+
+    public:
+        // What run takes ahead of the final handler: the arguments of the first step.
+        typedef typename traits::template in_args_t<0> argument_tuple;
+
+        template<typename ... S>
+        explicit pipeline(std::in_place_t, S&& ... s) : steps(std::in_place, std::forward<S>(s)...) {}
+
+        // run(arguments..., final_handler): arguments go to the first step, and final_handler
+        // takes only the error, of whichever type the steps report.
+        template<typename ... Arguments>
+        void run(Arguments&& ... arguments) const {
+            static_assert(sizeof...(Arguments) > 0, "run needs a final handler");
+            detail::start_pipeline(
+                steps,
+                std::make_index_sequence<sizeof...(Arguments) - 1>(),
+                std::forward_as_tuple(std::forward<Arguments>(arguments)...)
+            );
+        }
+
+        // As run, with token stopping the run as it does a series.
+        template<typename ... Arguments>
+        void run(stop_token token, Arguments&& ... arguments) const {
+            static_assert(sizeof...(Arguments) > 0, "run needs a final handler");
+            detail::start_pipeline(
+                std::move(token),
+                steps,
+                std::make_index_sequence<sizeof...(Arguments) - 1>(),
+                std::forward_as_tuple(std::forward<Arguments>(arguments)...)
+            );
+        }
+    };
+
+    template<typename ... Steps>
+    inline pipeline<std::decay_t<Steps>...> make_pipeline(Steps&& ... steps) {
+        return pipeline<std::decay_t<Steps>...>(std::in_place, std::forward<Steps>(steps)...);
+    }
+
+    // Starts every task at once. final_handler is called exactly once: with the first error,
+    // or with all results once every task has completed.
+    template<typename ... Arguments>
+    inline void parallel(
+        Arguments&& ... arguments
+    ) {
+        static_assert(sizeof...(Arguments) > 0, "parallel needs a final handler");
+        detail::start_parallel(
+            stop_token(),
+            std::make_index_sequence<sizeof...(Arguments) - 1>(),
+            std::forward_as_tuple(std::forward<Arguments>(arguments)...)
+        );
+    }
+
+    // As parallel, run with token: a task taking a stop_token ahead of its callback is given it,
+    // and once it is stopped the tasks not yet started are skipped and the final handler gets
+    // status::cancelled, as a system_error. Tasks already running are only told through the
+    // token.
+    template<typename ... Arguments>
+    inline void parallel(
+        stop_token token,
+        Arguments&& ... arguments
+    ) {
+        static_assert(sizeof...(Arguments) > 0, "parallel needs a final handler");
+        detail::start_parallel(
+            std::move(token),
+            std::make_index_sequence<sizeof...(Arguments) - 1>(),
+            std::forward_as_tuple(std::forward<Arguments>(arguments)...)
+        );
+    }
+
+    // Starts every task at once, race(tasks..., final_handler), and completes with the first to
+    // succeed, or with the last error once every task has failed. A task taking a stop_token
+    // ahead of its callback is stopped when another wins, so that it can give up early; it must
+    // still call its callback. final_handler takes (error_type) or (error_type, result).
+    template<typename ... Arguments>
+    inline void race(
+        Arguments&& ... arguments
+    ) {
+        static_assert(sizeof...(Arguments) > 1, "race needs a task and a final handler");
+        detail::start_race(
+            std::make_index_sequence<sizeof...(Arguments) - 1>(),
+            std::forward_as_tuple(std::forward<Arguments>(arguments)...)
+        );
+    }
+
+    // Calls iteratee(item, next) for every item of a random-access range, all at once.
+    // An lvalue range must outlive the operation.
+    template<typename Range, typename Iteratee, typename FinalHandler>
+    inline void each(
+        Range&& range,
+        Iteratee&& iteratee,
+        FinalHandler&& final_handler
+    ) {
+        detail::start_each<false>(
+            std::forward<Range>(range), std::numeric_limits<size_t>::max(),
+            std::forward<Iteratee>(iteratee), std::forward<FinalHandler>(final_handler)
+        );
+    }
+
+    // As each, with at most limit invocations in flight.
+    template<typename Range, typename Iteratee, typename FinalHandler>
+    inline void each_limit(
+        Range&& range,
+        size_t limit,
+        Iteratee&& iteratee,
+        FinalHandler&& final_handler
+    ) {
+        detail::start_each<false>(
+            std::forward<Range>(range), limit,
+            std::forward<Iteratee>(iteratee), std::forward<FinalHandler>(final_handler)
+        );
+    }
+
+    // As each, collecting what each item passes to its callback into a vector in range order.
+    template<typename Range, typename Iteratee, typename FinalHandler>
+    inline void map(
+        Range&& range,
+        Iteratee&& iteratee,
+        FinalHandler&& final_handler
+    ) {
+        detail::start_each<true>(
+            std::forward<Range>(range), std::numeric_limits<size_t>::max(),
+            std::forward<Iteratee>(iteratee), std::forward<FinalHandler>(final_handler)
+        );
+    }
+
+    // As map, with at most limit invocations in flight.
+    template<typename Range, typename Iteratee, typename FinalHandler>
+    inline void map_limit(
+        Range&& range,
+        size_t limit,
+        Iteratee&& iteratee,
+        FinalHandler&& final_handler
     ) {
-        std::tuple<Functions...> function_tuple(functions...);
-        detail::series<0>(function_tuple, std::tuple<>{});
+        detail::start_each<true>(
+            std::forward<Range>(range), limit,
+            std::forward<Iteratee>(iteratee), std::forward<FinalHandler>(final_handler)
+        );
     }
 
 }
+
+namespace std
+{
+
+    template<>
+    struct is_error_code_enum<async::status> : true_type {};
+
+}
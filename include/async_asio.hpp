@@ -0,0 +1,1084 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+
+#include "async.hpp"
+#include "async_metrics.hpp"
+
+#ifndef ASYNC_TIMER_WHEELS
+#define ASYNC_TIMER_WHEELS 8
+#endif
+
+namespace async
+{
+
+    namespace detail
+    {
+
+        inline error_type error_from(boost::system::error_code const& ec) {
+            if (!ec)
+                return nullptr;
+            count_allocation(allocation_event::error_object);
+            return std::make_exception_ptr(boost::system::system_error(ec));
+        }
+
+        inline void assign_error(boost::system::error_code const& ec, error_type& error) {
+            error = error_from(ec);
+        }
+
+        inline void assign_error(boost::system::error_code const& ec, std::error_code& error) {
+            error = ec;
+        }
+
+        inline void assign_error(boost::system::error_code const& ec, status& error) {
+            if (ec == boost::asio::error::operation_aborted)
+                error = status::cancelled;
+            else if (ec)
+                error = status::failed;
+        }
+
+        // The completion handler an Asio operation gets when a continuation is passed as its token.
+        template<typename Continuation, typename ... Values>
+        class asio_next_handler
+        {
+            Continuation next;
+        public:
+            explicit asio_next_handler(Continuation&& next) : next(std::move(next)) {}
+
+            void operator()(boost::system::error_code const& ec, Values ... values) {
+                auto error = error_traits<typename Continuation::error_type>::success();
+                assign_error(ec, error);
+                next(std::move(error), std::move(values)...);
+            }
+        };
+
+    }
+
+    namespace detail
+    {
+
+        // Threads take wheels round robin, so that up to ASYNC_TIMER_WHEELS threads scheduling
+        // timers never share one.
+        inline std::size_t timer_wheel() noexcept {
+            static std::atomic<std::size_t> next_wheel{0};
+            static thread_local std::size_t const wheel =
+                next_wheel.fetch_add(1, std::memory_order_relaxed) % ASYNC_TIMER_WHEELS;
+            return wheel;
+        }
+
+    }
+
+    // Deadlines for any number of pending operations, waited on with one steady_timer that
+    // ticks every resolution while any are pending, instead of a timer each. Each thread
+    // schedules into one of ASYNC_TIMER_WHEELS hierarchical timing wheels, so that scheduling
+    // and cancelling take constant time. A wheel has four levels, the first a tick a slot, each
+    // next 64 times coarser, each with slots for two periods of the level above: deadlines
+    // within about 33 million ticks (9 hours at the default millisecond) are placed exactly, and
+    // later ones re-placed as they come closer. Rather than cascading a slot to the level below
+    // all at once, as its period starts, each tick of the period before moves its share, so no
+    // tick stalls on a burst. Each wheel has its own mutex, taken by its scheduling thread, by
+    // cancels and by the tick. Expiries run on the timer's executor, no earlier than their
+    // deadline and, unless the executor is busy, at most about a tick late. The queue must
+    // outlive the operations it times.
+    class timer_queue
+    {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+    private:
+        struct slot;
+        struct wheel;
+
+    public:
+        // What an operation embeds to be timed.
+        class node
+        {
+            friend class timer_queue;
+
+            std::uint64_t tick = 0;
+            node* next = nullptr;
+            node** previous = nullptr;
+            slot* in = nullptr;
+            std::atomic<wheel*> owner{nullptr};
+            void (*expire)(node* n);
+
+        protected:
+            explicit node(void (*expire)(node* n)) : expire(expire) {}
+        };
+
+        template<typename ExecutorOrContext>
+        explicit timer_queue(ExecutorOrContext&& executor, clock::duration resolution = std::chrono::milliseconds(1))
+        : timer(std::forward<ExecutorOrContext>(executor)), resolution(resolution), epoch(clock::now()),
+          pending(0), ticking(false)
+        {}
+
+        timer_queue(timer_queue const&) = delete;
+        timer_queue& operator=(timer_queue const&) = delete;
+
+        // A queue with a thread of its own, for operations that are not given one.
+        static timer_queue& shared();
+
+        // Calls n's expire on the timer's executor once deadline has passed, unless cancelled.
+        void schedule(node* n, clock::time_point deadline) {
+            auto since = deadline > epoch ? deadline - epoch : clock::duration(0);
+            std::uint64_t tick = static_cast<std::uint64_t>((since + resolution - clock::duration(1)) / resolution);
+            pending.fetch_add(1, std::memory_order_relaxed);
+            wheel& w = wheels[detail::timer_wheel()];
+            {
+                std::lock_guard<std::mutex> lock(w.mutex);
+                // An empty wheel may have missed ticks while the timer was idle.
+                if (w.size == 0)
+                    w.current = std::max(w.current, now());
+                n->tick = std::max(tick, w.current + 1);
+                w.link(n);
+                w.size++;
+                n->owner.store(&w, std::memory_order_release);
+            }
+            if (!ticking.exchange(true, std::memory_order_acq_rel))
+                boost::asio::post(timer.get_executor(), [this] { run_tick(); });
+        }
+
+        // True if n was pending and now never expires; false if it has expired or is expiring.
+        bool cancel(node* n) {
+            wheel* w = n->owner.load(std::memory_order_acquire);
+            if (!w)
+                return false;
+            {
+                std::lock_guard<std::mutex> lock(w->mutex);
+                if (n->owner.load(std::memory_order_relaxed) != w)
+                    return false;
+                w->unlink(n);
+                n->owner.store(nullptr, std::memory_order_relaxed);
+                w->size--;
+            }
+            pending.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+    private:
+        static constexpr unsigned level_bits = 6;
+        static constexpr std::size_t slot_count = std::size_t(2) << level_bits;
+        static constexpr unsigned level_count = 4;
+
+        struct slot
+        {
+            node* head = nullptr;
+            std::size_t size = 0;
+        };
+
+        struct alignas(detail::cache_line_size) wheel
+        {
+            std::mutex mutex;
+            std::uint64_t current = 0;
+            std::size_t size = 0;
+            slot slots[level_count][slot_count];
+
+            static std::uint64_t period(std::uint64_t tick, unsigned level) {
+                return tick >> (level_bits * level);
+            }
+
+            // In the lowest level whose slots reach as far as n, which is the first unless n is
+            // beyond the next period of the level above.
+            void link(node* n) {
+                unsigned level = 0;
+                while (level + 1 < level_count && period(n->tick, level + 1) > period(current, level + 1) + 1)
+                    level++;
+                std::uint64_t p = std::min(period(n->tick, level), period(current, level) + slot_count - 1);
+                slot& s = slots[level][p % slot_count];
+                n->next = s.head;
+                n->previous = &s.head;
+                if (s.head)
+                    s.head->previous = &n->next;
+                s.head = n;
+                s.size++;
+                n->in = &s;
+            }
+
+            void unlink(node* n) {
+                *n->previous = n->next;
+                if (n->next)
+                    n->next->previous = n->previous;
+                n->in->size--;
+            }
+
+            // Moves level's share of its slot for the next period down, all of it by the
+            // period's last tick.
+            void drain(unsigned level) {
+                slot& s = slots[level][(period(current, level) + 1) % slot_count];
+                if (s.size == 0)
+                    return;
+                std::uint64_t length = std::uint64_t(1) << (level_bits * level);
+                std::uint64_t left = length - (current & (length - 1));
+                for (std::size_t moving = (s.size + left - 1) / left; moving > 0; moving--) {
+                    node* n = s.head;
+                    unlink(n);
+                    link(n);
+                }
+            }
+
+            // Appends what expires by tick to the list ending at tail.
+            void advance(std::uint64_t tick, node**& tail) {
+                while (current < tick) {
+                    if (size == 0) {
+                        current = tick;
+                        return;
+                    }
+                    current++;
+                    for (unsigned level = level_count - 1; level > 0; level--)
+                        drain(level);
+                    slot& s = slots[0][current % slot_count];
+                    for (node* n = s.head; n; n = n->next) {
+                        n->owner.store(nullptr, std::memory_order_relaxed);
+                        size--;
+                        *tail = n;
+                        tail = &n->next;
+                    }
+                    s.head = nullptr;
+                    s.size = 0;
+                }
+            }
+        };
+
+        boost::asio::steady_timer timer;
+        clock::duration resolution;
+        clock::time_point epoch;
+        std::atomic<std::size_t> pending;
+        std::atomic<bool> ticking;
+        wheel wheels[ASYNC_TIMER_WHEELS];
+
+        std::uint64_t now() const {
+            return static_cast<std::uint64_t>((clock::now() - epoch) / resolution);
+        }
+
+        // Only one tick runs at a time: each arms the next, and schedule posts one only when
+        // none is running.
+        void run_tick() {
+            std::uint64_t tick = now();
+            node* expired = nullptr;
+            node** tail = &expired;
+            for (wheel& w : wheels) {
+                std::lock_guard<std::mutex> lock(w.mutex);
+                w.advance(tick, tail);
+            }
+            std::size_t count = 0;
+            for (node* n = expired; n; ) {
+                node* next = n->next;
+                count++;
+                n->expire(n);
+                n = next;
+            }
+            if (pending.fetch_sub(count, std::memory_order_acq_rel) == count) {
+                ticking.store(false, std::memory_order_release);
+                if (pending.load(std::memory_order_acquire) == 0 || ticking.exchange(true, std::memory_order_acq_rel))
+                    return;
+            }
+            timer.expires_at(epoch + (tick + 1) * resolution);
+            timer.async_wait([this] (boost::system::error_code const&) { run_tick(); });
+        }
+    };
+
+    // A timer_queue ticked by a thread of its own, stopped and joined on destruction.
+    class timer_thread
+    {
+        boost::asio::io_context context;
+        boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work;
+        timer_queue timers;
+        std::thread thread;
+
+    public:
+        explicit timer_thread(timer_queue::clock::duration resolution = std::chrono::milliseconds(1))
+        : work(boost::asio::make_work_guard(context)), timers(context, resolution), thread([this] { context.run(); })
+        {}
+
+        ~timer_thread() {
+            work.reset();
+            context.stop();
+            thread.join();
+        }
+
+        timer_queue& queue() noexcept { return timers; }
+    };
+
+    inline timer_queue& timer_queue::shared() {
+        static timer_thread instance;
+        return instance.queue();
+    }
+
+    // When hedged requests start their backup: once the primary has been outstanding for the
+    // given quantile of the latencies observed so far, re-read from the histogram every
+    // refresh_interval samples. Until then, initial_delay. Shared by every request to one
+    // backend, and must outlive them.
+    class hedging_policy
+    {
+        latency_histogram latencies;
+        double quantile;
+        std::uint64_t minimum_delay;
+        std::uint64_t refresh_interval;
+        std::atomic<std::uint64_t> samples{0};
+        std::atomic<std::uint64_t> current_delay;
+
+    public:
+        explicit hedging_policy(
+            double quantile = 0.95,
+            std::chrono::nanoseconds initial_delay = std::chrono::milliseconds(10),
+            std::chrono::nanoseconds minimum_delay = std::chrono::nanoseconds(0),
+            std::uint64_t refresh_interval = 100
+        )
+        : quantile(quantile), minimum_delay(static_cast<std::uint64_t>(minimum_delay.count())),
+          refresh_interval(refresh_interval > 0 ? refresh_interval : 1),
+          current_delay(static_cast<std::uint64_t>(initial_delay.count()))
+        {}
+
+        std::chrono::nanoseconds delay() const noexcept {
+            return std::chrono::nanoseconds(current_delay.load(std::memory_order_relaxed));
+        }
+
+        latency_histogram const& observed() const noexcept { return latencies; }
+
+        void record(std::uint64_t nanoseconds) noexcept {
+            latencies.record(nanoseconds);
+            if ((samples.fetch_add(1, std::memory_order_relaxed) + 1) % refresh_interval == 0) {
+                std::uint64_t delay = latencies.read().value_at_quantile(quantile);
+                current_delay.store(delay > minimum_delay ? delay : minimum_delay, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    namespace detail
+    {
+
+        // Runs the primary at once and the backup once the policy's delay has passed, or as soon
+        // as the primary fails, and reports the first success or, once both have failed, the
+        // last error. One 64-bit word holds the outcome: references held by the launcher, the
+        // timer and the attempts; how many attempts have failed; and whether one has won.
+        template<typename FinalHandler, typename Primary, typename Backup>
+        class hedged_frame
+        : public timer_queue::node
+        {
+            static constexpr std::uint64_t won_bit = std::uint64_t(1) << 63;
+            static constexpr std::uint64_t failure = std::uint64_t(1) << 32;
+            static constexpr std::uint64_t count_mask = failure - 1;
+
+            using argument_tuple = typename callback_traits<step_callback_t<Primary>>::argument_tuple;
+            using result_type = typename task_result<argument_tuple>::type;
+
+            static_assert(
+                std::is_same_v<typename callback_traits<step_callback_t<Backup>>::argument_tuple, argument_tuple>,
+                "hedged's primary and backup must pass the same values to their callbacks"
+            );
+
+            static constexpr bool wants_result = function_traits<FinalHandler>::arity == 2;
+
+            static_assert(
+                std::is_same_v<
+                    typename function_traits<FinalHandler>::argument_tuple,
+                    std::conditional_t<wants_result, std::tuple<error_type, result_type>, std::tuple<error_type>>
+                >,
+                "hedged's final handler must take (error_type) or (error_type, result)"
+            );
+
+            template<bool IsBackup, typename Args = argument_tuple>
+            class next_attempt;
+
+            template<bool IsBackup, typename ... Args>
+            class next_attempt<IsBackup, std::tuple<Args...>>
+            {
+                hedged_frame* frame;
+            public:
+                explicit next_attempt(hedged_frame* frame) : frame(frame) {}
+                void operator()(error_type error, Args ... args) const {
+                    if (error)
+                        frame->template fail<IsBackup>(std::move(error));
+                    else
+                        frame->template succeed<IsBackup>(std::move(args)...);
+                }
+            };
+
+            struct alignas(cache_line_size) padded_state {
+                std::atomic<std::uint64_t> value;
+            };
+
+            padded_state state;
+            hedging_policy& policy;
+            Primary primary;
+            Backup backup;
+            FinalHandler final_handler;
+            stop_source losers;
+            timer_queue& timers;
+            std::atomic<bool> backup_started;
+            std::uint64_t primary_start;
+            std::uint64_t backup_start;
+
+            static void expire(timer_queue::node* n) {
+                auto* frame = static_cast<hedged_frame*>(n);
+                frame->start_backup();
+                frame->release(1);
+            }
+
+        public:
+            template<typename F, typename P, typename B>
+            hedged_frame(hedging_policy& policy, timer_queue& timers, F&& final, P&& p, B&& b)
+            : timer_queue::node(&hedged_frame::expire), state{ 3 }, policy(policy), primary(std::forward<P>(p)),
+              backup(std::forward<B>(b)), final_handler(std::forward<F>(final)), timers(timers),
+              backup_started(false), primary_start(0), backup_start(0)
+            {}
+
+            void start() {
+                timers.schedule(this, timer_queue::clock::now() + policy.delay());
+                primary_start = metrics_clock();
+                start_attempt<false>(primary);
+                release(1);
+            }
+
+        private:
+            // Once the backup has started or one attempt has won, the timer has nothing to do.
+            void cancel_timer() {
+                if (timers.cancel(this))
+                    release(1);
+            }
+
+            template<bool IsBackup, typename Task>
+            void start_attempt(Task& task) {
+                stop_token token = losers.get_token();
+                guarded_call<invoke_stoppable_noexcept<Task, next_attempt<IsBackup>>()>(
+                    [&] { invoke_stoppable(task, token, next_attempt<IsBackup>(this)); },
+                    [this] (std::exception_ptr exception) { fail<IsBackup>(std::move(exception)); }
+                );
+            }
+
+            // Called by the timer or by the failed primary, either holding a reference.
+            void start_backup() {
+                if (state.value.load(std::memory_order_acquire) & won_bit)
+                    return;
+                if (backup_started.exchange(true, std::memory_order_acq_rel))
+                    return;
+                state.value.fetch_add(1, std::memory_order_relaxed);
+                cancel_timer();
+                backup_start = metrics_clock();
+                start_attempt<true>(backup);
+            }
+
+            template<bool IsBackup, typename ... Args>
+            void succeed(Args&& ... args) {
+                policy.record(metrics_clock() - (IsBackup ? backup_start : primary_start));
+                std::uint64_t expected = state.value.load(std::memory_order_relaxed);
+                while (!(expected & won_bit) && !state.value.compare_exchange_weak(
+                    expected, expected | won_bit, std::memory_order_acq_rel
+                ));
+                if (expected & won_bit) {
+                    release(1);
+                    return;
+                }
+                cancel_timer();
+                auto handler = std::move(final_handler);
+                stop_source stopping = losers;
+                release(1);
+                stopping.request_stop();
+                if constexpr (!wants_result)
+                    handler(error_type(nullptr));
+                else if constexpr (sizeof...(Args) == 1)
+                    handler(error_type(nullptr), std::forward<Args>(args)...);
+                else
+                    handler(error_type(nullptr), result_type(std::forward<Args>(args)...));
+            }
+
+            template<bool IsBackup>
+            void fail(error_type error) {
+                std::uint64_t previous = state.value.fetch_add(failure, std::memory_order_acq_rel);
+                if ((previous & won_bit) || (previous & ~won_bit) >> 32 != 1) {
+                    if (!IsBackup)
+                        start_backup();
+                    release(1);
+                    return;
+                }
+                auto handler = std::move(final_handler);
+                release(1);
+                if constexpr (wants_result)
+                    handler(std::move(error), result_type());
+                else
+                    handler(std::move(error));
+            }
+
+            void release(std::uint64_t count) {
+                std::uint64_t previous = state.value.fetch_sub(count, std::memory_order_acq_rel);
+                if ((previous & count_mask) == count)
+                    free_frame(this);
+            }
+        };
+
+    }
+
+    // Runs primary, and backup too if primary has not succeeded within policy.delay(), or as
+    // soon as primary fails, then completes with whichever succeeds first, or with the last
+    // error. Each success is recorded in the policy, timed from the attempt's own start. Either
+    // task may take a stop_token ahead of its callback, stopped when the other wins. The delay
+    // is waited in timers, so a backup started by it starts on the timers' executor.
+    template<
+        typename Primary,
+        typename Backup,
+        typename FinalHandler
+    >
+    inline void hedged(
+        hedging_policy& policy,
+        timer_queue& timers,
+        Primary&& primary,
+        Backup&& backup,
+        FinalHandler&& final_handler
+    ) {
+        using frame_t = detail::hedged_frame<std::decay_t<FinalHandler>, std::decay_t<Primary>, std::decay_t<Backup>>;
+        detail::make_frame<frame_t>(
+            policy, timers, std::forward<FinalHandler>(final_handler),
+            std::forward<Primary>(primary), std::forward<Backup>(backup)
+        )->start();
+    }
+
+    namespace detail
+    {
+
+        // One invocation of a step with a timeout. The invoker, the timer and the step's callback
+        // each hold a reference, the callback until it is called or destroyed; whichever of the
+        // step and the timer completes first exchanges done and passes its outcome on. An
+        // expiry while the step is still being invoked waits for the invocation to return, so
+        // that the chain, and the step with it, cannot be destroyed under the step.
+        template<typename Callback>
+        class timeout_op;
+
+        template<typename Error, typename ... Values, std::size_t InlineSize>
+        class timeout_op<continuation<void(Error, Values...), InlineSize>>
+        : public timer_queue::node
+        {
+            static_assert((std::is_default_constructible_v<Values> && ...),
+                "async::timeout passes timed_out with default-constructed values, so they must be default constructible");
+
+            using callback_type = continuation<void(Error, Values...), InlineSize>;
+
+            enum phase_type { invoking, returned, expired_while_invoking };
+
+            std::atomic<int> references;
+            std::atomic<bool> done;
+            std::atomic<int> phase;
+            callback_type next;
+            timer_queue* queue;
+            std::optional<stop_source> stop;
+
+            static void expire(timer_queue::node* n) {
+                auto* op = static_cast<timeout_op*>(n);
+                if (op->done.exchange(true, std::memory_order_acq_rel)) {
+                    op->release();
+                    return;
+                }
+                if (op->stop)
+                    op->stop->request_stop();
+                int expected = invoking;
+                if (op->phase.compare_exchange_strong(expected, expired_while_invoking, std::memory_order_acq_rel))
+                    return;
+                op->time_out();
+            }
+
+            // Passes the timeout on, with the timer's reference.
+            void time_out() {
+                auto callback = std::move(next);
+                release();
+                callback(status_error<Error>(status::timed_out), Values()...);
+            }
+
+            void release() {
+                if (references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    free_frame(this);
+            }
+
+        public:
+            // Move-only; gives up the callback's reference if destroyed without being called.
+            class completion
+            {
+                timeout_op* op;
+            public:
+                explicit completion(timeout_op* op) : op(op) {}
+                completion(completion&& other) noexcept : op(std::exchange(other.op, nullptr)) {}
+                completion& operator=(completion&&) = delete;
+                ~completion() {
+                    if (op)
+                        op->release();
+                }
+                void operator()(Error error, Values ... values) {
+                    std::exchange(op, nullptr)->complete(std::move(error), std::move(values)...);
+                }
+            };
+
+            timeout_op(callback_type&& next, timer_queue& queue, stop_token const* parent)
+            : timer_queue::node(&timeout_op::expire), references(3), done(false), phase(invoking),
+              next(std::move(next)), queue(&queue)
+            {
+                if (parent)
+                    stop.emplace(*parent);
+            }
+
+            stop_token token() const { return stop ? stop->get_token() : stop_token(); }
+
+            void complete(Error error, Values ... values) {
+                if (done.exchange(true, std::memory_order_acq_rel)) {
+                    release();
+                    return;
+                }
+                if (queue->cancel(this))
+                    release();
+                auto callback = std::move(next);
+                release();
+                callback(std::move(error), std::move(values)...);
+            }
+
+            // Called once the step's invocation has returned or thrown; a step that threw has
+            // failed, and must not also call its callback. Passes on a timeout that came during
+            // the invocation. True if the exception is the chain's to handle, which it is not
+            // once the op has completed.
+            bool invoked(bool threw) {
+                bool rethrow = false;
+                if (threw) {
+                    if (!done.exchange(true, std::memory_order_acq_rel)) {
+                        rethrow = true;
+                        if (queue->cancel(this))
+                            release();
+                    }
+                }
+                if (phase.exchange(returned, std::memory_order_acq_rel) == expired_while_invoking)
+                    time_out();
+                release();
+                return rethrow;
+            }
+        };
+
+        template<typename Step, typename Declared = step_declared_args_t<Step>, bool Stoppable = takes_stop_token_v<Step>>
+        class timeout_step;
+
+        // Has the signature of Step, so that it can stand in for it in a series.
+        template<typename Step, typename ... Args, bool Stoppable>
+        class timeout_step<Step, std::tuple<Args...>, Stoppable>
+        {
+            using callback_type = step_callback_t<Step>;
+            using op_type = timeout_op<callback_type>;
+
+        protected:
+            mutable Step step;
+            timer_queue* queue;
+            timer_queue::clock::duration duration;
+
+        public:
+            template<typename S>
+            timeout_step(S&& s, timer_queue& queue, timer_queue::clock::duration duration)
+            : step(std::forward<S>(s)), queue(&queue), duration(duration)
+            {}
+
+            void operator()(Args ... args, callback_type next) const {
+                op_type* op = make_frame<op_type>(std::move(next), *queue, nullptr);
+                start(op, [&] { step(std::forward<Args>(args)..., callback_type(typename op_type::completion(op))); });
+            }
+
+        protected:
+            // Touches nothing of the step's once the op has been told the invocation returned,
+            // as that may complete the chain.
+            template<typename Invoke>
+            void start(op_type* op, Invoke&& invoke) const {
+                queue->schedule(op, timer_queue::clock::now() + duration);
+#ifndef ASYNC_NO_EXCEPTIONS
+                std::exception_ptr exception;
+                try {
+                    invoke();
+                }
+                catch (...) {
+                    exception = std::current_exception();
+                }
+                if (op->invoked(exception != nullptr))
+                    std::rethrow_exception(std::move(exception));
+#else
+                invoke();
+                op->invoked(false);
+#endif
+            }
+        };
+
+        // For a step taking a stop_token: it is given a token stopped on expiry or by the
+        // chain's.
+        template<typename Step, typename ... Args>
+        class timeout_step<Step, std::tuple<Args...>, true>
+        : timeout_step<Step, std::tuple<Args...>, false>
+        {
+            using base = timeout_step<Step, std::tuple<Args...>, false>;
+            using callback_type = step_callback_t<Step>;
+            using op_type = timeout_op<callback_type>;
+
+        public:
+            using base::base;
+
+            void operator()(Args ... args, stop_token const& token, callback_type next) const {
+                op_type* op = make_frame<op_type>(std::move(next), *this->queue, &token);
+                this->start(op, [&] {
+                    this->step(std::forward<Args>(args)..., op->token(), callback_type(typename op_type::completion(op)));
+                });
+            }
+        };
+
+    }
+
+    // Wraps a step so that it completes with a timed_out error (a system_error of
+    // status::timed_out for exception_ptr chains) unless it completes within duration. The
+    // result takes what step takes; a step taking a stop_token ahead of its callback is given
+    // one stopped on expiry as well as by the token the result is given. A step that completes
+    // after its timeout is ignored, and so is an exception it throws after it; an expiry while
+    // the step is still being invoked is passed on once the invocation returns. The timed_out
+    // error comes with default-constructed values, so the step's values must be default
+    // constructible.
+    template<typename Step>
+    inline auto timeout(timer_queue& queue, Step&& step, timer_queue::clock::duration duration) {
+        return detail::timeout_step<std::decay_t<Step>>(std::forward<Step>(step), queue, duration);
+    }
+
+    // As above, timed by timer_queue::shared(), whose thread then continues timed-out chains.
+    template<typename Step>
+    inline auto timeout(Step&& step, timer_queue::clock::duration duration) {
+        return timeout(timer_queue::shared(), std::forward<Step>(step), duration);
+    }
+
+    // Retries every error.
+    struct retry_always
+    {
+        template<typename Error>
+        bool operator()(Error const&) const noexcept { return true; }
+    };
+
+    namespace detail
+    {
+
+        // A splitmix64 stream per thread, so that jitter takes no lock and shares no line.
+        inline std::uint64_t jitter_random() noexcept {
+            thread_local std::uint64_t state = metrics_clock() ^ reinterpret_cast<std::uintptr_t>(&state);
+            std::uint64_t z = (state += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            return z ^ (z >> 31);
+        }
+
+    }
+
+    // Retries shared by the calls of one backend, or by a whole process, so that retrying cannot
+    // multiply the load on a backend that is failing: a token bucket that each success fills by
+    // ratio of a retry, up to capacity, and that each retry must take a whole token from. Once
+    // most calls fail, retries fall from max_attempts - 1 a call to about ratio of the calls
+    // that still succeed. It starts full. One atomic holds the tokens, in thousandths; while it
+    // is full, the healthy case, successes only read it, and so share its cache line rather
+    // than contend for it. Concurrent deposits may overfill it by a few. Must outlive the
+    // policies drawing from it.
+    class retry_budget
+    {
+        static constexpr std::int64_t unit = 1000;
+
+        alignas(detail::cache_line_size) std::atomic<std::int64_t> tokens;
+        std::int64_t refill;
+        std::int64_t capacity;
+
+    public:
+        explicit retry_budget(double ratio = 0.1, double capacity = 100)
+        : tokens(static_cast<std::int64_t>(capacity * unit)), refill(static_cast<std::int64_t>(ratio * unit)),
+          capacity(static_cast<std::int64_t>(capacity * unit))
+        {}
+
+        retry_budget(retry_budget const&) = delete;
+        retry_budget& operator=(retry_budget const&) = delete;
+
+        // A budget for the whole process, with the default ratio and capacity.
+        static retry_budget& shared() {
+            static retry_budget budget;
+            return budget;
+        }
+
+        // For a success.
+        void deposit() noexcept {
+            if (tokens.load(std::memory_order_relaxed) < capacity)
+                tokens.fetch_add(refill, std::memory_order_relaxed);
+        }
+
+        // For a retry: takes a token if there is a whole one.
+        bool try_withdraw() noexcept {
+            std::int64_t current = tokens.load(std::memory_order_relaxed);
+            while (current >= unit)
+                if (tokens.compare_exchange_weak(current, current - unit, std::memory_order_relaxed))
+                    return true;
+            return false;
+        }
+
+        // The retries left.
+        double balance() const noexcept {
+            return static_cast<double>(tokens.load(std::memory_order_relaxed)) / unit;
+        }
+    };
+
+    // How retry re-invokes a failing step: up to max_attempts in all, for the errors retryable
+    // accepts, and with a token from the budget it draws from, if any. The wait after attempt n
+    // is drawn uniformly from zero to initial_delay times multiplier to the n - 1, capped at
+    // max_delay; this full jitter spreads out callers that failed together instead of retrying
+    // them in lockstep. Shared by every call it governs, and must outlive them.
+    template<typename Predicate = retry_always>
+    class retry_policy
+    {
+        Predicate retryable;
+        unsigned attempts;
+        double initial_delay;
+        double max_delay;
+        double multiplier;
+        retry_budget* budget = nullptr;
+
+    public:
+        explicit retry_policy(
+            unsigned max_attempts = 3,
+            std::chrono::nanoseconds initial_delay = std::chrono::milliseconds(10),
+            std::chrono::nanoseconds max_delay = std::chrono::seconds(1),
+            double multiplier = 2.0,
+            Predicate retryable = Predicate()
+        )
+        : retryable(std::move(retryable)), attempts(max_attempts > 0 ? max_attempts : 1),
+          initial_delay(static_cast<double>(initial_delay.count())),
+          max_delay(static_cast<double>(max_delay.count())), multiplier(multiplier)
+        {}
+
+        unsigned max_attempts() const noexcept { return attempts; }
+
+        // Makes every retry take a token from budget, and every success refill it. Set before
+        // the policy is used.
+        retry_policy& draw_from(retry_budget& b) noexcept {
+            budget = &b;
+            return *this;
+        }
+
+        // Whether to retry after attempt, counted from one, failed with error. Takes the
+        // retry's token if it will.
+        template<typename Error>
+        bool should_retry(Error const& error, unsigned attempt) const {
+            return attempt < attempts && retryable(error) && (!budget || budget->try_withdraw());
+        }
+
+        // For a call that has succeeded, on whichever attempt.
+        void succeeded() const noexcept {
+            if (budget)
+                budget->deposit();
+        }
+
+        // The longest wait after attempt.
+        std::chrono::nanoseconds backoff_ceiling(unsigned attempt) const noexcept {
+            double ceiling = initial_delay;
+            for (unsigned n = 1; n < attempt && ceiling < max_delay; n++)
+                ceiling *= multiplier;
+            return std::chrono::nanoseconds(static_cast<std::int64_t>(std::min(ceiling, max_delay)));
+        }
+
+        // The wait after attempt, with full jitter.
+        std::chrono::nanoseconds backoff(unsigned attempt) const noexcept {
+            auto ceiling = static_cast<std::uint64_t>(backoff_ceiling(attempt).count());
+            return std::chrono::nanoseconds(static_cast<std::int64_t>(detail::jitter_random() % (ceiling + 1)));
+        }
+    };
+
+    namespace detail
+    {
+
+        template<typename Policy, typename Step, typename FinalHandler, typename Callback = step_callback_t<Step>>
+        class retry_frame;
+
+        // Holds the step, the final handler and the attempt count across every attempt. Only
+        // one thing refers to it at a time: the running attempt or, between attempts, the
+        // timer, so it needs no count of references.
+        template<typename Policy, typename Step, typename FinalHandler, typename Error, typename ... Values, std::size_t InlineSize>
+        class retry_frame<Policy, Step, FinalHandler, continuation<void(Error, Values...), InlineSize>>
+        : public timer_queue::node
+        {
+            using result_type = typename task_result<std::tuple<Values...>>::type;
+
+            static_assert(function_traits<Step>::arity == 1, "retry's step must take only its callback");
+
+            static constexpr bool wants_result = function_traits<FinalHandler>::arity == 2;
+
+            static_assert(
+                std::is_same_v<
+                    typename function_traits<FinalHandler>::argument_tuple,
+                    std::conditional_t<wants_result, std::tuple<Error, result_type>, std::tuple<Error>>
+                >,
+                "retry's final handler must take (error) or (error, result)"
+            );
+
+            class next_attempt
+            {
+                retry_frame* frame;
+            public:
+                explicit next_attempt(retry_frame* frame) : frame(frame) {}
+                void operator()(Error error, Values ... values) const {
+                    frame->complete(std::move(error), std::move(values)...);
+                }
+            };
+
+            Policy const& policy;
+            timer_queue& timers;
+            Step step;
+            FinalHandler final_handler;
+            unsigned attempt;
+
+            static void expire(timer_queue::node* n) {
+                static_cast<retry_frame*>(n)->start();
+            }
+
+        public:
+            template<typename F, typename S>
+            retry_frame(Policy const& policy, timer_queue& timers, F&& final, S&& s)
+            : timer_queue::node(&retry_frame::expire), policy(policy), timers(timers), step(std::forward<S>(s)),
+              final_handler(std::forward<F>(final)), attempt(0)
+            {}
+
+            void start() {
+                attempt++;
+                guarded_call<noexcept(step(std::declval<next_attempt>()))>(
+                    [&] { step(next_attempt(this)); },
+                    [this] (std::exception_ptr exception) {
+                        complete(error_traits<Error>::from_exception(std::move(exception)), Values()...);
+                    }
+                );
+            }
+
+        private:
+            void complete(Error error, Values ... values) {
+                if (!error_traits<Error>::failed(error))
+                    policy.succeeded();
+                else if (policy.should_retry(error, attempt)) {
+                    timers.schedule(this, timer_queue::clock::now() + policy.backoff(attempt));
+                    return;
+                }
+                auto handler = std::move(final_handler);
+                free_frame(this);
+                if constexpr (!wants_result)
+                    handler(std::move(error));
+                else if constexpr (sizeof...(Values) == 1)
+                    handler(std::move(error), std::move(values)...);
+                else
+                    handler(std::move(error), result_type(std::move(values)...));
+            }
+        };
+
+    }
+
+    // Runs step, and again after a backoff each time it fails with an error policy retries,
+    // then completes with its first success or its last error. Every attempt reuses one frame.
+    // The backoffs are waited in timers, so a retry starts on the timers' executor. A step
+    // that throws has failed, and must not also call its callback.
+    template<
+        typename Policy,
+        typename Step,
+        typename FinalHandler
+    >
+    inline void retry(
+        Policy const& policy,
+        timer_queue& timers,
+        Step&& step,
+        FinalHandler&& final_handler
+    ) {
+        using frame_t = detail::retry_frame<Policy, std::decay_t<Step>, std::decay_t<FinalHandler>>;
+        detail::make_frame<frame_t>(
+            policy, timers, std::forward<FinalHandler>(final_handler), std::forward<Step>(step)
+        )->start();
+    }
+
+    // As above, waiting in timer_queue::shared(), whose thread then runs the retries.
+    template<
+        typename Policy,
+        typename Step,
+        typename FinalHandler
+    >
+    inline void retry(
+        Policy const& policy,
+        Step&& step,
+        FinalHandler&& final_handler
+    ) {
+        retry(policy, timer_queue::shared(), std::forward<Step>(step), std::forward<FinalHandler>(final_handler));
+    }
+
+    // Launches series(functions..., final) as an Asio initiating function: the final handler is
+    // produced from token and receives the error, so callbacks, use_future and use_awaitable work.
+    template<
+        typename CompletionToken,
+        typename ... Functions
+    >
+    inline auto async_series(
+        CompletionToken&& token,
+        Functions&& ... functions
+    ) {
+        return boost::asio::async_initiate<CompletionToken, void(error_type)>(
+            [] (auto handler, auto&& ... fs) {
+                auto executor = boost::asio::get_associated_executor(handler);
+                async::series(
+                    std::forward<decltype(fs)>(fs)...,
+                    [handler = std::move(handler), work = boost::asio::make_work_guard(executor)] (error_type error) mutable {
+                        auto executor = work.get_executor();
+                        boost::asio::dispatch(executor, [handler = std::move(handler), error = std::move(error)] () mutable {
+                            handler(std::move(error));
+                        });
+                        work.reset();
+                    }
+                );
+            },
+            token,
+            std::forward<Functions>(functions)...
+        );
+    }
+
+}
+
+namespace boost::asio
+{
+
+    // Lets a step pass its continuation straight to an Asio operation, as in
+    // timer.async_wait(std::move(next)); the error_code becomes the chain's error: a
+    // system_error for exception_ptr chains, itself for std::error_code ones, and a status.
+    template<
+        typename Error,
+        typename ... Args,
+        std::size_t InlineSize,
+        typename ... Values
+    >
+    class async_result<async::continuation<void(Error, Args...), InlineSize>, void(boost::system::error_code, Values...)>
+    {
+    public:
+        using completion_handler_type = async::detail::asio_next_handler<
+            async::continuation<void(Error, Args...), InlineSize>, Values...
+        >;
+        using return_type = void;
+
+        explicit async_result(completion_handler_type&) {}
+
+        return_type get() {}
+
+        template<typename Initiation, typename RawCompletionToken, typename ... InitArgs>
+        static return_type initiate(Initiation&& initiation, RawCompletionToken&& token, InitArgs&& ... args) {
+            std::move(initiation)(
+                completion_handler_type(std::forward<RawCompletionToken>(token)),
+                std::forward<InitArgs>(args)...
+            );
+        }
+    };
+
+}
@@ -0,0 +1,408 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+
+#include "async.hpp"
+
+#ifndef ASYNC_HISTOGRAM_SHARDS
+#define ASYNC_HISTOGRAM_SHARDS 8
+#endif
+
+namespace async
+{
+
+    namespace detail
+    {
+
+        inline std::uint64_t metrics_clock() noexcept {
+            return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()
+            ).count());
+        }
+
+        inline unsigned log2_floor(std::uint64_t value) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+            return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#else
+            unsigned log = 0;
+            while (value >>= 1)
+                log++;
+            return log;
+#endif
+        }
+
+        // Threads take shards round robin, so that up to ASYNC_HISTOGRAM_SHARDS threads never
+        // share one.
+        inline std::size_t histogram_shard() noexcept {
+            static std::atomic<std::size_t> next_shard{0};
+            static thread_local std::size_t const shard =
+                next_shard.fetch_add(1, std::memory_order_relaxed) % ASYNC_HISTOGRAM_SHARDS;
+            return shard;
+        }
+
+    }
+
+    // Latencies in nanoseconds, counted in buckets an eighth of an octave wide: any value is
+    // reported within 12.5%. Values from 2^41 ns, about 36 minutes, share the last bucket.
+    class latency_histogram
+    {
+    public:
+        static constexpr unsigned sub_bucket_bits = 3;
+        static constexpr std::size_t sub_buckets = std::size_t(1) << sub_bucket_bits;
+        static constexpr unsigned max_log2 = 40;
+        static constexpr std::size_t bucket_count = (max_log2 - sub_bucket_bits + 2) * sub_buckets;
+
+        static std::size_t bucket_of(std::uint64_t value) noexcept {
+            if (value < sub_buckets)
+                return static_cast<std::size_t>(value);
+            unsigned log = detail::log2_floor(value);
+            if (log > max_log2)
+                return bucket_count - 1;
+            std::size_t sub = static_cast<std::size_t>(value >> (log - sub_bucket_bits)) & (sub_buckets - 1);
+            return (log - sub_bucket_bits + 1) * sub_buckets + sub;
+        }
+
+        // The largest value counted in bucket.
+        static std::uint64_t bucket_limit(std::size_t bucket) noexcept {
+            if (bucket < sub_buckets)
+                return bucket;
+            unsigned shift = static_cast<unsigned>(bucket / sub_buckets) - 1;
+            std::uint64_t first = std::uint64_t(sub_buckets + bucket % sub_buckets) << shift;
+            return first + (std::uint64_t(1) << shift) - 1;
+        }
+
+        // The shards merged at one point in time.
+        struct snapshot
+        {
+            std::array<std::uint64_t, bucket_count> counts{};
+            std::uint64_t count = 0;
+            std::uint64_t sum = 0;
+
+            // The smallest bucket limit at or below which a fraction q of the values lie; zero
+            // when nothing has been recorded.
+            std::uint64_t value_at_quantile(double q) const noexcept {
+                if (count == 0)
+                    return 0;
+                std::uint64_t rank = static_cast<std::uint64_t>(q * double(count) + 0.5);
+                rank = rank < 1 ? 1 : rank > count ? count : rank;
+                std::uint64_t seen = 0;
+                for (std::size_t bucket = 0; bucket < bucket_count; bucket++) {
+                    seen += counts[bucket];
+                    if (seen >= rank)
+                        return bucket_limit(bucket);
+                }
+                return bucket_limit(bucket_count - 1);
+            }
+        };
+
+        latency_histogram() = default;
+        latency_histogram(latency_histogram const&) = delete;
+        latency_histogram& operator=(latency_histogram const&) = delete;
+
+        void record(std::uint64_t nanoseconds) noexcept {
+            auto& shard = shards[detail::histogram_shard()];
+            shard.counts[bucket_of(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+            shard.sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+        }
+
+        // Safe to call while other threads record; their latest values may be missed.
+        snapshot read() const noexcept {
+            snapshot merged;
+            for (auto const& shard : shards) {
+                for (std::size_t bucket = 0; bucket < bucket_count; bucket++) {
+                    std::uint64_t n = shard.counts[bucket].load(std::memory_order_relaxed);
+                    merged.counts[bucket] += n;
+                    merged.count += n;
+                }
+                merged.sum += shard.sum.load(std::memory_order_relaxed);
+            }
+            return merged;
+        }
+
+    private:
+        struct alignas(detail::cache_line_size) shard_type
+        {
+            std::atomic<std::uint64_t> counts[bucket_count]{};
+            std::atomic<std::uint64_t> sum{0};
+        };
+
+        shard_type shards[ASYNC_HISTOGRAM_SHARDS];
+    };
+
+    // The end-to-end and per-step latencies of a named pipeline's runs. Every live instance is
+    // listed for the exporters.
+    class pipeline_metrics
+    {
+        std::string pipeline_name;
+        std::size_t steps;
+        latency_histogram end_to_end;
+        std::unique_ptr<latency_histogram[]> step_histograms;
+
+    public:
+        pipeline_metrics* previous = nullptr;
+        pipeline_metrics* next = nullptr;
+
+        pipeline_metrics(std::string name, std::size_t step_count);
+        ~pipeline_metrics();
+
+        pipeline_metrics(pipeline_metrics const&) = delete;
+        pipeline_metrics& operator=(pipeline_metrics const&) = delete;
+
+        std::string const& name() const noexcept { return pipeline_name; }
+        std::size_t step_count() const noexcept { return steps; }
+
+        latency_histogram& total() noexcept { return end_to_end; }
+        latency_histogram const& total() const noexcept { return end_to_end; }
+
+        latency_histogram& step(std::size_t index) noexcept { return step_histograms[index]; }
+        latency_histogram const& step(std::size_t index) const noexcept { return step_histograms[index]; }
+    };
+
+    namespace detail
+    {
+
+        struct metrics_registry
+        {
+            std::mutex mutex;
+            pipeline_metrics* head = nullptr;
+
+            static metrics_registry& instance() {
+                static metrics_registry registry;
+                return registry;
+            }
+        };
+
+        // A borrowed chain that times its steps and the whole run into a pipeline's metrics. A
+        // step's time runs from its invocation to its completion, on whichever thread. Pipelines
+        // invoke each step as soon as the one before completes, so one clock read per step does.
+        template<typename Storage, typename FinalHandler>
+        class observed_chain
+        : public borrowed_chain<Storage, FinalHandler>
+        {
+            pipeline_metrics* metrics;
+            std::uint64_t chain_start;
+            // When the chain started or its latest step completed.
+            std::uint64_t last_event;
+            std::size_t step;
+
+        public:
+            template<typename F>
+            observed_chain(Storage const& steps, pipeline_metrics& metrics, F&& final)
+            : borrowed_chain<Storage, FinalHandler>(steps, std::forward<F>(final)),
+              metrics(&metrics), chain_start(metrics_clock()), last_event(chain_start), step(0)
+            {}
+
+            void step_started(std::size_t index) noexcept {
+                step = index;
+            }
+
+            void step_finished() noexcept {
+                std::uint64_t now = metrics_clock();
+                metrics->step(step).record(now - last_event);
+                last_event = now;
+            }
+
+            void finished() noexcept {
+                metrics->total().record(last_event - chain_start);
+            }
+        };
+
+        template<typename Storage, size_t ... Is, typename ... Arguments>
+        inline void start_named_pipeline(
+            Storage const& steps,
+            pipeline_metrics& metrics,
+            std::index_sequence<Is...>,
+            std::tuple<Arguments...> arguments
+        ) {
+            constexpr size_t last = sizeof...(Is);
+            using final_t = std::decay_t<std::tuple_element_t<last, std::tuple<Arguments...>>>;
+            using frame_t = series_frame<inline_dispatcher, observed_chain<Storage, final_t>>;
+            make_frame<frame_t>(inline_dispatcher(), steps, metrics, std::get<last>(std::move(arguments)))
+                ->start(std::get<Is>(std::move(arguments))...);
+        }
+
+        template<typename Storage, size_t ... Is, typename ... Arguments>
+        inline void start_named_pipeline(
+            stop_token token,
+            Storage const& steps,
+            pipeline_metrics& metrics,
+            std::index_sequence<Is...>,
+            std::tuple<Arguments...> arguments
+        ) {
+            constexpr size_t last = sizeof...(Is);
+            using final_t = std::decay_t<std::tuple_element_t<last, std::tuple<Arguments...>>>;
+            using frame_t = series_frame<inline_dispatcher, stoppable_chain<observed_chain<Storage, final_t>>>;
+            make_frame<frame_t>(inline_dispatcher(), std::move(token), steps, metrics, std::get<last>(std::move(arguments)))
+                ->start(std::get<Is>(std::move(arguments))...);
+        }
+
+        inline void write_prometheus_label(std::ostream& out, std::string const& value) {
+            for (char c : value) {
+                if (c == '\\' || c == '"')
+                    out << '\\' << c;
+                else if (c == '\n')
+                    out << "\\n";
+                else
+                    out << c;
+            }
+        }
+
+        inline void write_prometheus_summary(
+            std::ostream& out,
+            char const* metric,
+            std::string const& pipeline,
+            std::size_t const* step,
+            latency_histogram::snapshot const& values
+        ) {
+            static constexpr std::pair<char const*, double> quantiles[] = {
+                { "0.5", 0.5 }, { "0.9", 0.9 }, { "0.99", 0.99 }, { "0.999", 0.999 }
+            };
+            auto labels = [&] {
+                out << "{pipeline=\"";
+                write_prometheus_label(out, pipeline);
+                out << '"';
+                if (step)
+                    out << ",step=\"" << *step << '"';
+            };
+            for (auto const& quantile : quantiles) {
+                out << metric;
+                labels();
+                out << ",quantile=\"" << quantile.first << "\"} "
+                    << double(values.value_at_quantile(quantile.second)) * 1e-9 << '\n';
+            }
+            out << metric << "_sum";
+            labels();
+            out << "} " << double(values.sum) * 1e-9 << '\n';
+            out << metric << "_count";
+            labels();
+            out << "} " << values.count << '\n';
+        }
+
+    }
+
+    inline pipeline_metrics::pipeline_metrics(std::string name, std::size_t step_count)
+    : pipeline_name(std::move(name)), steps(step_count), step_histograms(new latency_histogram[step_count])
+    {
+        auto& registry = detail::metrics_registry::instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        next = registry.head;
+        if (next)
+            next->previous = this;
+        registry.head = this;
+    }
+
+    inline pipeline_metrics::~pipeline_metrics() {
+        auto& registry = detail::metrics_registry::instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        if (previous)
+            previous->next = next;
+        else
+            registry.head = next;
+        if (next)
+            next->previous = previous;
+    }
+
+    // A pipeline that records how long each of its runs and each of their steps take, under a
+    // name the exporters report it by. Recording costs a clock read and two relaxed increments
+    // per step; the histograms are allocated once, with the pipeline.
+    template<typename ... Steps>
+    class named_pipeline
+    {
+        using steps_type = detail::step_storage_for<Steps...>;
+        using traits = detail::series_traits<steps_type, sizeof...(Steps)>;
+
+        steps_type steps;
+        std::unique_ptr<pipeline_metrics> latencies;
+
+    public:
+        typedef typename traits::template in_args_t<0> argument_tuple;
+
+        template<typename ... S>
+        named_pipeline(std::string name, std::in_place_t, S&& ... s)
+        : steps(std::in_place, std::forward<S>(s)...),
+          latencies(new pipeline_metrics(std::move(name), sizeof...(Steps)))
+        {}
+
+        pipeline_metrics const& metrics() const noexcept { return *latencies; }
+
+        // As pipeline::run.
+        template<typename ... Arguments>
+        void run(Arguments&& ... arguments) const {
+            static_assert(sizeof...(Arguments) > 0, "run needs a final handler");
+            detail::start_named_pipeline(
+                steps,
+                *latencies,
+                std::make_index_sequence<sizeof...(Arguments) - 1>(),
+                std::forward_as_tuple(std::forward<Arguments>(arguments)...)
+            );
+        }
+
+        // As pipeline::run with a stop_token.
+        template<typename ... Arguments>
+        void run(stop_token token, Arguments&& ... arguments) const {
+            static_assert(sizeof...(Arguments) > 0, "run needs a final handler");
+            detail::start_named_pipeline(
+                std::move(token),
+                steps,
+                *latencies,
+                std::make_index_sequence<sizeof...(Arguments) - 1>(),
+                std::forward_as_tuple(std::forward<Arguments>(arguments)...)
+            );
+        }
+    };
+
+    template<typename ... Steps>
+    inline named_pipeline<std::decay_t<Steps>...> make_named_pipeline(std::string name, Steps&& ... steps) {
+        return named_pipeline<std::decay_t<Steps>...>(std::move(name), std::in_place, std::forward<Steps>(steps)...);
+    }
+
+    // Writes the latencies of every live named pipeline in the Prometheus text format, as
+    // summaries in seconds with their 0.5, 0.9, 0.99 and 0.999 quantiles.
+    inline void write_metrics(std::ostream& out) {
+        auto& registry = detail::metrics_registry::instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        out << "# HELP async_pipeline_duration_seconds Latency of named pipeline runs, from start to final handler.\n"
+            << "# TYPE async_pipeline_duration_seconds summary\n";
+        for (auto* metrics = registry.head; metrics; metrics = metrics->next)
+            detail::write_prometheus_summary(out, "async_pipeline_duration_seconds", metrics->name(), nullptr, metrics->total().read());
+        out << "# HELP async_pipeline_step_duration_seconds Latency of named pipeline steps, from invocation to completion.\n"
+            << "# TYPE async_pipeline_step_duration_seconds summary\n";
+        for (auto* metrics = registry.head; metrics; metrics = metrics->next)
+            for (std::size_t step = 0; step < metrics->step_count(); step++)
+                detail::write_prometheus_summary(out, "async_pipeline_step_duration_seconds", metrics->name(), &step, metrics->step(step).read());
+    }
+
+    // As above, replacing the file at path in one rename, so that a collector reading it (such
+    // as node_exporter's textfile collector) never sees half of it. On failure the temporary
+    // file is removed and path left as it was.
+    inline bool write_metrics(std::string const& path) {
+        std::string temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::trunc);
+            write_metrics(out);
+            out.flush();
+            if (!out) {
+                out.close();
+                std::remove(temporary.c_str());
+                return false;
+            }
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+}
@@ -0,0 +1,392 @@
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "async.hpp"
+
+namespace async
+{
+
+    // Where task frames come from. The default draws them from the same per-thread pools as
+    // chain frames; set_task_allocator installs another pair.
+    struct task_allocator
+    {
+        void* (*allocate)(std::size_t size);
+        void (*deallocate)(void* p, std::size_t size);
+    };
+
+    namespace detail
+    {
+
+        template<std::size_t Size>
+        using task_pool = frame_pool<Size, __STDCPP_DEFAULT_NEW_ALIGNMENT__>;
+
+        template<std::size_t Size = cache_line_size>
+        inline void* pooled_allocate(std::size_t size) {
+            if constexpr (Size > 4096) {
+                count_allocation(allocation_event::heap_allocation, size);
+                return ::operator new(size);
+            }
+            else if (size <= Size)
+                return task_pool<Size>::allocate();
+            else
+                return pooled_allocate<Size * 2>(size);
+        }
+
+        template<std::size_t Size = cache_line_size>
+        inline void pooled_deallocate(void* p, std::size_t size) {
+            if constexpr (Size > 4096)
+                ::operator delete(p);
+            else if (size <= Size)
+                task_pool<Size>::deallocate(p);
+            else
+                pooled_deallocate<Size * 2>(p, size);
+        }
+
+        inline std::atomic<task_allocator const*>& task_allocator_slot();
+
+        // Every frame records the deallocate it must go back to, so that changing the allocator
+        // while tasks are alive is safe.
+        struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) task_frame_header
+        {
+            void (*deallocate)(void* p, std::size_t size);
+        };
+
+        struct task_promise_storage
+        {
+            static void* operator new(std::size_t size) {
+                task_allocator const* allocator = task_allocator_slot().load(std::memory_order_acquire);
+                auto* header = static_cast<task_frame_header*>(allocator->allocate(size + sizeof(task_frame_header)));
+                header->deallocate = allocator->deallocate;
+                return header + 1;
+            }
+
+            static void operator delete(void* p, std::size_t size) {
+                auto* header = static_cast<task_frame_header*>(p) - 1;
+                header->deallocate(header, size + sizeof(task_frame_header));
+            }
+        };
+
+        template<typename T>
+        class task_promise_base
+        : public task_promise_storage
+        {
+        protected:
+            std::variant<std::monostate, T, std::exception_ptr> result;
+
+        public:
+            template<typename U>
+            void return_value(U&& value) {
+                result.template emplace<1>(std::forward<U>(value));
+            }
+
+            T take_result() {
+                if (result.index() == 2)
+                    std::rethrow_exception(std::get<2>(result));
+                return std::move(std::get<1>(result));
+            }
+
+            void unhandled_exception() {
+                result.template emplace<2>(std::current_exception());
+            }
+        };
+
+        template<>
+        class task_promise_base<void>
+        : public task_promise_storage
+        {
+        protected:
+            std::exception_ptr error;
+
+        public:
+            void return_void() {}
+
+            void take_result() {
+                if (error)
+                    std::rethrow_exception(error);
+            }
+
+            void unhandled_exception() {
+                error = std::current_exception();
+            }
+        };
+
+    }
+
+    inline task_allocator const& pooled_task_allocator() {
+        static constexpr task_allocator pooled = { &detail::pooled_allocate<>, &detail::pooled_deallocate<> };
+        return pooled;
+    }
+
+    namespace detail
+    {
+
+        inline std::atomic<task_allocator const*>& task_allocator_slot() {
+            static std::atomic<task_allocator const*> slot{ &pooled_task_allocator() };
+            return slot;
+        }
+
+    }
+
+    // The allocator must outlive every task started after the call.
+    inline void set_task_allocator(task_allocator const& allocator) {
+        detail::task_allocator_slot().store(&allocator, std::memory_order_release);
+    }
+
+    // A lazily started coroutine producing a T. Awaiting it starts it, and the awaiter is resumed
+    // by symmetric transfer when it finishes.
+    template<typename T = void>
+    class task
+    {
+    public:
+        typedef T value_type;
+
+        class promise_type
+        : public detail::task_promise_base<T>
+        {
+            friend class task;
+
+            std::coroutine_handle<> continuation;
+
+            struct final_awaiter
+            {
+                bool await_ready() noexcept { return false; }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                    return handle.promise().continuation;
+                }
+
+                void await_resume() noexcept {}
+            };
+
+        public:
+            task get_return_object() {
+                return task(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            final_awaiter final_suspend() noexcept { return {}; }
+        };
+
+        task(task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+        task& operator=(task&& other) noexcept {
+            if (this != &other) {
+                if (handle)
+                    handle.destroy();
+                handle = std::exchange(other.handle, nullptr);
+            }
+            return *this;
+        }
+
+        ~task() {
+            if (handle)
+                handle.destroy();
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+            handle.promise().continuation = awaiter;
+            return handle;
+        }
+
+        T await_resume() {
+            return handle.promise().take_result();
+        }
+
+    private:
+        explicit task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    namespace detail
+    {
+
+        // Runs eagerly and frees itself when done; used to start a task from callback code.
+        struct detached_task
+        {
+            struct promise_type
+            : task_promise_storage
+            {
+                detached_task get_return_object() { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { std::terminate(); }
+            };
+        };
+
+        template<typename T>
+        struct task_values
+        {
+            typedef std::tuple<T> type;
+        };
+
+        template<>
+        struct task_values<void>
+        {
+            typedef std::tuple<> type;
+        };
+
+        template<typename T, typename Callback>
+        detached_task run_task(task<T> work, Callback next) {
+            static_assert(std::is_void_v<T> || std::is_default_constructible_v<T>,
+                "a failed task<T> is passed on with a default-constructed T, so T must be default constructible");
+            std::exception_ptr error;
+            if constexpr (std::is_void_v<T>) {
+#ifdef ASYNC_NO_EXCEPTIONS
+                co_await std::move(work);
+#else
+                try {
+                    co_await std::move(work);
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+#endif
+                next(std::move(error));
+            }
+            else {
+                std::optional<T> value;
+#ifdef ASYNC_NO_EXCEPTIONS
+                value.emplace(co_await std::move(work));
+#else
+                try {
+                    value.emplace(co_await std::move(work));
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+#endif
+                if (value)
+                    next(nullptr, std::move(*value));
+                else
+                    next(std::move(error), T{});
+            }
+        }
+
+        template<typename Function, typename ArgumentTuple>
+        class task_step;
+
+        template<typename Function, typename ... Args>
+        class task_step<Function, std::tuple<Args...>>
+        {
+            using result_type = typename std::invoke_result_t<Function const&, Args...>::value_type;
+
+            template<typename Values>
+            struct callback_for;
+
+            template<typename ... Values>
+            struct callback_for<std::tuple<Values...>>
+            {
+                typedef callback<Values...> type;
+            };
+
+            Function function;
+
+        public:
+            explicit task_step(Function function) : function(std::move(function)) {}
+
+            void operator()(Args ... args, typename callback_for<typename task_values<result_type>::type>::type next) const {
+                run_task(function(std::move(args)...), std::move(next));
+            }
+        };
+
+        // Awaits a callback-style step: the coroutine resumes when the step calls next.
+        template<typename Step>
+        class callback_awaitable
+        {
+            using values_type = typename callback_traits<step_callback_t<Step>>::argument_tuple;
+
+            template<typename Values = values_type>
+            class resume_next;
+
+            template<typename ... Values>
+            class resume_next<std::tuple<Values...>>
+            {
+                callback_awaitable* awaitable;
+            public:
+                explicit resume_next(callback_awaitable* awaitable) : awaitable(awaitable) {}
+                void operator()(error_type error, Values ... values) const {
+                    awaitable->complete(std::move(error), std::move(values)...);
+                }
+            };
+
+            Step step;
+            std::coroutine_handle<> handle;
+            std::atomic<bool> completed_or_suspended;
+            error_type error;
+            std::optional<values_type> values;
+
+            template<typename ... Values>
+            void complete(error_type step_error, Values&& ... step_values) {
+                if (step_error)
+                    error = std::move(step_error);
+                else
+                    values.emplace(std::forward<Values>(step_values)...);
+                // Whichever of the step and await_suspend comes second carries on.
+                if (completed_or_suspended.exchange(true, std::memory_order_acq_rel))
+                    handle.resume();
+            }
+
+        public:
+            explicit callback_awaitable(Step step)
+            : step(std::move(step)), completed_or_suspended(false)
+            {}
+
+            bool await_ready() const noexcept { return false; }
+
+            bool await_suspend(std::coroutine_handle<> awaiter) {
+                handle = awaiter;
+                step(resume_next<>(this));
+                return !completed_or_suspended.exchange(true, std::memory_order_acq_rel);
+            }
+
+            auto await_resume() {
+                if (error)
+                    std::rethrow_exception(error);
+                if constexpr (std::tuple_size_v<values_type> == 1)
+                    return std::move(std::get<0>(*values));
+                else if constexpr (std::tuple_size_v<values_type> > 1)
+                    return std::move(*values);
+            }
+        };
+
+    }
+
+    // co_await from_callback(step) runs a step taking only a callback and yields what it passes
+    // to the callback: nothing, a single value, or a tuple; an error is rethrown.
+    template<typename Step>
+    inline detail::callback_awaitable<std::decay_t<Step>> from_callback(Step&& step) {
+        return detail::callback_awaitable<std::decay_t<Step>>(std::forward<Step>(step));
+    }
+
+    // Starts a task from callback code; final_handler gets (error_type) or (error_type, T). A
+    // task that fails passes a default-constructed T with its error, so T must be default
+    // constructible.
+    template<typename T, typename FinalHandler>
+    inline void start(task<T> work, FinalHandler&& final_handler) {
+        detail::run_task(std::move(work), std::decay_t<FinalHandler>(std::forward<FinalHandler>(final_handler)));
+    }
+
+    // Adapts a function returning task<T> into a step for series: it takes the function's
+    // arguments followed by callback<T> (callback<> for task<void>). As with start, T must be
+    // default constructible.
+    template<typename Function>
+    inline auto task_step(Function&& function) {
+        using function_t = std::decay_t<Function>;
+        return detail::task_step<function_t, typename detail::function_traits<function_t>::argument_tuple>(
+            std::forward<Function>(function)
+        );
+    }
+
+}
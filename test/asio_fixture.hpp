@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+
+
+namespace asio = boost::asio;
+
+
+
+template<int ThreadCount>
+class AsioFixture
+{
+public:
+    std::atomic_bool stop;
+    asio::io_service ios;
+    asio::io_service::work work;
+    std::vector<std::thread> threads;
+
+    AsioFixture() : ios(), work(ios) {
+        stop = false;
+        for (int i = 0; i < ThreadCount; i++)
+            threads.emplace_back([this](){
+                while (!stop)
+                    ios.run();
+            });
+    }
+
+    ~AsioFixture() {
+        stop = true;
+        ios.stop();
+        for (auto& t : threads)
+            t.join();
+    }
+};
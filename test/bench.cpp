@@ -0,0 +1,864 @@
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define BOOST_THREAD_PROVIDES_FUTURE
+#include <boost/thread/future.hpp>
+
+#include "../include/async.hpp"
+#include "../include/async_asio.hpp"
+#include "../include/async_metrics.hpp"
+#include "../include/async_task.hpp"
+
+#include "asio_fixture.hpp"
+
+
+
+static std::atomic<std::size_t> allocation_count{0};
+
+void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+
+
+// User-space instructions retired by this thread and, when inherited, by the threads it starts
+// afterwards; their counts are only added in once they exit. NaN where perf events are not
+// available.
+class instruction_counter
+{
+#ifdef __linux__
+    int fd;
+
+public:
+    explicit instruction_counter(bool inherit = false) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.disabled = 1;
+        attr.inherit = inherit;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    ~instruction_counter() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    void start() {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    double stop() {
+        std::uint64_t count;
+        if (fd < 0)
+            return std::numeric_limits<double>::quiet_NaN();
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+            return std::numeric_limits<double>::quiet_NaN();
+        return double(count);
+    }
+#else
+public:
+    explicit instruction_counter(bool = false) {}
+    void start() {}
+    double stop() { return std::numeric_limits<double>::quiet_NaN(); }
+#endif
+};
+
+
+
+struct result {
+    double ns_per_hop;
+    double allocations_per_chain;
+    double instructions_per_hop;
+};
+
+// A hop is one step handing its results on to the next step or the final handler.
+template<typename Body>
+result measure(std::size_t iterations, std::size_t hops_per_chain, Body&& body) {
+    for (std::size_t i = 0; i < iterations / 10; i++)
+        body();
+    instruction_counter instructions;
+    auto allocations_before = allocation_count.load();
+    auto start = std::chrono::steady_clock::now();
+    instructions.start();
+    for (std::size_t i = 0; i < iterations; i++)
+        body();
+    double instruction_count = instructions.stop();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    auto allocations = allocation_count.load() - allocations_before;
+    double hops = double(iterations) * hops_per_chain;
+    return {
+        std::chrono::duration<double, std::nano>(elapsed).count() / hops,
+        allocations / double(iterations),
+        instruction_count / hops
+    };
+}
+
+// Starts chain_count chains at once, start(ios, done) starting one that calls done() at its end,
+// and waits for them; once as a warm-up, then measured. Instructions cover every thread over both
+// rounds, fixture start-up included.
+template<int ThreadCount, typename Start>
+result measure_posted(std::size_t chain_count, std::size_t hops_per_chain, Start&& start) {
+    instruction_counter instructions(true);
+    instructions.start();
+    std::chrono::steady_clock::duration elapsed;
+    std::size_t allocations;
+    {
+        AsioFixture<ThreadCount> fixture;
+        auto run = [&] {
+            std::atomic<std::size_t> chains_left{chain_count};
+            boost::promise<void> done;
+            auto future = done.get_future();
+            auto on_done = [&] {
+                if (--chains_left == 0)
+                    done.set_value();
+            };
+            for (std::size_t i = 0; i < chain_count; i++)
+                start(fixture.ios, on_done);
+            future.get();
+        };
+        run();
+        auto allocations_before = allocation_count.load();
+        auto begin = std::chrono::steady_clock::now();
+        run();
+        elapsed = std::chrono::steady_clock::now() - begin;
+        allocations = allocation_count.load() - allocations_before;
+    }
+    double instruction_count = instructions.stop();
+    double hops = double(chain_count) * hops_per_chain;
+    return {
+        std::chrono::duration<double, std::nano>(elapsed).count() / hops,
+        allocations / double(chain_count),
+        instruction_count / (2 * hops)
+    };
+}
+
+
+
+// A measurement as written to JSON. completion is null for those not made of hops.
+struct record {
+    std::string name;
+    char const* completion;
+    int threads;
+    std::vector<std::pair<char const*, double>> values;
+};
+
+static std::vector<record> records;
+
+void report(char const* name, char const* completion, int threads, result r) {
+    std::string label = std::string(name) + " [" + completion;
+    if (threads)
+        label += ", " + std::to_string(threads) + (threads == 1 ? " thread" : " threads");
+    label += "]";
+    char instructions[32] = "n/a";
+    if (r.instructions_per_hop == r.instructions_per_hop)
+        std::snprintf(instructions, sizeof(instructions), "%.1f", r.instructions_per_hop);
+    std::printf("%-56s %10.2f ns/hop %8.3f allocs/chain %8s instr/hop\n",
+        label.c_str(), r.ns_per_hop, r.allocations_per_chain, instructions);
+    records.push_back({name, completion, threads, {
+        {"ns_per_hop", r.ns_per_hop},
+        {"allocations_per_chain", r.allocations_per_chain},
+        {"instructions_per_hop", r.instructions_per_hop}
+    }});
+}
+
+void report(char const* name, result r) {
+    report(name, "inline", 0, r);
+}
+
+// Records what a benchmark that prints its own line measured.
+void record_values(std::string name, int threads, std::vector<std::pair<char const*, double>> values) {
+    records.push_back({std::move(name), nullptr, threads, std::move(values)});
+}
+
+std::string json_number(double value) {
+    if (value != value)
+        return "null";
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.3f", value);
+    return text;
+}
+
+// One JSON object per line, so that runs can be appended to a file and compared.
+bool write_json(char const* path) {
+    FILE* out = std::fopen(path, "w");
+    if (!out)
+        return false;
+    for (auto const& record : records) {
+        std::fprintf(out, "{\"name\": \"%s\", ", record.name.c_str());
+        if (record.completion)
+            std::fprintf(out, "\"completion\": \"%s\", ", record.completion);
+        std::fprintf(out, "\"threads\": %d", record.threads);
+        for (auto const& value : record.values)
+            std::fprintf(out, ", \"%s\": %s", value.first, json_number(value.second).c_str());
+        std::fprintf(out, "}\n");
+    }
+    return std::fclose(out) == 0;
+}
+
+
+
+// Completes a hop by calling next at once, or by posting the call to an io_service.
+struct inline_completion
+{
+    template<typename Next, typename ... Args>
+    void operator()(Next& next, Args ... args) const {
+        next(nullptr, args...);
+    }
+};
+
+struct posted_completion
+{
+    asio::io_service* ios;
+
+    template<typename Next, typename ... Args>
+    void operator()(Next& next, Args ... args) const {
+        asio::post(*ios, [next = std::move(next), args...] () mutable { next(nullptr, args...); });
+    }
+};
+
+// Three hops each; the series chains differ in how many arguments each step hands on.
+struct simple_series_chain
+{
+    template<typename Completion, typename Done>
+    void operator()(Completion complete, Done const& done) const {
+        async::simple_series(
+            [complete] (auto next) { complete(next); },
+            [complete] (auto next) { complete(next); },
+            [complete] (auto next) { complete(next); },
+            [&done] (async::error_type) { done(); }
+        );
+    }
+};
+
+struct series_0_chain
+{
+    template<typename Completion, typename Done>
+    void operator()(Completion complete, Done const& done) const {
+        async::series(
+            [complete] (async::callback<> next) { complete(next); },
+            [complete] (async::callback<> next) { complete(next); },
+            [complete] (async::callback<> next) { complete(next); },
+            [&done] (async::error_type) { done(); }
+        );
+    }
+};
+
+struct series_1_chain
+{
+    template<typename Completion, typename Done>
+    void operator()(Completion complete, Done const& done) const {
+        async::series(
+            [complete] (async::callback<int> next) { complete(next, 1); },
+            [complete] (int x, async::callback<int> next) { complete(next, x + 1); },
+            [complete] (int, async::callback<> next) { complete(next); },
+            [&done] (async::error_type) { done(); }
+        );
+    }
+};
+
+struct series_3_chain
+{
+    template<typename Completion, typename Done>
+    void operator()(Completion complete, Done const& done) const {
+        async::series(
+            [complete] (async::callback<int, int, int> next) { complete(next, 1, 2, 3); },
+            [complete] (int x, int y, int z, async::callback<int, int, int> next) { complete(next, y, z, x); },
+            [complete] (int, int, int, async::callback<> next) { complete(next); },
+            [&done] (async::error_type) { done(); }
+        );
+    }
+};
+
+// series_1_chain nested by hand, with no library code in between: the floor for the others.
+struct raw_callback_chain
+{
+    template<typename Completion, typename Done>
+    void operator()(Completion complete, Done const& done) const {
+        auto final_handler = [&done] (async::error_type) { done(); };
+        auto third = [complete, final_handler] (async::error_type, int) mutable { complete(final_handler); };
+        auto second = [complete, third] (async::error_type, int x) mutable { complete(third, x + 1); };
+        complete(second, 1);
+    }
+};
+
+template<int ThreadCount, typename Chain>
+void bench_posted_hops(char const* name, Chain chain) {
+    constexpr std::size_t chain_count = 50000;
+    report(name, "posted", ThreadCount, measure_posted<ThreadCount>(chain_count, 3, [&] (asio::io_service& ios, auto const& done) {
+        chain(posted_completion{&ios}, done);
+    }));
+}
+
+template<typename Chain>
+void bench_hops(char const* name, Chain chain) {
+    constexpr std::size_t iterations = 1000000;
+    volatile std::size_t completed = 0;
+    auto done = [&] { completed = completed + 1; };
+    report(name, "inline", 0, measure(iterations, 3, [&] { chain(inline_completion(), done); }));
+    bench_posted_hops<1>(name, chain);
+    bench_posted_hops<2>(name, chain);
+    bench_posted_hops<4>(name, chain);
+    bench_posted_hops<8>(name, chain);
+}
+
+
+
+template<int ThreadCount>
+void bench_each_limit(std::size_t item_count) {
+    AsioFixture<ThreadCount> fixture;
+    std::vector<int> items(item_count, 1);
+    for (std::size_t limit = 1; limit <= 64; limit *= 2) {
+        boost::promise<void> done;
+        auto future = done.get_future();
+        auto start = std::chrono::steady_clock::now();
+        async::each_limit(
+            items,
+            limit,
+            [&] (int, async::callback<> next) {
+                asio::post(fixture.ios, [next = std::move(next)] () { next(nullptr); });
+            },
+            [&] (async::error_type) { done.set_value(); }
+        );
+        future.get();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        double ns_per_item = std::chrono::duration<double, std::nano>(elapsed).count() / item_count;
+        std::printf("each_limit, %d threads, limit %2zu           %10.2f ns/item\n", ThreadCount, limit, ns_per_item);
+        record_values("each_limit, limit " + std::to_string(limit), ThreadCount, {{"ns_per_item", ns_per_item}});
+    }
+}
+
+
+
+void spin_for(std::chrono::nanoseconds duration) {
+    auto until = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < until);
+}
+
+template<int ThreadCount>
+void bench_dispatch_policy(char const* name, async::dispatch_policy policy) {
+    constexpr std::size_t chain_count = 20000;
+    AsioFixture<ThreadCount> fixture;
+    std::vector<std::chrono::steady_clock::time_point> started(chain_count);
+    std::vector<double> latencies(chain_count);
+    std::atomic<std::size_t> chains_left{chain_count};
+    boost::promise<void> done;
+    auto future = done.get_future();
+
+    auto io_step = [&] (async::callback<> next) {
+        asio::post(fixture.ios, [next = std::move(next)] () { next(nullptr); });
+    };
+    auto cpu_step = [] (async::callback<> next) {
+        spin_for(std::chrono::microseconds(1));
+        next(nullptr);
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < chain_count; i++) {
+        started[i] = std::chrono::steady_clock::now();
+        async::series_on(fixture.ios, policy,
+            io_step, cpu_step, cpu_step, cpu_step, cpu_step, cpu_step, cpu_step, cpu_step,
+            [&, i] (async::error_type) {
+                latencies[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started[i]).count();
+                if (--chains_left == 0)
+                    done.set_value();
+            }
+        );
+    }
+    future.get();
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::sort(latencies.begin(), latencies.end());
+    std::printf("series_on, %d threads, %-16s %10.0f chains/s  p50 %8.1f us  p99 %8.1f us\n",
+        ThreadCount, name, chain_count / elapsed,
+        latencies[chain_count / 2], latencies[chain_count * 99 / 100]);
+    record_values(std::string("series_on, ") + name, ThreadCount, {
+        {"chains_per_second", chain_count / elapsed},
+        {"p50_us", latencies[chain_count / 2]},
+        {"p99_us", latencies[chain_count * 99 / 100]}
+    });
+}
+
+
+
+// A replica that answers in 100-300 us, except one time in fifty when it takes 10 ms.
+struct heavy_tailed_replica
+{
+    asio::io_service* ios;
+    std::atomic<std::size_t>* attempts;
+
+    void operator()(async::callback<int> next) const {
+        static thread_local std::mt19937 random(std::random_device{}());
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        auto delay = uniform(random) < 0.02
+            ? std::chrono::microseconds(10000)
+            : std::chrono::microseconds(100 + int(uniform(random) * 200));
+        attempts->fetch_add(1, std::memory_order_relaxed);
+        auto timer = std::make_shared<asio::steady_timer>(*ios, delay);
+        timer->async_wait([timer, next = std::move(next)] (boost::system::error_code const&) { next(nullptr, 1); });
+    }
+};
+
+// Issues request_count requests from 32 concurrent clients, each straight to a replica or hedged
+// at the policy's p95, and reports latency quantiles and the extra attempts made.
+template<int ThreadCount>
+void bench_hedged(bool hedge, std::size_t request_count) {
+    constexpr std::size_t client_count = 32;
+    AsioFixture<ThreadCount> fixture;
+    std::atomic<std::size_t> attempts{0};
+    std::atomic<std::size_t> requests_left{request_count};
+    std::atomic<std::size_t> clients_left{client_count};
+    std::vector<double> latencies(request_count);
+    boost::promise<void> done;
+    auto future = done.get_future();
+    async::hedging_policy policy(0.95, std::chrono::milliseconds(1));
+    // Hedging delays are a few hundred microseconds, so the wheel ticks finer than its default.
+    async::timer_thread timers(std::chrono::microseconds(50));
+    heavy_tailed_replica replica{&fixture.ios, &attempts};
+
+    std::function<void()> request = [&] {
+        std::size_t left = requests_left.fetch_sub(1);
+        if (left == 0 || left > request_count) {
+            if (--clients_left == 0)
+                done.set_value();
+            return;
+        }
+        auto started = std::chrono::steady_clock::now();
+        auto complete = [&, started, index = left - 1] (async::error_type, int) {
+            latencies[index] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started).count();
+            request();
+        };
+        if (hedge)
+            async::hedged(policy, timers.queue(), replica, replica, complete);
+        else
+            replica(complete);
+    };
+    for (std::size_t i = 0; i < client_count; i++)
+        asio::post(fixture.ios, request);
+    future.get();
+
+    std::sort(latencies.begin(), latencies.end());
+    double extra_attempts = 100.0 * (double(attempts.load()) / request_count - 1);
+    std::printf("%-9s heavy-tailed replicas, %d threads  p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  %5.1f%% extra attempts\n",
+        hedge ? "hedged," : "unhedged,", ThreadCount,
+        latencies[request_count / 2], latencies[request_count * 99 / 100], latencies[request_count * 999 / 1000],
+        extra_attempts);
+    record_values(hedge ? "hedged, heavy-tailed replicas" : "unhedged, heavy-tailed replicas", ThreadCount, {
+        {"p50_us", latencies[request_count / 2]},
+        {"p99_us", latencies[request_count * 99 / 100]},
+        {"p999_us", latencies[request_count * 999 / 1000]},
+        {"extra_attempts_percent", extra_attempts}
+    });
+}
+
+
+
+// A backend that fails one attempt in a hundred, except during an incident, when it fails
+// nine in ten. Each attempt is answered through the io_service.
+struct flaky_backend
+{
+    asio::io_service* ios;
+    std::atomic<bool>* incident;
+    std::atomic<std::size_t>* attempts;
+
+    void operator()(async::callback<> next) const {
+        static thread_local std::mt19937 random(std::random_device{}());
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        bool fail = uniform(random) < (incident->load(std::memory_order_relaxed) ? 0.9 : 0.01);
+        attempts->fetch_add(1, std::memory_order_relaxed);
+        asio::post(*ios, [fail, next = std::move(next)] {
+            next(fail ? std::make_exception_ptr(std::runtime_error("unavailable")) : nullptr);
+        });
+    }
+};
+
+// Issues request_count requests from 32 concurrent clients through async::retry with four
+// attempts, the middle third of them during an incident, with and without a retry budget, and
+// reports the attempts made per request before and during the incident: the load amplification.
+template<int ThreadCount>
+void bench_retry_storm(async::retry_budget* budget, std::size_t request_count) {
+    constexpr std::size_t client_count = 32;
+    AsioFixture<ThreadCount> fixture;
+    std::atomic<bool> incident{false};
+    std::atomic<std::size_t> attempts{0};
+    std::atomic<std::size_t> requests_left{request_count};
+    std::atomic<std::size_t> clients_left{client_count};
+    std::atomic<std::size_t> failures{0};
+    std::size_t phase_attempts[3] = {};
+    boost::promise<void> done;
+    auto future = done.get_future();
+    async::retry_policy policy(4, std::chrono::microseconds(100), std::chrono::milliseconds(1));
+    if (budget)
+        policy.draw_from(*budget);
+    async::timer_thread timers(std::chrono::microseconds(50));
+    flaky_backend backend{&fixture.ios, &incident, &attempts};
+
+    // Requests are numbered down from request_count; the phase changes as they are issued.
+    std::function<void()> request = [&] {
+        std::size_t left = requests_left.fetch_sub(1);
+        if (left == 0 || left > request_count) {
+            if (--clients_left == 0)
+                done.set_value();
+            return;
+        }
+        if (left == request_count * 2 / 3 || left == request_count / 3) {
+            phase_attempts[left == request_count / 3 ? 1 : 0] = attempts.load();
+            incident.store(left == request_count * 2 / 3);
+        }
+        async::retry(policy, timers.queue(), backend, [&] (async::error_type error) {
+            if (error)
+                failures.fetch_add(1, std::memory_order_relaxed);
+            request();
+        });
+    };
+    for (std::size_t i = 0; i < client_count; i++)
+        asio::post(fixture.ios, request);
+    future.get();
+    phase_attempts[2] = attempts.load();
+
+    double third = double(request_count / 3);
+    double healthy = phase_attempts[0] / third;
+    double in_incident = (phase_attempts[1] - phase_attempts[0]) / third;
+    double failed = 100.0 * failures.load() / request_count;
+    std::printf("retries, %-22s %d threads  %5.2f attempts/request healthy, %5.2f in an incident  %5.1f%% failed\n",
+        budget ? "10% budget," : "no budget,", ThreadCount, healthy, in_incident, failed);
+    record_values(budget ? "retries, 10% budget" : "retries, no budget", ThreadCount, {
+        {"attempts_per_request_healthy", healthy},
+        {"attempts_per_request_incident", in_incident},
+        {"failed_percent", failed}
+    });
+}
+
+
+
+// count timeouts pending at once, 1-2 s out, half of them cancelled before they expire, on a
+// timer_queue and with a steady_timer each. Reports what scheduling and cancelling each cost, and
+// the worst lateness of an expiry. The state outlives the thread expiring into it.
+struct bench_timeout : async::timer_queue::node
+{
+    std::chrono::steady_clock::time_point deadline;
+    struct bench_timeouts* bench;
+
+    bench_timeout() : async::timer_queue::node(&bench_timeout::expire) {}
+
+    void expired();
+
+    static void expire(async::timer_queue::node* n) {
+        static_cast<bench_timeout*>(n)->expired();
+    }
+};
+
+struct bench_timeouts
+{
+    using clock = std::chrono::steady_clock;
+
+    std::vector<bench_timeout> timeouts;
+    clock::duration latest{0};
+    std::atomic<std::size_t> left;
+    boost::promise<void> done;
+
+    explicit bench_timeouts(std::size_t count) : timeouts(count), left(count / 2) {}
+
+    template<typename Schedule, typename Cancel>
+    void run(char const* name, Schedule&& schedule, Cancel&& cancel) {
+        std::size_t count = timeouts.size();
+        auto future = done.get_future();
+        auto started = clock::now();
+        for (std::size_t i = 0; i < count; i++) {
+            bench_timeout& t = timeouts[i];
+            t.deadline = clock::now() + std::chrono::microseconds(1000000 + (i * 7919) % 1000000);
+            t.bench = this;
+            schedule(t, i);
+        }
+        auto scheduled = clock::now();
+        for (std::size_t i = 0; i < count; i += 2)
+            cancel(timeouts[i], i);
+        auto cancelled = clock::now();
+        future.get();
+
+        auto per = [] (clock::duration d, std::size_t n) { return std::chrono::duration<double, std::nano>(d).count() / n; };
+        double schedule_ns = per(scheduled - started, count);
+        double cancel_ns = per(cancelled - scheduled, count / 2);
+        double latest_ms = std::chrono::duration<double, std::milli>(latest).count();
+        std::printf("%zu timeouts, %-22s schedule %6.1f ns  cancel %6.1f ns  latest expiry %6.2f ms\n",
+            count, name, schedule_ns, cancel_ns, latest_ms);
+        record_values(std::to_string(count) + " timeouts, " + name, 0, {
+            {"schedule_ns", schedule_ns},
+            {"cancel_ns", cancel_ns},
+            {"latest_expiry_ms", latest_ms}
+        });
+    }
+};
+
+void bench_timeout::expired() {
+    bench->latest = std::max(bench->latest, std::chrono::steady_clock::now() - deadline);
+    if (--bench->left == 0)
+        bench->done.set_value();
+}
+
+void bench_timer_wheel(std::size_t count) {
+    bench_timeouts bench(count);
+    async::timer_thread timers;
+    bench.run("timing wheel",
+        [&] (bench_timeout& t, std::size_t) { timers.queue().schedule(&t, t.deadline); },
+        [&] (bench_timeout& t, std::size_t) { timers.queue().cancel(&t); }
+    );
+}
+
+void bench_steady_timers(std::size_t count) {
+    bench_timeouts bench(count);
+    asio::io_context context;
+    auto work = asio::make_work_guard(context);
+    std::vector<std::unique_ptr<asio::steady_timer>> timers(count);
+    std::thread runner([&] { context.run(); });
+    bench.run("steady_timer each",
+        [&] (bench_timeout& t, std::size_t i) {
+            timers[i] = std::make_unique<asio::steady_timer>(context, t.deadline);
+            timers[i]->async_wait([&t] (boost::system::error_code const& ec) {
+                if (!ec)
+                    t.expired();
+            });
+        },
+        [&] (bench_timeout&, std::size_t i) { timers[i]->cancel(); }
+    );
+    work.reset();
+    runner.join();
+}
+
+
+
+async::task<int> first_task() {
+    co_return 1;
+}
+
+async::task<std::tuple<int, int>> second_task(int x) {
+    co_return std::make_tuple(x + 1, x + 2);
+}
+
+async::task<> third_task(int, int) {
+    co_return;
+}
+
+async::task<> coroutine_chain() {
+    int x = co_await first_task();
+    auto [y, z] = co_await second_task(x);
+    co_await third_task(y, z);
+}
+
+async::task<> from_callback_chain() {
+    int x = co_await async::from_callback([] (async::callback<int> next) { next(nullptr, 1); });
+    auto [y, z] = co_await async::from_callback([x] (async::callback<int, int> next) { next(nullptr, x + 1, x + 2); });
+    co_await async::from_callback([y, z] (async::callback<> next) { next(nullptr); });
+}
+
+
+
+// One in ten chains fails in its first step; the cost of a failure is the difference from the
+// successful steps.
+template<typename Error, typename MakeFailure>
+void bench_error_rate(char const* name, std::size_t iterations, MakeFailure make_failure) {
+    using traits = async::error_traits<Error>;
+    std::size_t i = 0;
+    std::size_t failures = 0;
+    report(name, measure(iterations, 2, [&] {
+        async::series(
+            [&] (async::basic_callback<Error, int> next) {
+                if (++i % 10 == 0)
+                    next(make_failure(), 0);
+                else
+                    next(traits::success(), 1);
+            },
+            [] (int, async::basic_callback<Error> next) { next(traits::success()); },
+            [&] (Error error) { failures += traits::failed(error); }
+        );
+    }));
+    if (failures == 0)
+        std::abort();
+}
+
+
+
+// Enough captured state to defeat std::function's small-buffer optimisation.
+struct padding { void* p[3]; };
+
+// benchmark [--json FILE] also writes every measurement to FILE as JSON lines.
+int main(int argc, char** argv) {
+
+    char const* json_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            json_path = argv[++i];
+        else {
+            std::fprintf(stderr, "usage: %s [--json FILE]\n", argv[0]);
+            return 2;
+        }
+    }
+
+#ifdef ASYNC_CHAIN_REGISTRY
+    // Registered chains pay for the registry's locks, and for contention with a watchdog
+    // scanning it as often as a production one might.
+    std::printf("with the outstanding-chain registry and a 100 ms watchdog\n");
+    async::chain_watchdog watchdog(std::chrono::seconds(10), std::chrono::milliseconds(100), [] (async::outstanding_chain const&) {});
+#endif
+
+    constexpr std::size_t iterations = 1000000;
+    volatile int sink = 0;
+
+    bench_hops("simple_series", simple_series_chain());
+    bench_hops("series, 0 arguments", series_0_chain());
+    bench_hops("series, 1 argument", series_1_chain());
+    bench_hops("series, 3 arguments", series_3_chain());
+    bench_hops("hand-written callbacks", raw_callback_chain());
+
+    report("series, async::callback", measure(iterations, 3, [&] {
+        padding pad{};
+        async::series(
+            [&, pad] (async::callback<int> next) { next(nullptr, 1); },
+            [&, pad] (int x, async::callback<int> next) { next(nullptr, x + 1); },
+            [&, pad] (int x, async::callback<> next) { sink = x; next(nullptr); },
+            [&] (async::error_type) {}
+        );
+    }));
+
+    report("series, noexcept steps", measure(iterations, 3, [&] {
+        padding pad{};
+        async::series(
+            [&, pad] (async::callback<int> next) noexcept { next(nullptr, 1); },
+            [&, pad] (int x, async::callback<int> next) noexcept { next(nullptr, x + 1); },
+            [&, pad] (int x, async::callback<> next) noexcept { sink = x; next(nullptr); },
+            [&] (async::error_type) {}
+        );
+    }));
+
+    report("hand-written, std::function", measure(iterations, 3, [&] {
+        padding pad{};
+        std::function<void(async::error_type, int)> third = [&, pad] (async::error_type, int x) { sink = x; };
+        std::function<void(async::error_type, int)> second = [&, pad] (async::error_type, int x) { third(nullptr, x + 1); };
+        std::function<void(async::error_type, int)> first = [&, pad] (async::error_type, int x) { second(nullptr, x + 1); };
+        first(nullptr, 1);
+    }));
+
+    // The shape of the "With parameters" series test, as callbacks and as coroutines.
+    report("series, 0/1/2 arguments", measure(iterations, 3, [&] {
+        async::series(
+            [] (async::callback<int> next) { next(nullptr, 1); },
+            [] (int x, async::callback<int, int> next) { next(nullptr, x + 1, x + 2); },
+            [] (int, int, async::callback<> next) { next(nullptr); },
+            [] (async::error_type) {}
+        );
+    }));
+
+    // A 1 MiB buffer handed along the chain; one allocation per run, for the buffer itself.
+    report("series, 1 MiB buffer", measure(iterations / 10, 3, [&] {
+        async::series(
+            [] (async::callback<std::vector<char>> next) {
+                std::vector<char> buffer;
+                buffer.reserve(1 << 20);
+                next(nullptr, std::move(buffer));
+            },
+            [] (std::vector<char> buffer, async::callback<std::vector<char>> next) { next(nullptr, std::move(buffer)); },
+            [&] (std::vector<char> const& buffer, async::callback<> next) { sink = int(buffer.capacity()); next(nullptr); },
+            [] (async::error_type) {}
+        );
+    }));
+
+    auto pipeline = async::make_pipeline(
+        [] (async::callback<int> next) { next(nullptr, 1); },
+        [] (int x, async::callback<int, int> next) { next(nullptr, x + 1, x + 2); },
+        [] (int, int, async::callback<> next) { next(nullptr); }
+    );
+    report("pipeline run, 0/1/2 arguments", measure(iterations, 3, [&] {
+        pipeline.run([] (async::error_type) {});
+    }));
+
+    auto named_pipeline = async::make_named_pipeline(
+        "bench",
+        [] (async::callback<int> next) { next(nullptr, 1); },
+        [] (int x, async::callback<int, int> next) { next(nullptr, x + 1, x + 2); },
+        [] (int, int, async::callback<> next) { next(nullptr); }
+    );
+    report("named pipeline run, 0/1/2 arguments", measure(iterations, 3, [&] {
+        named_pipeline.run([] (async::error_type) {});
+    }));
+
+    report("task, 0/1/2 arguments", measure(iterations, 3, [&] {
+        async::start(coroutine_chain(), [] (async::error_type) {});
+    }));
+
+    report("task via from_callback, 0/1/2 arguments", measure(iterations, 3, [&] {
+        async::start(from_callback_chain(), [] (async::error_type) {});
+    }));
+
+    bench_error_rate<async::error_type>("10% errors, exception_ptr", iterations, [] {
+        return std::make_exception_ptr(std::runtime_error("failed"));
+    });
+    bench_error_rate<std::error_code>("10% errors, std::error_code", iterations, [] {
+        return std::make_error_code(std::errc::io_error);
+    });
+    bench_error_rate<async::status>("10% errors, async::status", iterations, [] {
+        return async::status::failed;
+    });
+
+    bench_each_limit<1>(100000);
+    bench_each_limit<4>(100000);
+
+    bench_dispatch_policy<4>("inline", async::dispatch_policy::always_inline());
+    bench_dispatch_policy<4>("post", async::dispatch_policy::always_post());
+    bench_dispatch_policy<4>("bounded(2)", async::dispatch_policy::bounded(2));
+
+    bench_hedged<4>(false, 20000);
+    bench_hedged<4>(true, 20000);
+
+    bench_retry_storm<4>(nullptr, 60000);
+    {
+        async::retry_budget budget(0.1, 100);
+        bench_retry_storm<4>(&budget, 60000);
+    }
+
+    bench_timer_wheel(1000000);
+    bench_steady_timers(1000000);
+
+    if (json_path && !write_json(json_path)) {
+        std::perror(json_path);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,41 @@
+
+// Compile-time benchmark: a series of ASYNC_COMPILE_BENCH_STEPS distinct steps. Built and timed
+// by `make compile-bench`.
+
+#include <cstddef>
+#include <cstdio>
+#include <utility>
+
+#include "../include/async.hpp"
+
+#ifndef ASYNC_COMPILE_BENCH_STEPS
+#define ASYNC_COMPILE_BENCH_STEPS 500
+#endif
+
+
+
+// Every step has its own type, so each position is instantiated separately.
+template<std::size_t I>
+struct step
+{
+    void operator()(int x, async::callback<int> next) const {
+        next(nullptr, x + 1);
+    }
+};
+
+template<std::size_t ... Is>
+int run(std::index_sequence<Is...>) {
+    int result = 0;
+    async::series(
+        [] (async::callback<int> next) { next(nullptr, 0); },
+        step<Is>()...,
+        [&] (int x, async::callback<> next) { result = x; next(nullptr); },
+        [] (async::error_type) {}
+    );
+    return result;
+}
+
+int main() {
+    std::printf("%d\n", run(std::make_index_sequence<ASYNC_COMPILE_BENCH_STEPS>()));
+    return 0;
+}
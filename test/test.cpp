@@ -1,10 +1,21 @@
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <tuple>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_future.hpp>
 
 // Use boost's promise and future because the std:: versions currently segfault.
 #define BOOST_THREAD_PROVIDES_FUTURE
@@ -14,10 +25,10 @@
 #include "catch.hpp"
 
 #include "../include/async.hpp"
+#include "../include/async_asio.hpp"
+#include "../include/async_metrics.hpp"
 
-
-
-namespace asio = boost::asio;
+#include "asio_fixture.hpp"
 
 
 
@@ -31,36 +42,6 @@ public:
 
 
 
-template<int ThreadCount>
-class AsioFixture
-{
-public:
-    std::atomic_bool stop;
-    asio::io_service ios;
-    asio::io_service::work work;
-    std::vector<std::thread> threads;
-
-    AsioFixture() : ios(), work(ios) {
-        INFO("Starting AsioFixture threads...");
-        stop = false;
-        for (int i = 0; i < ThreadCount; i++)
-            threads.emplace_back([this](){
-                while (!stop)
-                    ios.run();
-            });
-    }
-
-    ~AsioFixture() {
-        INFO("Stopping AsioFixture threads...");
-        stop = true;
-        ios.stop();
-        for (auto& t : threads)
-            t.join();
-    }
-};
-
-
-
 TEST_CASE("Non-concurrent async::simple_series", "[simple_series]") {
 
     bool first_called = false, second_called = false,
@@ -299,63 +280,3085 @@ TEST_CASE("Non-concurrent async::series", "[series]") {
 
 
 
-TEST_CASE_METHOD(AsioFixture<1>, "Concurrent async::simple_series", "[simple_series]") {
-
-    struct shared_state {
-        boost::promise<void> promise;
-        bool first_called, second_called, third_called;
-        std::exception_ptr error;
-    };
-
-    auto state = std::make_shared<shared_state>();
-    auto future = state->promise.get_future();
-
-    // Keep timer out here since it would be cancelled when going out of scope inside a lambda.
-    auto timer = std::make_shared<asio::steady_timer>(ios);
+TEST_CASE("async::continuation", "[continuation]") {
 
-    async::simple_series(
-        [=] (auto next) {
-            state->first_called = true;
-            timer->expires_from_now(std::chrono::milliseconds(10));
-            timer->async_wait([&](auto ec){
-                if (ec)
-                    next(std::make_exception_ptr(boost::system::system_error(ec)));
-                else
-                    next(nullptr);
-            });
+    SECTION("Forwards error and arguments") {
+
+        async::error_type error = std::make_exception_ptr(expected_exception());
+        int value = 0;
+
+        async::callback<int> next = [&] (async::error_type err, int x) {
+            error = err;
+            value = x;
+        };
+
+        REQUIRE(static_cast<bool>(next));
+        next(nullptr, 42);
+
+        CHECK(error == nullptr);
+        CHECK(value == 42);
+
+    }
+
+    SECTION("Holds move-only targets") {
+
+        auto payload = std::make_unique<int>(7);
+        int value = 0;
+
+        async::callback<> first = [&value, payload = std::move(payload)] (async::error_type) {
+            value = *payload;
+        };
+        async::callback<> second = std::move(first);
+
+        CHECK_FALSE(static_cast<bool>(first));
+        REQUIRE(static_cast<bool>(second));
+        second(nullptr);
+
+        CHECK(value == 7);
+
+    }
+
+    SECTION("Configurable inline buffer") {
+
+        std::array<char, 64> big{};
+        big[63] = 'x';
+        char seen = 0;
+
+        async::continuation<void(async::error_type), 128> next = [&seen, big] (async::error_type) {
+            seen = big[63];
+        };
+        next(nullptr);
+
+        CHECK(seen == 'x');
+        CHECK(sizeof(next) >= 128);
+
+    }
+
+}
+
+
+
+TEST_CASE("async::series with move-only continuations", "[series]") {
+
+    async::error_type error = std::make_exception_ptr(expected_exception());
+    int result = 0;
+
+    async::series(
+        [&] (async::callback<int> next) {
+            auto moved = std::move(next);
+            moved(nullptr, 5);
         },
-        [=] (auto next) {
-            state->second_called = true;
-            timer->expires_from_now(std::chrono::milliseconds(10));
-            timer->async_wait([&](auto ec){
-                if (ec)
-                    next(std::make_exception_ptr(boost::system::system_error(ec)));
-                else
-                    next(nullptr);
-            });
+        [&] (int x, async::callback<> next) {
+            result = x;
+            next(nullptr);
         },
-        [=] (auto next) {
-            state->third_called = true;
-            timer->expires_from_now(std::chrono::milliseconds(10));
-            timer->async_wait([&](auto ec){
-                if (ec)
-                    next(std::make_exception_ptr(boost::system::system_error(ec)));
-                else
-                    next(nullptr);
-            });
+        [&] (async::error_type err) {
+            error = err;
+        }
+    );
+
+    CHECK(result == 5);
+    CHECK(error == nullptr);
+
+}
+
+
+
+// Counts copies so tests can check that values are only ever moved.
+struct copy_counted {
+    int* copies;
+    int value;
+    copy_counted(int* copies, int value) : copies(copies), value(value) {}
+    copy_counted(copy_counted const& other) : copies(other.copies), value(other.value) { ++*copies; }
+    copy_counted(copy_counted&& other) noexcept = default;
+    copy_counted& operator=(copy_counted const& other) { copies = other.copies; value = other.value; ++*copies; return *this; }
+    copy_counted& operator=(copy_counted&&) noexcept = default;
+};
+
+TEST_CASE("async::series moves arguments between steps", "[series]") {
+
+    int copies = 0;
+    int result = 0;
+    async::error_type error = std::make_exception_ptr(expected_exception());
+
+    SECTION("By value, by rvalue reference and by const reference") {
+        async::series(
+            [&] (async::callback<copy_counted> next) {
+                next(nullptr, copy_counted(&copies, 1));
+            },
+            [] (copy_counted x, async::callback<copy_counted, copy_counted> next) {
+                copy_counted y(x.copies, x.value + 1);
+                next(nullptr, std::move(x), std::move(y));
+            },
+            [] (copy_counted&& x, copy_counted const& y, async::callback<copy_counted> next) {
+                x.value += y.value;
+                next(nullptr, std::move(x));
+            },
+            [&] (copy_counted x, async::callback<> next) {
+                result = x.value;
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                error = err;
+            }
+        );
+
+        CHECK(error == nullptr);
+        CHECK(result == 3);
+        CHECK(copies == 0);
+    }
+
+    SECTION("Move-only values") {
+        async::series(
+            [] (async::callback<std::unique_ptr<int>> next) {
+                next(nullptr, std::make_unique<int>(7));
+            },
+            [] (std::unique_ptr<int> p, async::callback<std::unique_ptr<int>> next) {
+                *p += 1;
+                next(nullptr, std::move(p));
+            },
+            [&] (std::unique_ptr<int>&& p, async::callback<> next) {
+                result = *p;
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                error = err;
+            }
+        );
+
+        CHECK(error == nullptr);
+        CHECK(result == 8);
+    }
+
+    SECTION("Passing an argument straight on") {
+        std::vector<int> received;
+        async::series(
+            [] (async::callback<std::vector<int>> next) {
+                next(nullptr, std::vector<int>{ 1, 2, 3 });
+            },
+            [] (std::vector<int>&& values, async::callback<std::vector<int>> next) {
+                next(nullptr, std::move(values));
+            },
+            [] (std::vector<int> const& values, async::callback<std::vector<int>> next) {
+                next(nullptr, values);
+            },
+            [&] (std::vector<int> values, async::callback<> next) {
+                received = std::move(values);
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                error = err;
+            }
+        );
+
+        CHECK(error == nullptr);
+        CHECK((received == std::vector<int>{ 1, 2, 3 }));
+    }
+
+    SECTION("Into a pipeline run") {
+        auto pipeline = async::make_pipeline(
+            [] (copy_counted x, std::unique_ptr<int> p, async::callback<copy_counted> next) {
+                x.value += *p;
+                next(nullptr, std::move(x));
+            },
+            [&] (copy_counted const& x, async::callback<> next) {
+                result = x.value;
+                next(nullptr);
+            }
+        );
+        pipeline.run(copy_counted(&copies, 1), std::make_unique<int>(2), [&] (async::error_type err) {
+            error = err;
+        });
+
+        CHECK(error == nullptr);
+        CHECK(result == 3);
+        CHECK(copies == 0);
+    }
+
+}
+
+TEST_CASE_METHOD(AsioFixture<1>, "async::series moves arguments across threads", "[series]") {
+
+    int copies = 0;
+    boost::promise<int> promise;
+    auto future = promise.get_future();
+
+    async::series(
+        [this, &copies] (async::callback<copy_counted> next) {
+            asio::post(ios, [next = std::move(next), &copies] () { next(nullptr, copy_counted(&copies, 1)); });
         },
-        [=] (auto err) {
-            state->error = err;
-            state->promise.set_value();
+        [this] (copy_counted x, async::callback<copy_counted> next) {
+            asio::post(ios, [next = std::move(next), x = std::move(x)] () mutable { next(nullptr, std::move(x)); });
+        },
+        [&] (copy_counted x, async::callback<> next) {
+            promise.set_value(x.value);
+            next(nullptr);
+        },
+        [] (async::error_type) {}
+    );
+
+    CHECK(future.get() == 1);
+    CHECK(copies == 0);
+
+}
+
+
+
+TEST_CASE("Chains with std::error_code and async::status errors", "[series][simple_series]") {
+
+    SECTION("series with std::error_code") {
+        std::error_code error = async::make_error_code(async::status::ok);
+        bool third_called = false;
+
+        async::series(
+            [] (async::basic_callback<std::error_code, int> next) {
+                next(std::error_code(), 1);
+            },
+            [] (int x, async::basic_callback<std::error_code> next) {
+                next(std::make_error_code(std::errc::io_error));
+            },
+            [&] (async::basic_callback<std::error_code> next) {
+                third_called = true;
+                next(std::error_code());
+            },
+            [&] (std::error_code err) {
+                error = err;
+            }
+        );
+
+        CHECK(error == std::errc::io_error);
+        CHECK_FALSE(third_called);
+    }
+
+    SECTION("series with async::status") {
+        async::status error = async::status::failed;
+        int result = 0;
+
+        async::series(
+            [] (async::basic_callback<async::status, int> next) {
+                next(async::status::ok, 2);
+            },
+            [&] (int x, async::basic_callback<async::status> next) {
+                result = x;
+                next(async::status::ok);
+            },
+            [&] (async::status err) {
+                error = err;
+            }
+        );
+
+        CHECK(error == async::status::ok);
+        CHECK(result == 2);
+    }
+
+    SECTION("simple_series with async::status") {
+        async::status error = async::status::ok;
+        bool second_called = false;
+
+        async::simple_series(
+            [] (auto next) {
+                next(async::status::timed_out);
+            },
+            [&] (auto next) {
+                second_called = true;
+                next(async::status::ok);
+            },
+            [&] (async::status err) {
+                error = err;
+            }
+        );
+
+        CHECK(error == async::status::timed_out);
+        CHECK_FALSE(second_called);
+    }
+
+    SECTION("Exceptions thrown by steps") {
+        async::status status_error = async::status::ok;
+        std::error_code code_error;
+
+        async::series(
+            [] (async::basic_callback<async::status> next) {
+                throw expected_exception();
+            },
+            [&] (async::status err) {
+                status_error = err;
+            }
+        );
+        async::series(
+            [] (async::basic_callback<std::error_code> next) {
+                throw std::system_error(std::make_error_code(std::errc::timed_out));
+            },
+            [&] (std::error_code err) {
+                code_error = err;
+            }
+        );
+
+        CHECK(status_error == async::status::failed);
+        CHECK(code_error == std::errc::timed_out);
+    }
+
+    SECTION("async::status as an error code") {
+        std::error_code code = async::status::cancelled;
+        CHECK(code.category() == async::status_category());
+        CHECK(code.message() == "cancelled");
+    }
+
+}
+
+TEST_CASE_METHOD(AsioFixture<1>, "Continuations as Asio completion tokens with other error types", "[series][asio]") {
+
+    boost::promise<async::status> promise;
+    auto future = promise.get_future();
+    asio::steady_timer timer(ios, std::chrono::hours(1));
+
+    async::series(
+        [&] (async::basic_callback<async::status> next) {
+            timer.async_wait(std::move(next));
+            asio::post(ios, [&] () { timer.cancel(); });
+        },
+        [&] (async::status err) {
+            promise.set_value(err);
         }
     );
 
-    future.get();
+    CHECK(future.get() == async::status::cancelled);
+
+}
+
+
+
+TEST_CASE("async::series with noexcept steps", "[series]") {
+
+    async::error_type error = nullptr;
+    int result = 0;
+
+    async::series(
+        [] (async::callback<int> next) noexcept {
+            next(nullptr, 1);
+        },
+        [] (int x, async::callback<int> next) {
+            if (x == 1)
+                throw expected_exception();
+            next(nullptr, x);
+        },
+        [&] (int x, async::callback<> next) noexcept {
+            result = x;
+            next(nullptr);
+        },
+        [&] (async::error_type err) {
+            error = err;
+        }
+    );
+
+    CHECK(result == 0);
+    CHECK_THROWS_AS(std::rethrow_exception(error), expected_exception);
+
+    async::simple_series(
+        [&] (auto next) noexcept { result = 1; next(nullptr); },
+        [&] (auto next) noexcept { result += 1; next(nullptr); },
+        [&] (async::error_type err) { error = err; }
+    );
+
+    CHECK(result == 2);
+    CHECK(error == nullptr);
+
+}
+
+
+
+TEST_CASE("async::series completing after the call returns", "[series]") {
+
+    async::callback<int> pending;
+    async::error_type error = std::make_exception_ptr(expected_exception());
+    int result = 0;
+
+    async::series(
+        [&] (async::callback<int> next) {
+            pending = std::move(next);
+        },
+        [&] (int x, async::callback<> next) {
+            result = x;
+            next(nullptr);
+        },
+        [&] (async::error_type err) {
+            error = err;
+        }
+    );
+
+    REQUIRE(pending);
+    CHECK(result == 0);
+
+    pending(nullptr, 5);
+
+    CHECK(result == 5);
+    CHECK(error == nullptr);
+
+}
 
-    CHECK(state->first_called);
-    CHECK(state->second_called);
-    CHECK(state->third_called);
-    CHECK(state->error == nullptr);
-    //CHECK_NOTHROW(std::rethrow_exception(error));
 
+
+template<size_t ... Is, typename Step, typename FinalHandler>
+void repeated_series(std::index_sequence<Is...>, Step const& step, FinalHandler const& final_handler) {
+    async::series(((void)Is, step)..., final_handler);
 }
+
+TEST_CASE("Steps are destroyed with their chain, even while still running", "[series][simple_series]") {
+
+    // So a step that hands next to another thread must not touch its captures afterwards.
+    auto run = [] (auto start) {
+        auto capture = std::make_shared<int>(42);
+        std::weak_ptr<int> watched = capture;
+        bool expired_after_handoff = false;
+        int copied = 0;
+        start([&, capture = std::move(capture)] (auto next) {
+            copied = *capture;
+            auto* expired = &expired_after_handoff;
+            auto still_watched = watched;
+            std::thread(std::move(next), nullptr).join();
+            // Only this call's locals are safe from here on, references captured by [&] included.
+            *expired = still_watched.expired();
+        });
+        CHECK(copied == 42);
+        CHECK(expired_after_handoff);
+    };
+
+    run([] (auto step) {
+        async::simple_series(std::move(step), [] (async::error_type) {});
+    });
+    run([] (auto step) {
+        async::series(
+            [step = std::move(step)] (async::callback<> next) mutable { step(std::move(next)); },
+            [] (async::error_type) {}
+        );
+    });
+
+}
+
+TEST_CASE("Synchronous chains do not grow the stack", "[series][simple_series]") {
+
+    SECTION("async::series") {
+
+        std::vector<std::uintptr_t> depths;
+        bool last_called = false;
+
+        repeated_series(
+            std::make_index_sequence<64>(),
+            [&] (async::callback<> next) {
+                char marker;
+                depths.push_back(reinterpret_cast<std::uintptr_t>(&marker));
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                last_called = true;
+                CHECK(err == nullptr);
+            }
+        );
+
+        REQUIRE(depths.size() == 64);
+        CHECK(last_called);
+        auto range = std::minmax_element(depths.begin(), depths.end());
+        CHECK(*range.second - *range.first < 256);
+
+    }
+
+    SECTION("async::simple_series, 100k steps") {
+
+        constexpr size_t step_count = 100000;
+        size_t steps_run = 0;
+        std::uintptr_t first_depth = 0, last_depth = 0;
+        bool last_called = false;
+
+        auto step = [&] (auto next) {
+            char marker;
+            last_depth = reinterpret_cast<std::uintptr_t>(&marker);
+            if (steps_run++ == 0)
+                first_depth = last_depth;
+            next(nullptr);
+        };
+
+        async::simple_series(
+            std::vector<decltype(step)>(step_count, step),
+            [&] (auto err) {
+                last_called = true;
+                CHECK(err == nullptr);
+            }
+        );
+
+        CHECK(steps_run == step_count);
+        CHECK(last_called);
+        CHECK(last_depth == first_depth);
+
+    }
+
+    SECTION("async::simple_series, 100k steps with error") {
+
+        size_t steps_run = 0;
+        async::error_type error = nullptr;
+
+        auto step = [&] (auto next) {
+            if (++steps_run == 50000)
+                next(std::make_exception_ptr(expected_exception()));
+            else
+                next(nullptr);
+        };
+
+        async::simple_series(
+            std::vector<decltype(step)>(100000, step),
+            [&] (auto err) {
+                error = err;
+            }
+        );
+
+        CHECK(steps_run == 50000);
+        CHECK_THROWS_AS(std::rethrow_exception(error), expected_exception);
+
+    }
+
+}
+
+
+
+TEST_CASE_METHOD(AsioFixture<1>, "Concurrent async::simple_series", "[simple_series]") {
+
+    struct shared_state {
+        boost::promise<void> promise;
+        bool first_called, second_called, third_called;
+        std::exception_ptr error;
+    };
+
+    auto state = std::make_shared<shared_state>();
+    auto future = state->promise.get_future();
+
+    // Keep timer out here since it would be cancelled when going out of scope inside a lambda.
+    auto timer = std::make_shared<asio::steady_timer>(ios);
+
+    async::simple_series(
+        [=] (auto next) {
+            state->first_called = true;
+            timer->expires_from_now(std::chrono::milliseconds(10));
+            timer->async_wait([next](auto ec){
+                if (ec)
+                    next(std::make_exception_ptr(boost::system::system_error(ec)));
+                else
+                    next(nullptr);
+            });
+        },
+        [=] (auto next) {
+            state->second_called = true;
+            timer->expires_from_now(std::chrono::milliseconds(10));
+            timer->async_wait([next](auto ec){
+                if (ec)
+                    next(std::make_exception_ptr(boost::system::system_error(ec)));
+                else
+                    next(nullptr);
+            });
+        },
+        [=] (auto next) {
+            state->third_called = true;
+            timer->expires_from_now(std::chrono::milliseconds(10));
+            timer->async_wait([next](auto ec){
+                if (ec)
+                    next(std::make_exception_ptr(boost::system::system_error(ec)));
+                else
+                    next(nullptr);
+            });
+        },
+        [=] (auto err) {
+            state->error = err;
+            state->promise.set_value();
+        }
+    );
+
+    future.get();
+
+    CHECK(state->first_called);
+    CHECK(state->second_called);
+    CHECK(state->third_called);
+    CHECK(state->error == nullptr);
+    //CHECK_NOTHROW(std::rethrow_exception(error));
+
+}
+
+
+
+TEST_CASE_METHOD(AsioFixture<4>, "Many concurrent async::simple_series", "[simple_series]") {
+
+    constexpr int chain_count = 1000;
+
+    struct shared_state {
+        boost::promise<void> promise;
+        std::atomic_int steps_run{0};
+        std::atomic_int chains_left{chain_count};
+        std::atomic_int errors{0};
+    };
+
+    auto state = std::make_shared<shared_state>();
+    auto future = state->promise.get_future();
+
+    auto step = [this, state] (auto next) {
+        state->steps_run++;
+        asio::post(ios, [next]() { next(nullptr); });
+    };
+
+    for (int i = 0; i < chain_count; i++)
+        async::simple_series(
+            step,
+            step,
+            step,
+            [=] (auto err) {
+                if (err)
+                    state->errors++;
+                if (--state->chains_left == 0)
+                    state->promise.set_value();
+            }
+        );
+
+    future.get();
+
+    CHECK(state->steps_run == 3 * chain_count);
+    CHECK(state->errors == 0);
+
+}
+
+
+
+TEST_CASE_METHOD(AsioFixture<4>, "Many concurrent async::series", "[series]") {
+
+    constexpr int chain_count = 1000;
+
+    struct shared_state {
+        boost::promise<void> promise;
+        std::atomic_int sum{0};
+        std::atomic_int chains_left{chain_count};
+        std::atomic_int errors{0};
+    };
+
+    auto state = std::make_shared<shared_state>();
+    auto future = state->promise.get_future();
+
+    for (int i = 0; i < chain_count; i++)
+        async::series(
+            [this, i] (async::callback<int> next) {
+                asio::post(ios, [next = std::move(next), i] () { next(nullptr, i); });
+            },
+            [] (int x, async::callback<int, int> next) {
+                // Alternate between synchronous and posted completion.
+                next(nullptr, x, 1);
+            },
+            [this] (int x, int y, async::callback<int> next) {
+                asio::post(ios, [next = std::move(next), x, y] () { next(nullptr, x + y); });
+            },
+            [state] (int x, async::callback<> next) {
+                state->sum += x;
+                next(nullptr);
+            },
+            [state] (async::error_type err) {
+                if (err)
+                    state->errors++;
+                if (--state->chains_left == 0)
+                    state->promise.set_value();
+            }
+        );
+
+    future.get();
+
+    CHECK(state->sum == chain_count * (chain_count - 1) / 2 + chain_count);
+    CHECK(state->errors == 0);
+
+}
+
+
+
+TEST_CASE("async::make_pipeline", "[pipeline]") {
+
+    int calls = 0;
+    int product = 0;
+
+    auto pipeline = async::make_pipeline(
+        [&] (int x, async::callback<int, int> next) {
+            calls++;
+            next(nullptr, x, x + 1);
+        },
+        [&] (int x, int y, async::callback<> next) {
+            if (x < 0)
+                return next(std::make_exception_ptr(expected_exception()));
+            product = x * y;
+            next(nullptr);
+        }
+    );
+
+    static_assert(std::is_same<decltype(pipeline)::argument_tuple, std::tuple<int>>::value, "");
+
+    SECTION("Can be run repeatedly") {
+        int sum = 0;
+        for (int i = 0; i < 10; i++)
+            pipeline.run(i, [&] (async::error_type err) {
+                REQUIRE(err == nullptr);
+                sum += 1;
+            });
+        CHECK(sum == 10);
+        CHECK(calls == 10);
+        CHECK(product == 9 * 10);
+    }
+
+    SECTION("Reports errors per run") {
+        async::error_type first = nullptr;
+        async::error_type second = nullptr;
+        pipeline.run(-1, [&] (async::error_type err) { first = err; });
+        pipeline.run(1, [&] (async::error_type err) { second = err; });
+        CHECK_THROWS_AS(std::rethrow_exception(first), expected_exception);
+        CHECK(second == nullptr);
+    }
+
+    SECTION("Steps without arguments") {
+        int result = 0;
+        auto empty = async::make_pipeline(
+            [] (async::callback<int> next) { next(nullptr, 3); },
+            [&] (int x, async::callback<> next) { result = x; next(nullptr); }
+        );
+        empty.run([] (async::error_type) {});
+        CHECK(result == 3);
+    }
+
+}
+
+TEST_CASE_METHOD(AsioFixture<4>, "Concurrent runs of one async::pipeline", "[pipeline]") {
+
+    constexpr int run_count = 1000;
+
+    boost::promise<void> promise;
+    auto future = promise.get_future();
+    std::atomic_int sum{0};
+    std::atomic_int runs_left{run_count};
+
+    auto pipeline = async::make_pipeline(
+        [this] (int x, async::callback<int> next) {
+            asio::post(ios, [next = std::move(next), x] () { next(nullptr, x); });
+        },
+        [&] (int x, async::callback<> next) {
+            sum += x;
+            next(nullptr);
+        }
+    );
+
+    for (int i = 0; i < run_count; i++)
+        pipeline.run(i, [&] (async::error_type) {
+            if (--runs_left == 0)
+                promise.set_value();
+        });
+
+    future.get();
+
+    CHECK(sum == run_count * (run_count - 1) / 2);
+
+}
+
+
+
+TEST_CASE("Non-concurrent async::parallel", "[parallel]") {
+
+    bool first_called = false, second_called = false,
+        third_called = false;
+    int last_called = 0;
+    async::error_type error = nullptr;
+
+    SECTION("No error") {
+
+        std::tuple<int, std::tuple<>, std::tuple<int, std::string>> results;
+
+        async::parallel(
+            [&] (async::callback<int> next) {
+                first_called = true;
+                next(nullptr, 1);
+            },
+            [&] (async::callback<> next) {
+                second_called = true;
+                next(nullptr);
+            },
+            [&] (async::callback<int, std::string> next) {
+                third_called = true;
+                next(nullptr, 2, "three");
+            },
+            [&] (async::error_type err, std::tuple<int, std::tuple<>, std::tuple<int, std::string>> values) {
+                last_called++;
+                error = err;
+                results = std::move(values);
+            }
+        );
+
+        CHECK(first_called == true);
+        CHECK(second_called == true);
+        CHECK(third_called == true);
+        CHECK(last_called == 1);
+        CHECK(error == nullptr);
+
+        CHECK(std::get<0>(results) == 1);
+        CHECK(std::get<0>(std::get<2>(results)) == 2);
+        CHECK(std::get<1>(std::get<2>(results)) == "three");
+
+    }
+
+    SECTION("With error") {
+
+        async::parallel(
+            [&] (async::callback<> next) {
+                first_called = true;
+                next(nullptr);
+            },
+            [&] (async::callback<> next) {
+                second_called = true;
+                next(std::make_exception_ptr(expected_exception()));
+            },
+            [&] (async::callback<> next) {
+                third_called = true;
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                last_called++;
+                error = err;
+            }
+        );
+
+        CHECK(first_called == true);
+        CHECK(second_called == true);
+        CHECK(third_called == false);
+        CHECK(last_called == 1);
+        CHECK_THROWS_AS(std::rethrow_exception(error), expected_exception);
+
+    }
+
+    SECTION("With exception and a late completion") {
+
+        async::callback<> pending;
+
+        async::parallel(
+            [&] (async::callback<> next) {
+                first_called = true;
+                pending = std::move(next);
+            },
+            [&] (async::callback<> next) {
+                second_called = true;
+                throw expected_exception("async::parallel");
+            },
+            [&] (async::error_type err) {
+                last_called++;
+                error = err;
+            }
+        );
+
+        CHECK(first_called == true);
+        CHECK(second_called == true);
+        CHECK(last_called == 1);
+        CHECK_THROWS_AS(std::rethrow_exception(error), expected_exception);
+
+        pending(nullptr);
+
+        CHECK(last_called == 1);
+
+    }
+
+}
+
+
+
+TEST_CASE_METHOD(AsioFixture<4>, "Concurrent async::parallel", "[parallel]") {
+
+    constexpr int join_count = 1000;
+
+    struct shared_state {
+        boost::promise<void> promise;
+        std::atomic_int sum{0};
+        std::atomic_int finals{0};
+        std::atomic_int joins_left{join_count};
+    };
+
+    auto state = std::make_shared<shared_state>();
+    auto future = state->promise.get_future();
+
+    auto task = [this] (int value) {
+        return [this, value] (async::callback<int> next) {
+            asio::post(ios, [next = std::move(next), value] () { next(nullptr, value); });
+        };
+    };
+
+    for (int i = 0; i < join_count; i++)
+        async::parallel(
+            task(1),
+            task(2),
+            task(3),
+            task(4),
+            [state] (async::error_type err, std::tuple<int, int, int, int> values) {
+                state->finals++;
+                if (!err)
+                    state->sum += std::get<0>(values) + std::get<1>(values)
+                        + std::get<2>(values) + std::get<3>(values);
+                if (--state->joins_left == 0)
+                    state->promise.set_value();
+            }
+        );
+
+    future.get();
+
+    CHECK(state->finals == join_count);
+    CHECK(state->sum == 10 * join_count);
+
+}
+
+
+
+TEST_CASE("async::stop_token", "[stop]") {
+
+    async::stop_source source;
+    auto token = source.get_token();
+    int calls = 0;
+
+    CHECK(token.stop_possible());
+    CHECK(!async::stop_token().stop_possible());
+    CHECK(!token.stop_requested());
+
+    SECTION("Callbacks run once, on request") {
+
+        async::stop_callback callback(token, [&] { calls++; });
+        {
+            async::stop_callback removed(token, [&] { calls += 100; });
+        }
+        CHECK(calls == 0);
+        CHECK(source.request_stop());
+        CHECK(!source.request_stop());
+        CHECK(token.stop_requested());
+        CHECK(calls == 1);
+
+    }
+
+    SECTION("Callbacks registered after the request run at once") {
+
+        source.request_stop();
+        async::stop_callback callback(token, [&] { calls++; });
+        CHECK(calls == 1);
+
+    }
+
+    SECTION("Tokens outlive their source") {
+
+        source = async::stop_source();
+        CHECK(!token.stop_requested());
+        CHECK(!source.get_token().stop_requested());
+
+    }
+
+}
+
+TEST_CASE("Child async::stop_source", "[stop]") {
+
+    async::stop_source parent;
+    int calls = 0;
+
+    SECTION("A stop of the parent stops the child") {
+
+        async::stop_source child(parent.get_token());
+        async::stop_callback callback(child.get_token(), [&] { calls++; });
+        CHECK(!child.stop_requested());
+        parent.request_stop();
+        CHECK(child.stop_requested());
+        CHECK(calls == 1);
+
+    }
+
+    SECTION("A stop of the child leaves the parent") {
+
+        async::stop_source child(parent.get_token());
+        child.request_stop();
+        CHECK(child.stop_requested());
+        CHECK(!parent.stop_requested());
+        async::stop_source sibling(parent.get_token());
+        CHECK(!sibling.stop_requested());
+
+    }
+
+    SECTION("A child of a stopped parent starts stopped") {
+
+        parent.request_stop();
+        async::stop_source child(parent.get_token());
+        CHECK(child.stop_requested());
+
+    }
+
+    SECTION("A child of a default constructed token never stops") {
+
+        async::stop_source child{async::stop_token()};
+        CHECK(child.get_token().stop_possible());
+        CHECK(!child.stop_requested());
+
+    }
+
+    SECTION("Children may go before the parent stops, and the parent before its children") {
+
+        {
+            async::stop_source gone(parent.get_token());
+        }
+        auto grandparent = std::make_unique<async::stop_source>();
+        async::stop_source child(grandparent->get_token());
+        async::stop_source grandchild(child.get_token());
+        grandparent->request_stop();
+        grandparent.reset();
+        CHECK(grandchild.stop_requested());
+        parent.request_stop();
+
+    }
+
+}
+
+TEST_CASE("Concurrent async::stop_callback registration", "[stop]") {
+
+    constexpr int thread_count = 4;
+    constexpr int per_thread = 20000;
+
+    for (int round = 0; round < 5; round++) {
+        async::stop_source source;
+        auto token = source.get_token();
+        std::atomic_int started{0};
+        std::atomic_int runs{0};
+        std::atomic_int late_runs{0};
+        std::atomic_bool stopped{false};
+        std::vector<std::thread> threads;
+
+        for (int t = 0; t < thread_count; t++)
+            threads.emplace_back([&] {
+                std::vector<std::unique_ptr<async::stop_callback<std::function<void()>>>> kept;
+                started++;
+                for (int i = 0; i < per_thread; i++) {
+                    if (i % 16 == 0) {
+                        kept.push_back(std::make_unique<async::stop_callback<std::function<void()>>>(
+                            token, std::function<void()>([&] { runs++; })
+                        ));
+                    }
+                    else {
+                        async::stop_callback removed(token, [&] { late_runs++; });
+                    }
+                }
+                // Keeps the rest registered until the stop has run them.
+                while (!stopped)
+                    std::this_thread::yield();
+            });
+
+        while (started < thread_count)
+            std::this_thread::yield();
+        async::stop_source child(token);
+        source.request_stop();
+        stopped = true;
+        for (auto& thread : threads)
+            thread.join();
+
+        CHECK(runs == thread_count * ((per_thread + 15) / 16));
+        CHECK(child.stop_requested());
+    }
+
+}
+
+TEST_CASE("Chains with a stop_token", "[stop][series][parallel][pipeline]") {
+
+    async::stop_source source;
+
+    SECTION("Steps taking a stop_token are given the chain's") {
+
+        async::stop_token seen;
+        int result = 0;
+        async::error_type error;
+
+        async::series(
+            source.get_token(),
+            [] (async::callback<int> next) {
+                next(nullptr, 1);
+            },
+            [&] (int value, async::stop_token token, async::callback<int> next) {
+                seen = token;
+                next(nullptr, value + 1);
+            },
+            [&] (int value, async::callback<> next) {
+                result = value;
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                error = err;
+            }
+        );
+
+        CHECK(error == nullptr);
+        CHECK(result == 2);
+        CHECK(seen.stop_possible());
+        source.request_stop();
+        CHECK(seen.stop_requested());
+
+    }
+
+    SECTION("A series without a token gives its steps one that never stops") {
+
+        bool possible = true;
+
+        async::series(
+            [&] (async::stop_token token, async::callback<> next) {
+                possible = token.stop_possible();
+                next(nullptr);
+            },
+            [] (async::error_type) {}
+        );
+
+        CHECK(!possible);
+
+    }
+
+    SECTION("Steps after a stop are skipped and the chain is cancelled") {
+
+        async::callback<std::string> pending;
+        bool later_step = false;
+        bool cancelled = false;
+
+        async::series(
+            source.get_token(),
+            [&] (async::callback<std::string> next) {
+                pending = std::move(next);
+            },
+            [&] (std::string, async::callback<> next) {
+                later_step = true;
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                REQUIRE(err != nullptr);
+                try {
+                    std::rethrow_exception(err);
+                }
+                catch (std::system_error const& e) {
+                    cancelled = e.code() == async::status::cancelled;
+                }
+            }
+        );
+
+        source.request_stop();
+        CHECK(!cancelled);
+        pending(nullptr, "value");
+        CHECK(!later_step);
+        CHECK(cancelled);
+
+    }
+
+    SECTION("A chain started after the stop runs no steps") {
+
+        bool ran = false;
+        std::error_code code;
+
+        source.request_stop();
+        async::series(
+            source.get_token(),
+            [&] (async::basic_callback<std::error_code> next) {
+                ran = true;
+                next({});
+            },
+            [&] (std::error_code err) {
+                code = err;
+            }
+        );
+
+        CHECK(!ran);
+        CHECK(code == async::status::cancelled);
+
+    }
+
+    SECTION("Chains with status errors report status::cancelled") {
+
+        async::basic_callback<async::status> pending;
+        async::status result = async::status::ok;
+
+        async::series(
+            source.get_token(),
+            [&] (async::basic_callback<async::status> next) {
+                pending = std::move(next);
+            },
+            [] (async::basic_callback<async::status> next) {
+                next(async::status::ok);
+            },
+            [&] (async::status err) {
+                result = err;
+            }
+        );
+
+        source.request_stop();
+        pending(async::status::ok);
+        CHECK(result == async::status::cancelled);
+
+    }
+
+    SECTION("Errors from the running step win over the stop") {
+
+        async::basic_callback<std::error_code> pending;
+        std::error_code code;
+
+        async::series(
+            source.get_token(),
+            [&] (async::basic_callback<std::error_code> next) {
+                pending = std::move(next);
+            },
+            [&] (std::error_code err) {
+                code = err;
+            }
+        );
+
+        source.request_stop();
+        pending(std::make_error_code(std::errc::io_error));
+        CHECK(code == std::errc::io_error);
+
+    }
+
+    SECTION("A pipeline run with a token") {
+
+        int result = 0;
+        int runs = 0;
+        auto steps = async::make_pipeline(
+            [] (int x, async::stop_token token, async::callback<int> next) {
+                next(nullptr, token.stop_requested() ? -1 : x * 2);
+            },
+            [] (int x, async::callback<int> next) {
+                next(nullptr, x + 1);
+            },
+            [&] (int x, async::callback<> next) {
+                result = x;
+                next(nullptr);
+            }
+        );
+        auto final = [&] (async::error_type err) {
+            runs++;
+            if (err)
+                result = 0;
+        };
+
+        steps.run(source.get_token(), 4, final);
+        CHECK(result == 9);
+        steps.run(4, final);
+        CHECK(result == 9);
+
+        source.request_stop();
+        steps.run(source.get_token(), 4, final);
+        CHECK(runs == 3);
+        CHECK(result == 0);
+
+    }
+
+    SECTION("Parallel tasks are given the token, and those not started are skipped") {
+
+        async::stop_token seen;
+        bool third = false;
+        bool cancelled = false;
+
+        async::parallel(
+            source.get_token(),
+            [&] (async::stop_token token, async::callback<int> next) {
+                seen = token;
+                next(nullptr, 1);
+            },
+            [&] (async::callback<int> next) {
+                source.request_stop();
+                next(nullptr, 2);
+            },
+            [&] (async::callback<int> next) {
+                third = true;
+                next(nullptr, 3);
+            },
+            [&] (async::error_type err, std::tuple<int, int, int>) {
+                REQUIRE(err != nullptr);
+                try {
+                    std::rethrow_exception(err);
+                }
+                catch (std::system_error const& e) {
+                    cancelled = e.code() == async::status::cancelled;
+                }
+            }
+        );
+
+        CHECK(seen.stop_requested());
+        CHECK(!third);
+        CHECK(cancelled);
+
+    }
+
+    SECTION("A timed step is given a token stopped by the chain's") {
+
+        asio::io_context context;
+        async::timer_queue queue(context);
+        async::callback<> pending;
+        async::stop_token seen;
+        bool cancelled = false;
+
+        async::series(
+            source.get_token(),
+            async::timeout(queue, [&] (async::stop_token token, async::callback<> next) {
+                seen = token;
+                pending = std::move(next);
+            }, std::chrono::seconds(10)),
+            [] (async::callback<> next) {
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                REQUIRE(err != nullptr);
+                try {
+                    std::rethrow_exception(err);
+                }
+                catch (std::system_error const& e) {
+                    cancelled = e.code() == async::status::cancelled;
+                }
+            }
+        );
+
+        CHECK(!seen.stop_requested());
+        source.request_stop();
+        CHECK(seen.stop_requested());
+        pending(nullptr);
+        context.run();
+        CHECK(cancelled);
+
+    }
+
+}
+
+TEST_CASE_METHOD(AsioFixture<4>, "Concurrent chains stopped midway", "[stop][series]") {
+
+    constexpr int chain_count = 1000;
+
+    struct shared_state {
+        boost::promise<void> promise;
+        std::atomic_int finished{0};
+        std::atomic_int cancelled{0};
+        std::atomic_int last_steps{0};
+    };
+
+    auto state = std::make_shared<shared_state>();
+    auto future = state->promise.get_future();
+    async::stop_source source;
+
+    auto step = [this] (async::stop_token token, async::callback<> next) {
+        asio::post(ios, [token, next = std::move(next)] () {
+            if (!token.stop_requested())
+                std::this_thread::yield();
+            next(nullptr);
+        });
+    };
+
+    for (int i = 0; i < chain_count; i++) {
+        if (i == chain_count / 2)
+            source.request_stop();
+        async::series(
+            async::stop_source(source.get_token()).get_token(),
+            step,
+            step,
+            [state] (async::callback<> next) {
+                state->last_steps++;
+                next(nullptr);
+            },
+            [state] (async::error_type err) {
+                if (err)
+                    state->cancelled++;
+                if (++state->finished == chain_count)
+                    state->promise.set_value();
+            }
+        );
+    }
+
+    future.get();
+
+    CHECK(state->cancelled + state->last_steps == chain_count);
+    CHECK(state->cancelled >= chain_count / 2);
+
+}
+
+TEST_CASE("Non-concurrent async::race", "[race]") {
+
+    async::error_type error = nullptr;
+    int result = 0;
+    int finals = 0;
+    auto final_handler = [&] (async::error_type err, int value) {
+        finals++;
+        error = err;
+        result = value;
+    };
+
+    SECTION("The first success wins and the others are stopped") {
+
+        async::callback<int> late;
+        bool loser_stopped = false;
+        std::unique_ptr<async::stop_callback<std::function<void()>>> on_stop;
+
+        async::race(
+            [&] (async::stop_token token, async::callback<int> next) {
+                on_stop.reset(new async::stop_callback<std::function<void()>>(token, [&] { loser_stopped = true; }));
+                late = std::move(next);
+            },
+            [] (async::callback<int> next) { next(std::make_exception_ptr(expected_exception()), 0); },
+            [] (async::callback<int> next) { next(nullptr, 3); },
+            [] (async::callback<int> next) { next(nullptr, 4); },
+            final_handler
+        );
+
+        CHECK(finals == 1);
+        CHECK(error == nullptr);
+        CHECK(result == 3);
+        CHECK(loser_stopped);
+
+        on_stop.reset();
+        late(nullptr, 1);
+        CHECK(finals == 1);
+        CHECK(result == 3);
+
+    }
+
+    SECTION("The last error once all have failed") {
+
+        async::callback<int> late;
+
+        async::race(
+            [] (async::callback<int> next) { next(std::make_exception_ptr(expected_exception("first")), 0); },
+            [&] (async::callback<int> next) { late = std::move(next); },
+            [] (async::callback<int>) { throw expected_exception("thrown"); },
+            final_handler
+        );
+
+        CHECK(finals == 0);
+        late(std::make_exception_ptr(expected_exception("last")), 0);
+        REQUIRE(finals == 1);
+        REQUIRE(error != nullptr);
+        try {
+            std::rethrow_exception(error);
+        }
+        catch (expected_exception const& e) {
+            CHECK(std::string(e.what()) == "last");
+        }
+
+    }
+
+    SECTION("Without a result") {
+
+        async::race(
+            [] (async::callback<> next) { next(nullptr); },
+            [&] (async::error_type err) { finals++; error = err; }
+        );
+
+        CHECK(finals == 1);
+        CHECK(error == nullptr);
+
+    }
+
+}
+
+TEST_CASE_METHOD(AsioFixture<4>, "Concurrent async::race", "[race]") {
+
+    constexpr int race_count = 1000;
+
+    struct shared_state {
+        boost::promise<void> promise;
+        std::atomic_int sum{0};
+        std::atomic_int finals{0};
+        std::atomic_int cancelled{0};
+        std::atomic_int races_left{race_count};
+    };
+
+    auto state = std::make_shared<shared_state>();
+    auto future = state->promise.get_future();
+
+    // A replica that answers after delay unless the race is won first, when it cancels its timer.
+    auto replica = [this, state] (int value, std::chrono::milliseconds delay) {
+        return [this, state, value, delay] (async::stop_token token, async::callback<int> next) {
+            auto timer = std::make_shared<asio::steady_timer>(ios, delay);
+            auto on_stop = std::make_shared<async::stop_callback<std::function<void()>>>(
+                token, [timer] { asio::post(timer->get_executor(), [timer] { timer->cancel(); }); }
+            );
+            timer->async_wait([state, timer, on_stop, value, next = std::move(next)] (boost::system::error_code const& ec) {
+                if (ec)
+                    state->cancelled++;
+                next(nullptr, value);
+            });
+        };
+    };
+
+    // The replica that answers goes last, so that the others have started by the time it wins.
+    for (int i = 0; i < race_count; i++)
+        async::race(
+            replica(2, std::chrono::seconds(10)),
+            replica(3, std::chrono::seconds(10)),
+            replica(1, std::chrono::milliseconds(0)),
+            [state] (async::error_type err, int value) {
+                state->finals++;
+                if (!err)
+                    state->sum += value;
+                if (--state->races_left == 0)
+                    state->promise.set_value();
+            }
+        );
+
+    future.get();
+
+    CHECK(state->finals == race_count);
+    CHECK(state->sum == race_count);
+    while (state->cancelled < 2 * race_count)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    CHECK(state->finals == race_count);
+
+}
+
+
+
+TEST_CASE("Non-concurrent async::each and async::map", "[each][map]") {
+
+    std::vector<int> items(100);
+    for (int i = 0; i < 100; i++)
+        items[i] = i;
+
+    int last_called = 0;
+    async::error_type error = nullptr;
+
+    SECTION("each") {
+
+        int sum = 0;
+
+        async::each(
+            items,
+            [&] (int item, async::callback<> next) {
+                sum += item;
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                last_called++;
+                error = err;
+            }
+        );
+
+        CHECK(last_called == 1);
+        CHECK(error == nullptr);
+        CHECK(sum == 4950);
+
+    }
+
+    SECTION("each_limit with error") {
+
+        int visited = 0;
+
+        async::each_limit(
+            items,
+            4,
+            [&] (int item, async::callback<> next) {
+                visited++;
+                if (item == 10)
+                    next(std::make_exception_ptr(expected_exception()));
+                else
+                    next(nullptr);
+            },
+            [&] (async::error_type err) {
+                last_called++;
+                error = err;
+            }
+        );
+
+        CHECK(last_called == 1);
+        CHECK(visited == 11);
+        CHECK_THROWS_AS(std::rethrow_exception(error), expected_exception);
+
+    }
+
+    SECTION("map keeps range order") {
+
+        std::vector<async::callback<int>> pending;
+        std::vector<int> results;
+
+        async::map_limit(
+            items,
+            8,
+            [&] (int item, async::callback<int> next) {
+                if (item % 2)
+                    pending.push_back(std::move(next));
+                else
+                    next(nullptr, item * 2);
+            },
+            [&] (async::error_type err, std::vector<int> values) {
+                last_called++;
+                error = err;
+                results = std::move(values);
+            }
+        );
+
+        // Complete the deferred items in reverse; each completion feeds the next item.
+        while (!pending.empty()) {
+            auto next = std::move(pending.back());
+            pending.pop_back();
+            next(nullptr, -1);
+        }
+
+        CHECK(last_called == 1);
+        CHECK(error == nullptr);
+        REQUIRE(results.size() == items.size());
+        for (int i = 0; i < 100; i++)
+            CHECK(results[i] == (i % 2 ? -1 : i * 2));
+
+    }
+
+    SECTION("100k synchronous items") {
+
+        size_t visited = 0;
+
+        async::each_limit(
+            std::vector<int>(100000, 1),
+            3,
+            [&] (int, async::callback<> next) {
+                visited++;
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                last_called++;
+                error = err;
+            }
+        );
+
+        CHECK(last_called == 1);
+        CHECK(visited == 100000);
+
+    }
+
+}
+
+
+
+TEST_CASE_METHOD(AsioFixture<4>, "Concurrent async::map_limit", "[map]") {
+
+    constexpr size_t limit = 5;
+
+    struct shared_state {
+        boost::promise<void> promise;
+        std::atomic_size_t in_flight{0};
+        std::atomic_size_t max_in_flight{0};
+        std::vector<int> results;
+        async::error_type error;
+    };
+
+    auto state = std::make_shared<shared_state>();
+    auto future = state->promise.get_future();
+
+    std::vector<int> items(2000);
+    for (int i = 0; i < 2000; i++)
+        items[i] = i;
+
+    async::map_limit(
+        items,
+        limit,
+        [this, state] (int item, async::callback<int> next) {
+            auto now = ++state->in_flight;
+            auto seen = state->max_in_flight.load();
+            while (now > seen && !state->max_in_flight.compare_exchange_weak(seen, now));
+            asio::post(ios, [state, item, next = std::move(next)] () {
+                state->in_flight--;
+                next(nullptr, item + 1);
+            });
+        },
+        [state] (async::error_type err, std::vector<int> values) {
+            state->error = err;
+            state->results = std::move(values);
+            state->promise.set_value();
+        }
+    );
+
+    future.get();
+
+    CHECK(state->error == nullptr);
+    CHECK(state->max_in_flight <= limit);
+    REQUIRE(state->results.size() == items.size());
+    for (int i = 0; i < 2000; i++)
+        CHECK(state->results[i] == i + 1);
+
+}
+
+
+
+TEST_CASE_METHOD(AsioFixture<4>, "Concurrent async::map over bool", "[map]") {
+
+    constexpr int count = 4000;
+    boost::promise<std::vector<bool>> promise;
+    auto future = promise.get_future();
+
+    std::vector<int> items(count);
+    for (int i = 0; i < count; i++)
+        items[i] = i;
+
+    async::map_limit(
+        items,
+        64,
+        [this] (int item, async::callback<bool> next) {
+            asio::post(ios, [item, next = std::move(next)] () { next(nullptr, item % 3 == 0); });
+        },
+        [&promise] (async::error_type, std::vector<bool> values) {
+            promise.set_value(std::move(values));
+        }
+    );
+
+    auto results = future.get();
+    REQUIRE(results.size() == items.size());
+    int wrong = 0;
+    for (int i = 0; i < count; i++)
+        wrong += results[i] != (i % 3 == 0);
+    CHECK(wrong == 0);
+
+}
+
+
+
+// Collects posted work so that tests can run it step by step.
+class manual_executor
+{
+public:
+    std::vector<std::function<void()>>* queue;
+
+    template<typename Function>
+    void post(Function&& function) {
+        auto shared = std::make_shared<std::decay_t<Function>>(std::forward<Function>(function));
+        queue->push_back([shared] () { (*shared)(); });
+    }
+
+    size_t run_all() {
+        size_t count = 0;
+        while (!queue->empty()) {
+            auto work = std::move(queue->front());
+            queue->erase(queue->begin());
+            work();
+            count++;
+        }
+        return count;
+    }
+};
+
+TEST_CASE("async::series_on dispatch policies", "[series][executor]") {
+
+    std::vector<std::function<void()>> queue;
+    manual_executor executor{ &queue };
+
+    int steps_run = 0;
+    bool last_called = false;
+
+    auto step = [&] (async::callback<> next) {
+        steps_run++;
+        next(nullptr);
+    };
+    auto final_handler = [&] (async::error_type err) {
+        last_called = true;
+        CHECK(err == nullptr);
+    };
+
+    SECTION("Always inline") {
+
+        async::series_on(executor, async::dispatch_policy::always_inline(),
+            step, step, step, step, step, step, final_handler);
+
+        CHECK(steps_run == 6);
+        CHECK(last_called);
+        CHECK(queue.empty());
+
+    }
+
+    SECTION("Always post") {
+
+        async::series_on(executor, async::dispatch_policy::always_post(),
+            step, step, step, step, step, step, final_handler);
+
+        CHECK(steps_run == 1);
+        CHECK_FALSE(last_called);
+
+        CHECK(executor.run_all() == 6);
+        CHECK(steps_run == 6);
+        CHECK(last_called);
+
+    }
+
+    SECTION("Bounded inline depth") {
+
+        async::series_on(executor, async::dispatch_policy::bounded(2),
+            step, step, step, step, step, step, final_handler);
+
+        CHECK(steps_run == 3);
+        CHECK_FALSE(last_called);
+
+        CHECK(executor.run_all() == 2);
+        CHECK(steps_run == 6);
+        CHECK(last_called);
+
+    }
+
+}
+
+
+
+TEST_CASE_METHOD(AsioFixture<2>, "Concurrent async::series_on", "[series][executor]") {
+
+    struct shared_state {
+        boost::promise<void> promise;
+        std::atomic_int on_executor{0};
+        async::error_type error;
+    };
+
+    auto state = std::make_shared<shared_state>();
+    auto future = state->promise.get_future();
+
+    auto step = [this, state] (async::callback<> next) {
+        if (ios.get_executor().running_in_this_thread())
+            state->on_executor++;
+        next(nullptr);
+    };
+
+    async::series_on(ios, async::dispatch_policy::always_post(),
+        step,
+        step,
+        step,
+        [state] (async::error_type err) {
+            state->error = err;
+            state->promise.set_value();
+        }
+    );
+
+    future.get();
+
+    // The first step runs in the caller, the rest through the io_service.
+    CHECK(state->on_executor == 2);
+    CHECK(state->error == nullptr);
+
+}
+
+
+
+TEST_CASE_METHOD(AsioFixture<1>, "Continuations as Asio completion tokens", "[series][asio]") {
+
+    struct shared_state {
+        boost::promise<void> promise;
+        int steps_run = 0;
+        async::error_type error;
+    };
+
+    auto state = std::make_shared<shared_state>();
+    auto future = state->promise.get_future();
+    auto timer = std::make_shared<asio::steady_timer>(ios);
+
+    SECTION("Completes into the next step") {
+
+        async::series(
+            [=] (async::callback<> next) {
+                state->steps_run++;
+                timer->expires_from_now(std::chrono::milliseconds(1));
+                timer->async_wait(std::move(next));
+            },
+            [=] (async::callback<> next) {
+                state->steps_run++;
+                timer->expires_from_now(std::chrono::milliseconds(1));
+                timer->async_wait(std::move(next));
+            },
+            [=] (async::error_type err) {
+                state->error = err;
+                state->promise.set_value();
+            }
+        );
+
+        future.get();
+
+        CHECK(state->steps_run == 2);
+        CHECK(state->error == nullptr);
+
+    }
+
+    SECTION("Error codes become the chain's error") {
+
+        async::series(
+            [=] (async::callback<> next) {
+                state->steps_run++;
+                timer->expires_from_now(std::chrono::hours(1));
+                timer->async_wait(std::move(next));
+                timer->cancel();
+            },
+            [=] (async::callback<> next) {
+                state->steps_run++;
+                next(nullptr);
+            },
+            [=] (async::error_type err) {
+                state->error = err;
+                state->promise.set_value();
+            }
+        );
+
+        future.get();
+
+        CHECK(state->steps_run == 1);
+        CHECK_THROWS_AS(std::rethrow_exception(state->error), boost::system::system_error);
+
+    }
+
+}
+
+
+
+TEST_CASE_METHOD(AsioFixture<1>, "async::async_series with completion tokens", "[series][asio]") {
+
+    auto timer = std::make_shared<asio::steady_timer>(ios);
+    int value = 0;
+
+    auto wait_step = [=] (async::callback<int> next) {
+        timer->expires_from_now(std::chrono::milliseconds(1));
+        timer->async_wait([next = std::move(next)] (boost::system::error_code ec) {
+            next(async::detail::error_from(ec), 42);
+        });
+    };
+    auto store_step = [&] (int x, async::callback<> next) {
+        value = x;
+        next(nullptr);
+    };
+
+    SECTION("Callback") {
+
+        boost::promise<void> promise;
+        auto future = promise.get_future();
+        async::error_type error = std::make_exception_ptr(expected_exception());
+
+        async::async_series(
+            [&] (async::error_type err) {
+                error = err;
+                promise.set_value();
+            },
+            wait_step,
+            store_step
+        );
+
+        future.get();
+
+        CHECK(error == nullptr);
+        CHECK(value == 42);
+
+    }
+
+    SECTION("use_future") {
+
+        std::future<void> future = async::async_series(asio::use_future, wait_step, store_step);
+
+        CHECK_NOTHROW(future.get());
+        CHECK(value == 42);
+
+    }
+
+    SECTION("use_future with error") {
+
+        std::future<void> future = async::async_series(
+            asio::use_future,
+            [] (async::callback<> next) {
+                throw expected_exception("async::async_series");
+            }
+        );
+
+        CHECK_THROWS_AS(future.get(), expected_exception);
+
+    }
+
+}
+
+
+
+TEST_CASE("async::hedging_policy", "[hedged]") {
+
+    async::hedging_policy policy(0.9, std::chrono::milliseconds(5), std::chrono::microseconds(100), 10);
+    CHECK(policy.delay() == std::chrono::milliseconds(5));
+
+    for (int i = 1; i <= 9; i++)
+        policy.record(i * 1000000);
+    CHECK(policy.delay() == std::chrono::milliseconds(5));
+    policy.record(10000000);
+    CHECK(policy.delay() >= std::chrono::milliseconds(9));
+    CHECK(policy.delay() <= std::chrono::microseconds(10125));
+
+    for (int i = 0; i < 100; i++)
+        policy.record(1000);
+    CHECK(policy.delay() == std::chrono::microseconds(100));
+
+}
+
+TEST_CASE_METHOD(AsioFixture<2>, "async::hedged", "[hedged][asio]") {
+
+    struct shared_state {
+        boost::promise<void> promise;
+        std::atomic_int backups{0};
+        std::atomic_bool primary_stopped{false};
+        async::error_type error;
+        int result = 0;
+    };
+
+    auto state = std::make_shared<shared_state>();
+    auto future = state->promise.get_future();
+    auto final_handler = [state] (async::error_type err, int value) {
+        state->error = err;
+        state->result = value;
+        state->promise.set_value();
+    };
+
+    // Answers value after delay, or fails, unless stopped first.
+    auto attempt = [this, state] (int value, std::chrono::milliseconds delay, bool fails = false) {
+        return [this, state, value, delay, fails] (async::stop_token token, async::callback<int> next) {
+            auto timer = std::make_shared<asio::steady_timer>(ios, delay);
+            timer->async_wait([state, timer, token, value, fails, next = std::move(next)] (boost::system::error_code const&) {
+                if (token.stop_requested())
+                    state->primary_stopped = true;
+                if (fails)
+                    next(std::make_exception_ptr(expected_exception(std::to_string(value))), 0);
+                else
+                    next(nullptr, value);
+            });
+        };
+    };
+    auto backup = [state, attempt] (int value, std::chrono::milliseconds delay, bool fails = false) {
+        return [state, inner = attempt(value, delay, fails)] (async::stop_token token, async::callback<int> next) {
+            state->backups++;
+            inner(std::move(token), std::move(next));
+        };
+    };
+
+    SECTION("A fast primary needs no backup") {
+
+        async::hedging_policy policy(0.95, std::chrono::milliseconds(50));
+        async::hedged(policy, async::timer_queue::shared(), attempt(1, std::chrono::milliseconds(0)), backup(2, std::chrono::milliseconds(0)), final_handler);
+        future.get();
+
+        CHECK(state->error == nullptr);
+        CHECK(state->result == 1);
+        CHECK(state->backups == 0);
+        CHECK(policy.observed().read().count == 1);
+
+    }
+
+    SECTION("A slow primary is hedged and stopped") {
+
+        async::hedging_policy policy(0.95, std::chrono::milliseconds(5));
+        async::hedged(policy, async::timer_queue::shared(), attempt(1, std::chrono::milliseconds(200)), backup(2, std::chrono::milliseconds(0)), final_handler);
+        future.get();
+
+        CHECK(state->error == nullptr);
+        CHECK(state->result == 2);
+        CHECK(state->backups == 1);
+        while (!state->primary_stopped)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    }
+
+    SECTION("A failed primary is hedged at once") {
+
+        async::hedging_policy policy(0.95, std::chrono::seconds(10));
+        auto started = std::chrono::steady_clock::now();
+        async::hedged(policy, async::timer_queue::shared(), attempt(1, std::chrono::milliseconds(0), true), backup(2, std::chrono::milliseconds(0)), final_handler);
+        future.get();
+
+        CHECK(std::chrono::steady_clock::now() - started < std::chrono::seconds(5));
+        CHECK(state->error == nullptr);
+        CHECK(state->result == 2);
+
+    }
+
+    SECTION("The last error once both have failed") {
+
+        async::hedging_policy policy(0.95, std::chrono::milliseconds(1));
+        async::hedged(policy, async::timer_queue::shared(), attempt(1, std::chrono::milliseconds(50), true), backup(2, std::chrono::milliseconds(0), true), final_handler);
+        future.get();
+
+        REQUIRE(state->error != nullptr);
+        try {
+            std::rethrow_exception(state->error);
+        }
+        catch (expected_exception const& e) {
+            CHECK(std::string(e.what()) == "1");
+        }
+
+    }
+
+}
+
+
+
+TEST_CASE("async::timer_queue", "[timeout][asio]") {
+
+    using clock = async::timer_queue::clock;
+
+    struct timed : async::timer_queue::node {
+        clock::time_point deadline;
+        clock::time_point expired_at;
+        std::vector<timed*>* order;
+
+        timed(std::vector<timed*>* order) : async::timer_queue::node(&timed::expire), order(order) {}
+
+        static void expire(async::timer_queue::node* n) {
+            auto* self = static_cast<timed*>(n);
+            self->expired_at = clock::now();
+            self->order->push_back(self);
+        }
+    };
+
+    // With 10 us ticks these deadlines sit in the first three levels of the wheel, and
+    // those further out are moved down as they come closer.
+    asio::io_context context;
+    async::timer_queue queue(context, std::chrono::microseconds(10));
+    std::vector<timed*> order;
+    std::vector<std::unique_ptr<timed>> nodes;
+    auto started = clock::now();
+    for (int delay : { 30000, 500, 0, 90000, 1300, 7000, 60, 45000 }) {
+        nodes.push_back(std::make_unique<timed>(&order));
+        nodes.back()->deadline = started + std::chrono::microseconds(delay);
+        queue.schedule(nodes.back().get(), nodes.back()->deadline);
+    }
+    auto cancelled = std::make_unique<timed>(&order);
+    queue.schedule(cancelled.get(), started + std::chrono::microseconds(40000));
+    CHECK(queue.cancel(cancelled.get()));
+    CHECK(!queue.cancel(cancelled.get()));
+    context.run();
+
+    REQUIRE(order.size() == nodes.size());
+    for (auto const& n : nodes) {
+        CHECK(n->expired_at >= n->deadline);
+        CHECK(!queue.cancel(n.get()));
+    }
+    for (size_t i = 1; i < order.size(); i++)
+        CHECK(order[i - 1]->deadline <= order[i]->deadline);
+
+}
+
+TEST_CASE("async::timeout", "[timeout][asio]") {
+
+    SECTION("A step that completes in time passes its result on") {
+        asio::io_context context;
+        async::timer_queue queue(context);
+        async::error_type error;
+        int result = 0;
+
+        async::series(
+            [] (async::callback<int> next) {
+                next(nullptr, 1);
+            },
+            async::timeout(queue, [] (int x, async::callback<int> next) {
+                next(nullptr, x + 1);
+            }, std::chrono::seconds(10)),
+            [&] (int value, async::callback<> next) {
+                result = value;
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                error = err;
+            }
+        );
+        context.run();
+
+        CHECK(error == nullptr);
+        CHECK(result == 2);
+    }
+
+    SECTION("A step that does not is stopped and the chain fails") {
+        asio::io_context context;
+        async::timer_queue queue(context);
+        async::callback<int> pending;
+        async::stop_token token;
+        bool timed_out = false;
+        bool later_step = false;
+
+        async::series(
+            async::timeout(queue, [&] (async::stop_token t, async::callback<int> next) {
+                token = t;
+                pending = std::move(next);
+            }, std::chrono::milliseconds(5)),
+            [&] (int, async::callback<> next) {
+                later_step = true;
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                REQUIRE(err != nullptr);
+                try {
+                    std::rethrow_exception(err);
+                }
+                catch (std::system_error const& e) {
+                    timed_out = e.code() == async::status::timed_out;
+                }
+            }
+        );
+        CHECK(!token.stop_requested());
+        context.run();
+
+        CHECK(timed_out);
+        CHECK(token.stop_requested());
+        CHECK(!later_step);
+
+        // Too late, and ignored.
+        pending(nullptr, 1);
+        CHECK(!later_step);
+    }
+
+    SECTION("Errors of other types") {
+        asio::io_context context;
+        async::timer_queue queue(context);
+        std::error_code code;
+        async::status status = async::status::ok;
+
+        async::series(
+            async::timeout(queue, [] (async::basic_callback<std::error_code>) {}, std::chrono::milliseconds(1)),
+            [&] (std::error_code err) { code = err; }
+        );
+        async::series(
+            async::timeout(queue, [] (async::basic_callback<async::status>) {}, std::chrono::milliseconds(1)),
+            [&] (async::status err) { status = err; }
+        );
+        context.run();
+
+        CHECK(code == async::status::timed_out);
+        CHECK(status == async::status::timed_out);
+    }
+
+    SECTION("Many timeouts share one queue and expire in deadline order") {
+        asio::io_context context;
+        async::timer_queue queue(context);
+        std::vector<int> order;
+        std::vector<async::callback<>> answered;
+
+        for (int i = 0; i < 100; i++) {
+            int delay = (i * 37) % 100;
+            async::series(
+                async::timeout(queue, [&answered, i] (async::callback<> next) {
+                    // Every third one answers at once, and must not time out.
+                    if (i % 3 == 0)
+                        next(nullptr);
+                    else
+                        answered.push_back(std::move(next));
+                }, std::chrono::milliseconds(delay)),
+                [&order, i] (async::error_type err) {
+                    if (err)
+                        order.push_back(i);
+                }
+            );
+        }
+        context.run();
+
+        REQUIRE(order.size() == 66);
+        for (size_t i = 1; i < order.size(); i++)
+            CHECK((order[i - 1] * 37) % 100 <= (order[i] * 37) % 100);
+    }
+
+    SECTION("A step that throws cancels its timeout") {
+        asio::io_context context;
+        async::timer_queue queue(context);
+        bool failed = false;
+
+        async::series(
+            async::timeout(queue, [] (async::callback<>) {
+                throw expected_exception("thrown");
+            }, std::chrono::seconds(10)),
+            [&] (async::error_type err) { failed = err != nullptr; }
+        );
+        context.run();
+
+        CHECK(failed);
+    }
+
+    auto is_timeout = [] (async::error_type err) {
+        if (!err)
+            return false;
+        try {
+            std::rethrow_exception(err);
+        }
+        catch (std::system_error const& e) {
+            return e.code() == async::status::timed_out;
+        }
+        catch (...) {
+            return false;
+        }
+    };
+
+    SECTION("An expiry while the step is still running waits for it to return") {
+        async::timer_thread timers(std::chrono::microseconds(100));
+        async::callback<> pending;
+        std::atomic_bool finished{false};
+        bool finished_during_step = true;
+        int read_after_expiry = 0;
+        int timeouts = 0;
+
+        async::series(
+            async::timeout(timers.queue(), [&, value = std::make_unique<int>(7)] (async::stop_token token, async::callback<> next) {
+                pending = std::move(next);
+                while (!token.stop_requested())
+                    std::this_thread::yield();
+                finished_during_step = finished;
+                read_after_expiry = *value;
+            }, std::chrono::milliseconds(1)),
+            [] (async::callback<> next) {
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                timeouts += is_timeout(err);
+                finished = true;
+            }
+        );
+
+        // Passed on by the invoking thread, as the step returned.
+        CHECK(finished);
+        CHECK(!finished_during_step);
+        CHECK(read_after_expiry == 7);
+        CHECK(timeouts == 1);
+        pending(nullptr);
+        CHECK(timeouts == 1);
+    }
+
+    SECTION("A step that throws after its expiry is ignored") {
+        async::timer_thread timers(std::chrono::microseconds(100));
+        int finals = 0;
+        int timeouts = 0;
+
+        async::series(
+            async::timeout(timers.queue(), [] (async::stop_token token, async::callback<>) {
+                while (!token.stop_requested())
+                    std::this_thread::yield();
+                throw expected_exception("too late");
+            }, std::chrono::milliseconds(1)),
+            [] (async::callback<> next) {
+                next(nullptr);
+            },
+            [&] (async::error_type err) {
+                finals++;
+                timeouts += is_timeout(err);
+            }
+        );
+
+        CHECK(finals == 1);
+        CHECK(timeouts == 1);
+    }
+
+}
+
+TEST_CASE_METHOD(AsioFixture<4>, "Concurrent async::timeout", "[timeout][asio]") {
+
+    const int count = 2000;
+    std::atomic_int completed{0}, slow_timed_out{0};
+    boost::promise<void> promise;
+    auto future = promise.get_future();
+
+    for (int i = 0; i < count; i++) {
+        // Half answer at once, half take ten times their timeout.
+        bool slow = i % 2 == 0;
+        auto delay = std::chrono::milliseconds(slow ? 200 : 0);
+        async::series(
+            async::timeout([this, delay] (async::stop_token, async::callback<> next) {
+                auto timer = std::make_shared<asio::steady_timer>(ios, delay);
+                timer->async_wait([timer, next = std::move(next)] (boost::system::error_code const&) {
+                    next(nullptr);
+                });
+            }, std::chrono::milliseconds(20)),
+            [&, slow] (async::error_type err) {
+                if (err && slow)
+                    slow_timed_out++;
+                if (++completed == count)
+                    promise.set_value();
+            }
+        );
+    }
+    future.get();
+
+    CHECK(slow_timed_out == count / 2);
+
+    // The slow half still has to answer, into frames that must stay alive for it.
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+
+}
+
+TEST_CASE("async::retry_policy", "[retry]") {
+
+    async::retry_policy policy(5, std::chrono::milliseconds(10), std::chrono::milliseconds(50), 2.0);
+
+    CHECK(policy.max_attempts() == 5);
+    CHECK(policy.backoff_ceiling(1) == std::chrono::milliseconds(10));
+    CHECK(policy.backoff_ceiling(2) == std::chrono::milliseconds(20));
+    CHECK(policy.backoff_ceiling(3) == std::chrono::milliseconds(40));
+    CHECK(policy.backoff_ceiling(4) == std::chrono::milliseconds(50));
+    CHECK(policy.backoff_ceiling(40) == std::chrono::milliseconds(50));
+
+    CHECK(policy.should_retry(async::error_type(), 4));
+    CHECK(!policy.should_retry(async::error_type(), 5));
+
+    std::chrono::nanoseconds lowest = std::chrono::milliseconds(40), highest(0);
+    for (int i = 0; i < 1000; i++) {
+        auto delay = policy.backoff(3);
+        lowest = std::min(lowest, delay);
+        highest = std::max(highest, delay);
+    }
+    CHECK(lowest >= std::chrono::nanoseconds(0));
+    CHECK(lowest < std::chrono::milliseconds(4));
+    CHECK(highest <= std::chrono::milliseconds(40));
+    CHECK(highest > std::chrono::milliseconds(36));
+
+    async::retry_policy only_io(3, std::chrono::milliseconds(1), std::chrono::milliseconds(1), 2.0,
+        [] (std::error_code const& error) { return error == std::errc::io_error; });
+    CHECK(only_io.should_retry(std::make_error_code(std::errc::io_error), 1));
+    CHECK(!only_io.should_retry(std::make_error_code(std::errc::invalid_argument), 1));
+
+}
+
+TEST_CASE("async::retry_budget", "[retry]") {
+
+    async::retry_budget budget(0.5, 2);
+
+    CHECK(budget.balance() == 2);
+    CHECK(budget.try_withdraw());
+    CHECK(budget.try_withdraw());
+    CHECK(!budget.try_withdraw());
+
+    budget.deposit();
+    CHECK(budget.balance() == 0.5);
+    CHECK(!budget.try_withdraw());
+    budget.deposit();
+    CHECK(budget.try_withdraw());
+
+    for (int i = 0; i < 10; i++)
+        budget.deposit();
+    CHECK(budget.balance() == 2);
+
+    SECTION("Retry policies draw from it") {
+
+        async::retry_policy policy(10);
+        policy.draw_from(budget);
+        CHECK(policy.should_retry(async::error_type(), 1));
+        CHECK(policy.should_retry(async::error_type(), 1));
+        CHECK(!policy.should_retry(async::error_type(), 1));
+        policy.succeeded();
+        policy.succeeded();
+        CHECK(policy.should_retry(async::error_type(), 1));
+
+    }
+
+}
+
+TEST_CASE("Concurrent async::retry_budget", "[retry]") {
+
+    constexpr int thread_count = 4;
+    constexpr int per_thread = 100000;
+    async::retry_budget budget(0.25, 10);
+    std::atomic_int withdrawn{0};
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < thread_count; t++)
+        threads.emplace_back([&] {
+            for (int i = 0; i < per_thread; i++) {
+                if (i % 2 == 0)
+                    budget.deposit();
+                else if (budget.try_withdraw())
+                    withdrawn++;
+            }
+        });
+    for (auto& thread : threads)
+        thread.join();
+
+    // Never more than it started with plus a quarter a deposit.
+    CHECK(withdrawn <= 10 + thread_count * per_thread / 2 / 4);
+    CHECK(withdrawn >= thread_count * per_thread / 2 / 4 - 10 - thread_count);
+    CHECK(budget.balance() >= 0);
+
+}
+
+TEST_CASE("async::retry", "[retry][asio]") {
+
+    asio::io_context context;
+    async::timer_queue queue(context, std::chrono::microseconds(100));
+    async::retry_policy policy(4, std::chrono::microseconds(200), std::chrono::milliseconds(2));
+    int attempts = 0;
+
+    SECTION("A step that fails and then succeeds passes its result on") {
+
+        async::error_type error = std::make_exception_ptr(expected_exception("unset"));
+        int result = 0;
+
+        async::retry(policy, queue,
+            [&] (async::callback<int> next) {
+                if (++attempts < 3)
+                    next(std::make_exception_ptr(expected_exception("flaky")), 0);
+                else
+                    next(nullptr, 42);
+            },
+            [&] (async::error_type err, int value) {
+                error = err;
+                result = value;
+            }
+        );
+        context.run();
+
+        CHECK(error == nullptr);
+        CHECK(result == 42);
+        CHECK(attempts == 3);
+
+    }
+
+    SECTION("A step that keeps failing gives up with its last error") {
+
+        async::error_type error;
+
+        async::retry(policy, queue,
+            [&] (async::callback<> next) {
+                attempts++;
+                next(std::make_exception_ptr(expected_exception("attempt " + std::to_string(attempts))));
+            },
+            [&] (async::error_type err) {
+                error = err;
+            }
+        );
+        context.run();
+
+        CHECK(attempts == 4);
+        REQUIRE(error != nullptr);
+        CHECK_THROWS_WITH(std::rethrow_exception(error), "attempt 4");
+
+    }
+
+    SECTION("Errors the predicate rejects are not retried") {
+
+        async::retry_policy only_io(4, std::chrono::microseconds(200), std::chrono::milliseconds(2), 2.0,
+            [] (std::error_code const& error) { return error == std::errc::io_error; });
+        std::error_code code;
+
+        async::retry(only_io, queue,
+            [&] (async::basic_callback<std::error_code, std::string, int> next) {
+                attempts++;
+                next(std::make_error_code(attempts == 1 ? std::errc::io_error : std::errc::invalid_argument), "", 0);
+            },
+            [&] (std::error_code err, std::tuple<std::string, int>) {
+                code = err;
+            }
+        );
+        context.run();
+
+        CHECK(attempts == 2);
+        CHECK(code == std::errc::invalid_argument);
+
+    }
+
+    SECTION("Without a token from its budget, a step is not retried") {
+
+        async::retry_budget budget(0.5, 1);
+        policy.draw_from(budget);
+        int failures = 0;
+
+        auto flaky = [&] (async::callback<> next) {
+            attempts++;
+            next(attempts % 2 ? std::make_exception_ptr(expected_exception("retry")) : nullptr);
+        };
+        auto final = [&] (async::error_type err) {
+            if (err)
+                failures++;
+        };
+
+        // The first retry takes the only token, and the success after it puts back half.
+        async::retry(policy, queue, flaky, final);
+        context.run();
+        CHECK(attempts == 2);
+        CHECK(failures == 0);
+
+        context.restart();
+        async::retry(policy, queue, flaky, final);
+        context.run();
+        CHECK(attempts == 3);
+        CHECK(failures == 1);
+
+    }
+
+    SECTION("A step that throws is retried") {
+
+        async::status result = async::status::failed;
+
+        async::retry(policy, queue,
+            [&] (async::basic_callback<async::status> next) {
+                if (++attempts == 1)
+                    throw expected_exception("retry");
+                next(async::status::ok);
+            },
+            [&] (async::status err) {
+                result = err;
+            }
+        );
+        context.run();
+
+        CHECK(attempts == 2);
+        CHECK(result == async::status::ok);
+
+    }
+
+}
+
+TEST_CASE_METHOD(AsioFixture<4>, "Concurrent async::retry", "[retry][asio]") {
+
+    const int count = 1000;
+    async::retry_policy policy(3, std::chrono::microseconds(100), std::chrono::milliseconds(1));
+    std::atomic_int completed{0}, succeeded{0}, attempts{0};
+    boost::promise<void> promise;
+    auto future = promise.get_future();
+
+    for (int i = 0; i < count; i++) {
+        auto failures = std::make_shared<int>(i % 4);
+        async::retry(policy,
+            [this, failures, &attempts] (async::callback<> next) {
+                attempts++;
+                bool fail = (*failures)-- > 0;
+                asio::post(ios, [fail, next = std::move(next)] {
+                    next(fail ? std::make_exception_ptr(expected_exception("retry")) : nullptr);
+                });
+            },
+            [&] (async::error_type err) {
+                if (!err)
+                    succeeded++;
+                if (++completed == count)
+                    promise.set_value();
+            }
+        );
+    }
+    future.get();
+
+    // A quarter fail all three attempts.
+    CHECK(succeeded == count * 3 / 4);
+    CHECK(attempts == count / 4 * (1 + 2 + 3 + 3));
+
+}
+
+
+#ifdef ASYNC_ALLOCATION_STATS
+
+TEST_CASE("Allocation stats", "[stats]") {
+
+    SECTION("async::series") {
+
+        auto before = async::this_thread_allocation_stats();
+        async::series(
+            [] (async::callback<int> next) { next(nullptr, 1); },
+            [] (int, async::callback<> next) { next(nullptr); },
+            [] (async::error_type) {}
+        );
+        auto stats = async::this_thread_allocation_stats() - before;
+
+        CHECK(stats.chains == 1);
+        CHECK(stats.frames == 1);
+        CHECK(stats.frame_bytes % 64 == 0);
+        CHECK(stats.frame_bytes > 0);
+        CHECK(stats.continuations == 2);
+        CHECK(stats.error_objects == 0);
+
+    }
+
+    SECTION("Pooled frames") {
+
+        auto run = [] {
+            async::simple_series([] (auto next) { next(nullptr); }, [] (async::error_type) {});
+        };
+        run();
+        auto before = async::this_thread_allocation_stats();
+        run();
+        auto stats = async::this_thread_allocation_stats() - before;
+
+        CHECK(stats.chains == 1);
+        CHECK(stats.frames == 1);
+        CHECK(stats.heap_allocations == 0);
+        CHECK(stats.heap_bytes == 0);
+        CHECK(stats.continuations == 0);
+
+    }
+
+    SECTION("Thrown exceptions") {
+
+        auto before = async::this_thread_allocation_stats();
+        async::simple_series(
+            [] (auto next) { throw expected_exception("simple_series"); },
+            [] (async::error_type) {}
+        );
+        auto stats = async::this_thread_allocation_stats() - before;
+
+        CHECK(stats.chains == 1);
+        CHECK(stats.error_objects == 1);
+
+    }
+
+    SECTION("async::retry") {
+
+        asio::io_context context;
+        async::timer_queue queue(context);
+        async::retry_policy policy(3, std::chrono::microseconds(10), std::chrono::microseconds(10));
+        auto before = async::this_thread_allocation_stats();
+        async::retry(policy, queue,
+            [] (async::basic_callback<std::error_code> next) { next(std::make_error_code(std::errc::io_error)); },
+            [] (std::error_code) {}
+        );
+        context.run();
+        auto stats = async::this_thread_allocation_stats() - before;
+
+        CHECK(stats.frames == 1);
+        CHECK(stats.continuations == 3);
+
+    }
+
+    SECTION("async::timeout whose step drops its callback") {
+
+        asio::io_context context;
+        async::timer_queue queue(context);
+        bool timed_out = false;
+        auto before = async::this_thread_allocation_stats();
+        async::series(
+            async::timeout(queue, [] (async::basic_callback<std::error_code>) {}, std::chrono::milliseconds(1)),
+            [&] (std::error_code err) { timed_out = err == async::status::timed_out; }
+        );
+        context.run();
+        auto stats = async::this_thread_allocation_stats() - before;
+
+        CHECK(timed_out);
+        CHECK(stats.frames == 2);
+        CHECK(stats.frame_frees == stats.frames);
+
+    }
+
+    SECTION("Frames cached by a thread that allocated none are freed at its exit") {
+
+        std::vector<async::callback<>> pending(32);
+        for (auto& next : pending)
+            async::series(
+                [&next] (async::callback<> n) { next = std::move(n); },
+                [] (async::error_type) {}
+            );
+        auto before = async::total_allocation_stats();
+        std::thread([&] {
+            for (auto& next : pending)
+                next(nullptr);
+        }).join();
+        auto stats = async::total_allocation_stats() - before;
+
+        CHECK(stats.frames == 0);
+        CHECK(stats.heap_frees == 32);
+
+    }
+
+    SECTION("Threads that have exited") {
+
+        auto before = async::total_allocation_stats();
+        std::thread([] {
+            async::simple_series([] (auto next) { next(nullptr); }, [] (async::error_type) {});
+        }).join();
+        auto stats = async::total_allocation_stats() - before;
+
+        CHECK(stats.chains == 1);
+        CHECK(stats.frames == 1);
+        CHECK(stats.heap_allocations == 1);
+
+    }
+
+}
+
+#endif
+
+
+
+#ifdef ASYNC_TRACING
+
+TEST_CASE("Step tracing", "[trace]") {
+
+    auto records_after = [] (std::uint64_t chain) {
+        std::vector<async::trace_record> records;
+        for (auto const& record : async::trace_records())
+            if (record.chain > chain)
+                records.push_back(record);
+        return records;
+    };
+
+    std::uint64_t last_chain = 0;
+    for (auto const& record : async::trace_records())
+        last_chain = std::max(last_chain, record.chain);
+
+    SECTION("Synchronous steps") {
+
+        async::series(
+            [] (async::callback<int> next) { next(nullptr, 1); },
+            [] (int x, async::callback<int> next) { next(nullptr, x + 1); },
+            [] (int, async::callback<> next) { next(nullptr); },
+            [] (async::error_type) {}
+        );
+
+        auto records = records_after(last_chain);
+        REQUIRE(records.size() == 3);
+        for (std::uint32_t i = 0; i < 3; i++) {
+            CHECK(records[i].chain == records[0].chain);
+            CHECK(records[i].step == i);
+            CHECK(records[i].thread == records[0].thread);
+            CHECK(records[i].start <= records[i].end);
+        }
+
+    }
+
+    SECTION("A step completing on another thread") {
+
+        std::thread worker;
+        async::simple_series(
+            [] (auto next) { next(nullptr); },
+            [&] (auto next) { worker = std::thread([next] { next(nullptr); }); },
+            [] (auto next) { next(nullptr); },
+            [] (async::error_type) {}
+        );
+        worker.join();
+
+        auto records = records_after(last_chain);
+        REQUIRE(records.size() == 3);
+        CHECK(records[1].step == 1);
+        CHECK(records[1].thread == records[0].thread);
+        CHECK(records[2].thread != records[0].thread);
+
+    }
+
+    SECTION("Chrome trace events") {
+
+        async::simple_series([] (auto next) { next(nullptr); }, [] (async::error_type) {});
+
+        std::ostringstream out;
+        async::write_chrome_trace(out);
+        std::string trace = out.str();
+
+        CHECK(trace.find("{\"traceEvents\":[") == 0);
+        CHECK(trace.find("\"ph\":\"X\"") != std::string::npos);
+        CHECK(trace.find("\"chain\":" + std::to_string(last_chain + 1)) != std::string::npos);
+
+    }
+
+}
+
+#endif
+
+
+
+TEST_CASE("async::latency_histogram", "[metrics]") {
+
+    async::latency_histogram histogram;
+    for (std::uint64_t value = 1; value <= 1000; value++)
+        histogram.record(value * 1000);
+    auto snapshot = histogram.read();
+
+    CHECK(snapshot.count == 1000);
+    CHECK(snapshot.sum == 500500000);
+    for (double q : { 0.5, 0.9, 0.99, 0.999 }) {
+        double exact = q * 1000000;
+        double reported = double(snapshot.value_at_quantile(q));
+        CHECK(reported >= exact);
+        CHECK(reported <= exact * 1.125);
+    }
+
+    SECTION("Merges the shards of every thread") {
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 16; i++)
+            threads.emplace_back([&] {
+                for (int j = 0; j < 1000; j++)
+                    histogram.record(5);
+            });
+        for (auto& thread : threads)
+            thread.join();
+
+        snapshot = histogram.read();
+        CHECK(snapshot.count == 17000);
+        CHECK(snapshot.counts[5] == 16000);
+
+    }
+
+}
+
+TEST_CASE("async::named_pipeline", "[metrics][pipeline]") {
+
+    auto pipeline = async::make_named_pipeline(
+        "test \"pipeline\"",
+        [] (int x, async::callback<int> next) { next(nullptr, x + 1); },
+        [] (int x, async::callback<> next) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(x));
+            next(nullptr);
+        }
+    );
+
+    for (int i = 0; i < 10; i++)
+        pipeline.run(1, [] (async::error_type) {});
+
+    auto const& metrics = pipeline.metrics();
+    REQUIRE(metrics.step_count() == 2);
+    auto total = metrics.total().read();
+    auto sleeping = metrics.step(1).read();
+    CHECK(total.count == 10);
+    CHECK(metrics.step(0).read().count == 10);
+    CHECK(sleeping.count == 10);
+    CHECK(sleeping.value_at_quantile(0.5) >= 2000000);
+    CHECK(total.value_at_quantile(0.5) >= sleeping.value_at_quantile(0.5));
+
+    SECTION("A step completing on another thread") {
+
+        std::thread worker;
+        auto threaded = async::make_named_pipeline(
+            "threaded",
+            [&] (async::callback<> next) {
+                worker = std::thread([next = std::move(next)] {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    next(nullptr);
+                });
+            }
+        );
+        threaded.run([] (async::error_type) {});
+        worker.join();
+
+        CHECK(threaded.metrics().step(0).read().value_at_quantile(1) >= 1000000);
+        CHECK(threaded.metrics().total().read().count == 1);
+
+    }
+
+    SECTION("A run with a token") {
+
+        async::stop_source source;
+        async::stop_token seen;
+        int result = 0;
+        async::error_type error;
+        auto stoppable = async::make_named_pipeline(
+            "stoppable",
+            [&] (int x, async::stop_token token, async::callback<int> next) {
+                seen = token;
+                next(nullptr, x * 2);
+            },
+            [&] (int x, async::callback<> next) {
+                result = x;
+                next(nullptr);
+            }
+        );
+
+        stoppable.run(source.get_token(), 4, [&] (async::error_type err) { error = err; });
+        CHECK(error == nullptr);
+        CHECK(result == 8);
+        CHECK(stoppable.metrics().step(1).read().count == 1);
+        CHECK(seen.stop_possible());
+        source.request_stop();
+        CHECK(seen.stop_requested());
+
+        bool cancelled = false;
+        stoppable.run(source.get_token(), 5, [&] (async::error_type err) {
+            REQUIRE(err != nullptr);
+            try {
+                std::rethrow_exception(err);
+            }
+            catch (std::system_error const& e) {
+                cancelled = e.code() == async::status::cancelled;
+            }
+        });
+        CHECK(cancelled);
+        CHECK(result == 8);
+
+    }
+
+    SECTION("Prometheus text format") {
+
+        std::ostringstream out;
+        async::write_metrics(out);
+        std::string text = out.str();
+
+        CHECK(text.find("# TYPE async_pipeline_duration_seconds summary\n") != std::string::npos);
+        CHECK(text.find("async_pipeline_duration_seconds_count{pipeline=\"test \\\"pipeline\\\"\"} 10\n") != std::string::npos);
+        CHECK(text.find("async_pipeline_step_duration_seconds{pipeline=\"test \\\"pipeline\\\"\",step=\"1\",quantile=\"0.99\"} ") != std::string::npos);
+
+    }
+
+    SECTION("Writing to a file") {
+
+        auto directory = std::filesystem::temp_directory_path() / "async_test_metrics";
+        std::filesystem::remove_all(directory);
+        std::filesystem::create_directory(directory);
+
+        std::string path = (directory / "async.prom").string();
+        CHECK(async::write_metrics(path));
+        CHECK(std::filesystem::file_size(path) > 0);
+        CHECK(!std::filesystem::exists(path + ".tmp"));
+
+        // A directory in the way fails the rename, which must not leave the temporary behind.
+        std::string blocked = (directory / "blocked").string();
+        std::filesystem::create_directories(directory / "blocked" / "entry");
+        CHECK(!async::write_metrics(blocked));
+        CHECK(!std::filesystem::exists(blocked + ".tmp"));
+
+        std::filesystem::remove_all(directory);
+
+    }
+
+}
+
+
+
+#ifdef ASYNC_CHAIN_REGISTRY
+
+TEST_CASE("Outstanding chain registry", "[registry]") {
+
+    auto find_chain = [] (std::size_t step_count) {
+        std::vector<async::outstanding_chain> found;
+        for (auto const& chain : async::outstanding_chains())
+            if (chain.step_count == step_count)
+                found.push_back(chain);
+        return found;
+    };
+
+    SECTION("Lists chains until they finish") {
+
+        async::callback<> held;
+        async::series(
+            [] (async::callback<> next) { next(nullptr); },
+            [&] (async::callback<> next) { held = std::move(next); },
+            [] (async::callback<> next) { next(nullptr); },
+            [] (async::callback<> next) { next(nullptr); },
+            [] (async::callback<> next) { next(nullptr); },
+            [] (async::callback<> next) { next(nullptr); },
+            [] (async::callback<> next) { next(nullptr); },
+            [] (async::error_type) {}
+        );
+
+        auto chains = find_chain(7);
+        REQUIRE(chains.size() == 1);
+        CHECK(chains[0].step == 1);
+        CHECK(chains[0].id > 0);
+
+        held(nullptr);
+        CHECK(find_chain(7).empty());
+
+    }
+
+    SECTION("The watchdog reports a stuck step once") {
+
+        std::mutex mutex;
+        std::vector<async::outstanding_chain> reports;
+        async::callback<> held;
+        {
+            async::chain_watchdog watchdog(
+                std::chrono::milliseconds(20), std::chrono::milliseconds(5),
+                [&] (async::outstanding_chain const& chain) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    reports.push_back(chain);
+                }
+            );
+            async::simple_series(
+                [] (auto next) { next(nullptr); },
+                [] (auto next) { next(nullptr); },
+                [] (auto next) { next(nullptr); },
+                [] (auto next) { next(nullptr); },
+                [] (auto next) { next(nullptr); },
+                [] (auto next) { next(nullptr); },
+                [] (auto next) { next(nullptr); },
+                [] (auto next) { next(nullptr); },
+                [&] (auto next) { held = next; },
+                [] (async::error_type) {}
+            );
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+
+        std::vector<async::outstanding_chain> stuck;
+        for (auto const& chain : reports)
+            if (chain.step_count == 9)
+                stuck.push_back(chain);
+        REQUIRE(stuck.size() == 1);
+        CHECK(stuck[0].step == 8);
+        CHECK(stuck[0].at_step >= std::chrono::milliseconds(20));
+        CHECK(stuck[0].age >= stuck[0].at_step);
+
+        held(nullptr);
+        CHECK(find_chain(9).empty());
+
+    }
+
+}
+
+#endif
@@ -0,0 +1,102 @@
+
+// Built with -fno-exceptions: errors reach the final handler only through the error channel.
+
+#include <cstdio>
+#include <memory>
+#include <system_error>
+#include <vector>
+
+#include "../include/async.hpp"
+#include "../include/async_task.hpp"
+
+#ifndef ASYNC_NO_EXCEPTIONS
+#error "this file must be built without exceptions"
+#endif
+
+
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (false)
+
+
+
+void series_with_status() {
+    async::status error = async::status::ok;
+    int result = 0;
+    async::series(
+        [] (async::basic_callback<async::status, std::unique_ptr<int>> next) noexcept {
+            next(async::status::ok, std::make_unique<int>(1));
+        },
+        [&] (std::unique_ptr<int> x, async::basic_callback<async::status> next) noexcept {
+            result = *x;
+            next(async::status::timed_out);
+        },
+        [&] (async::basic_callback<async::status> next) noexcept {
+            result = -1;
+            next(async::status::ok);
+        },
+        [&] (async::status err) {
+            error = err;
+        }
+    );
+    CHECK(result == 1);
+    CHECK(error == async::status::timed_out);
+}
+
+void simple_series_with_error_code() {
+    std::error_code error;
+    int calls = 0;
+    async::simple_series(
+        [&] (auto next) { calls++; next(std::error_code()); },
+        [&] (auto next) { calls++; next(std::make_error_code(std::errc::io_error)); },
+        [&] (std::error_code err) { error = err; }
+    );
+    CHECK(calls == 2);
+    CHECK(error == std::errc::io_error);
+}
+
+void map_with_exception_ptr() {
+    std::vector<int> items = { 1, 2, 3 };
+    std::vector<int> results;
+    async::map(
+        items,
+        [] (int item, async::callback<int> next) { next(nullptr, item * 2); },
+        [&] (async::error_type error, std::vector<int> values) {
+            CHECK(error == nullptr);
+            results = std::move(values);
+        }
+    );
+    CHECK((results == std::vector<int>{ 2, 4, 6 }));
+}
+
+async::task<int> twice(int x) {
+    co_return x * 2;
+}
+
+void task_without_exceptions() {
+    int result = 0;
+    async::start(twice(21), [&] (async::error_type error, int value) {
+        CHECK(error == nullptr);
+        result = value;
+    });
+    CHECK(result == 42);
+}
+
+
+
+int main() {
+    series_with_status();
+    simple_series_with_error_code();
+    map_with_exception_ptr();
+    task_without_exceptions();
+    if (failures == 0)
+        std::printf("All checks passed without exceptions\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,259 @@
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <tuple>
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+
+// Use boost's promise and future because the std:: versions currently segfault.
+#define BOOST_THREAD_PROVIDES_FUTURE
+#include <boost/thread/future.hpp>
+
+#include "catch.hpp"
+
+#include "../include/async.hpp"
+#include "../include/async_asio.hpp"
+#include "../include/async_task.hpp"
+
+#include "asio_fixture.hpp"
+
+
+
+namespace {
+
+    class task_exception : public std::exception {
+    public:
+        virtual const char* what() const noexcept override { return "task_exception"; }
+    };
+
+    async::task<int> add_one(int x) {
+        co_return x + 1;
+    }
+
+    async::task<int> add_two(int x) {
+        int y = co_await add_one(x);
+        co_return co_await add_one(y);
+    }
+
+    async::task<> throw_task() {
+        throw task_exception();
+        co_return;
+    }
+
+    async::task<std::string> throw_string_task() {
+        throw task_exception();
+        co_return "unreachable";
+    }
+
+    std::atomic_int allocations{0};
+    std::atomic_int deallocations{0};
+
+    void* counting_allocate(std::size_t size) {
+        allocations++;
+        return std::malloc(size);
+    }
+
+    void counting_deallocate(void* p, std::size_t) {
+        deallocations++;
+        std::free(p);
+    }
+
+}
+
+
+
+TEST_CASE("async::task", "[task]") {
+
+    async::error_type error = nullptr;
+    int value = 0;
+
+    SECTION("Nested awaits") {
+
+        async::start(add_two(40), [&] (async::error_type err, int x) {
+            error = err;
+            value = x;
+        });
+
+        CHECK(error == nullptr);
+        CHECK(value == 42);
+
+    }
+
+    SECTION("Exceptions become errors") {
+
+        async::start(throw_task(), [&] (async::error_type err) {
+            error = err;
+        });
+
+        CHECK_THROWS_AS(std::rethrow_exception(error), task_exception);
+
+    }
+
+    SECTION("A failed task<T> passes a default-constructed T") {
+
+        std::string result = "unset";
+        async::start(throw_string_task(), [&] (async::error_type err, std::string s) {
+            error = err;
+            result = std::move(s);
+        });
+
+        CHECK_THROWS_AS(std::rethrow_exception(error), task_exception);
+        CHECK(result.empty());
+
+    }
+
+    SECTION("Pluggable frame allocator") {
+
+        static constexpr async::task_allocator counting = { &counting_allocate, &counting_deallocate };
+        async::set_task_allocator(counting);
+        async::start(add_two(1), [&] (async::error_type err, int x) {
+            value = x;
+        });
+        async::set_task_allocator(async::pooled_task_allocator());
+
+        CHECK(value == 3);
+        CHECK(allocations > 0);
+        CHECK(allocations == deallocations);
+
+    }
+
+}
+
+
+
+TEST_CASE("async::from_callback", "[task]") {
+
+    async::error_type error = nullptr;
+
+    SECTION("Synchronous steps") {
+
+        std::tuple<int, std::string> result;
+
+        auto coroutine = [&] () -> async::task<> {
+            co_await async::from_callback([] (async::callback<> next) { next(nullptr); });
+            int x = co_await async::from_callback([] (async::callback<int> next) { next(nullptr, 1); });
+            auto [y, s] = co_await async::from_callback([x] (async::callback<int, std::string> next) {
+                next(nullptr, x + 1, "two");
+            });
+            result = std::make_tuple(y, s);
+        };
+
+        async::start(coroutine(), [&] (async::error_type err) { error = err; });
+
+        CHECK(error == nullptr);
+        CHECK(std::get<0>(result) == 2);
+        CHECK(std::get<1>(result) == "two");
+
+    }
+
+    SECTION("Errors are rethrown") {
+
+        bool caught = false;
+
+        auto coroutine = [&] () -> async::task<> {
+            try {
+                co_await async::from_callback([] (async::callback<> next) {
+                    next(std::make_exception_ptr(task_exception()));
+                });
+            }
+            catch (task_exception const&) {
+                caught = true;
+            }
+        };
+
+        async::start(coroutine(), [&] (async::error_type err) { error = err; });
+
+        CHECK(caught);
+        CHECK(error == nullptr);
+
+    }
+
+}
+
+
+
+TEST_CASE("async::task_step inside async::series", "[task][series]") {
+
+    async::error_type error = nullptr;
+    int a = 0, b = 0;
+
+    async::series(
+        [&] (async::callback<int> next) {
+            next(nullptr, 1);
+        },
+        async::task_step([] (int x) -> async::task<int> {
+            co_return co_await add_two(x);
+        }),
+        [&] (int x, async::callback<> next) {
+            a = x;
+            next(nullptr);
+        },
+        async::task_step([&] () -> async::task<> {
+            b = co_await add_one(10);
+            co_return;
+        }),
+        [&] (async::error_type err) {
+            error = err;
+        }
+    );
+
+    CHECK(error == nullptr);
+    CHECK(a == 3);
+    CHECK(b == 11);
+
+}
+
+
+
+TEST_CASE_METHOD(AsioFixture<2>, "Concurrent async::from_callback", "[task]") {
+
+    boost::promise<void> promise;
+    auto future = promise.get_future();
+    int sum = 0;
+    async::error_type error = nullptr;
+
+    auto coroutine = [&] () -> async::task<> {
+        for (int i = 0; i < 100; i++)
+            sum += co_await async::from_callback([&, i] (async::callback<int> next) {
+                asio::post(ios, [next = std::move(next), i] () { next(nullptr, i); });
+            });
+    };
+
+    async::start(coroutine(), [&] (async::error_type err) {
+        error = err;
+        promise.set_value();
+    });
+
+    future.get();
+
+    CHECK(error == nullptr);
+    CHECK(sum == 4950);
+
+}
+
+
+
+TEST_CASE_METHOD(AsioFixture<1>, "async::async_series with use_awaitable", "[task][asio]") {
+
+    boost::promise<int> promise;
+    auto future = promise.get_future();
+
+    asio::co_spawn(ios, [&] () -> asio::awaitable<void> {
+        int value = 0;
+        co_await async::async_series(
+            asio::use_awaitable,
+            [] (async::callback<int> next) { next(nullptr, 5); },
+            [&] (int x, async::callback<> next) { value = x; next(nullptr); }
+        );
+        promise.set_value(value);
+    }, asio::detached);
+
+    CHECK(future.get() == 5);
+
+}